@@ -10,7 +10,32 @@
 #include <algorithm>
 #include <ctime>
 #include <curl/curl.h>
-#include <regex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <list>
+#include <string_view>
+#include <set>
+#include <array>
+#include <tuple>
+#include <memory>
+#include <chrono>
+#include <optional>
+#include <queue>
+#include <openssl/evp.h>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 struct TreeEntry {
     std::string mode;
@@ -18,13 +43,6 @@ struct TreeEntry {
     std::string hash; // 20 bytes as hex string
 };
 
-struct PackObject {
-    std::string hash;
-    std::string data;
-    int type;
-    size_t size;
-};
-
 struct HTTPResponse {
     std::string body;
     int status_code;
@@ -105,6 +123,89 @@ std::string computeSHA1(const std::string& data) {
     return ss.str();
 }
 
+// Looks the object up in .git/objects/pack; defined with the pack reader below
+bool readPackedObject(const std::string& hash, std::string& objectData);
+
+// Fetches an object a partial clone's promisor remote promised, returning
+// false when it is simply missing; defined with the protocol client below
+bool fetchPromisedObject(const std::string& hash);
+
+// Writes the .promisor marker for a pack whose objects came from the promisor
+// remote; defined with the partial clone support below
+void markPromisorPack(const std::string& checksum);
+
+// Tells an object a partial clone's filter omitted from one that is missing;
+// defined with the partial clone support below
+enum class ObjectState { Present, Promised, Missing };
+ObjectState objectState(const std::string& hash);
+
+// Object directories listed in objectDir's info/alternates, one per line.
+// Relative entries are relative to objectDir.
+std::vector<std::filesystem::path> readAlternatesFile(const std::filesystem::path& objectDir) {
+    std::vector<std::filesystem::path> dirs;
+    std::ifstream file(objectDir / "info" / "alternates");
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::filesystem::path dir = line;
+        dirs.push_back((dir.is_absolute() ? dir : objectDir / dir).lexically_normal());
+    }
+    return dirs;
+}
+
+// Every alternate object directory of the repository, following each
+// alternate's own alternates depth first as git does. A directory already
+// seen (including our own) is skipped, so a cycle ends the chain instead of
+// looping, and like git a chain more than five deep is cut off.
+std::vector<std::filesystem::path> readAlternates() {
+    std::vector<std::filesystem::path> result;
+    std::set<std::filesystem::path> seen;
+    std::error_code error;
+    seen.insert(std::filesystem::weakly_canonical(".git/objects", error));
+    std::function<void(const std::filesystem::path&, int)> visit = [&](const std::filesystem::path& objectDir, int depth) {
+        for (const auto& dir : readAlternatesFile(objectDir)) {
+            std::filesystem::path canonical = std::filesystem::canonical(dir, error);
+            if (error) {
+                std::cerr << "warning: object directory " << dir.string() << " does not exist" << std::endl;
+                continue;
+            }
+            if (!seen.insert(canonical).second) {
+                continue;
+            }
+            if (depth > 5) {
+                std::cerr << "warning: ignoring alternate object store " << dir.string() << ", nesting too deep" << std::endl;
+                continue;
+            }
+            result.push_back(canonical);
+            visit(canonical, depth + 1);
+        }
+    };
+    visit(".git/objects", 1);
+    return result;
+}
+
+// Alternates of the current repository, read on first use
+std::vector<std::filesystem::path>& alternateObjectDirs() {
+    static std::vector<std::filesystem::path> dirs = readAlternates();
+    return dirs;
+}
+
+// Path of the object's loose file in an alternate, or an empty string
+std::string alternateLoosePath(const std::string& hash) {
+    for (const auto& dir : alternateObjectDirs()) {
+        std::filesystem::path path = dir / hash.substr(0, 2) / hash.substr(2);
+        if (std::filesystem::exists(path)) {
+            return path.string();
+        }
+    }
+    return "";
+}
+
 std::string readGitObject(const std::string& hash) {
     // Git objects are stored as .git/objects/XX/YYYYYY... where XX is first 2 chars of hash
     std::string dir = ".git/objects/" + hash.substr(0, 2);
@@ -112,7 +213,20 @@ std::string readGitObject(const std::string& hash) {
     
     std::ifstream file(filename, std::ios::binary);
     if (!file) {
-        throw std::runtime_error("Object file not found: " + filename);
+        // Fall back to the packs, then to loose objects of the alternates
+        std::string objectData;
+        if (hash.length() == 40 && readPackedObject(hash, objectData)) {
+            return objectData;
+        }
+        std::string alternate = hash.length() == 40 ? alternateLoosePath(hash) : "";
+        if (!alternate.empty()) {
+            file.open(alternate, std::ios::binary);
+        } else if (hash.length() == 40 && fetchPromisedObject(hash) && readPackedObject(hash, objectData)) {
+            return objectData;
+        }
+        if (!file) {
+            throw std::runtime_error("Object file not found: " + filename);
+        }
     }
     
     // Read entire file into vector
@@ -124,6 +238,41 @@ std::string readGitObject(const std::string& hash) {
     return decompressZlib(compressedData);
 }
 
+const char* packTypeName(int type) {
+    switch (type) {
+        case 1: return "commit";
+        case 2: return "tree";
+        case 3: return "blob";
+        case 4: return "tag";
+        case 6: return "ofs-delta";
+        case 7: return "ref-delta";
+        default: return "unknown";
+    }
+}
+
+int packTypeFromName(const std::string& name) {
+    for (int type = 1; type <= 4; type++) {
+        if (name == packTypeName(type)) {
+            return type;
+        }
+    }
+    throw std::runtime_error("Unknown object type: " + name);
+}
+
+// Read an object and split off its header, returning the content and its type
+std::string readObjectContent(const std::string& hash, int& type) {
+    std::string objectData = readGitObject(hash);
+    size_t spacePos = objectData.find(' ');
+    size_t nullPos = objectData.find('\0');
+    if (spacePos == std::string::npos || nullPos == std::string::npos || spacePos > nullPos) {
+        throw std::runtime_error("Invalid git object format: " + hash);
+    }
+    type = packTypeFromName(objectData.substr(0, spacePos));
+    // Strip the header in place rather than copying a possibly large body
+    objectData.erase(0, nullPos + 1);
+    return objectData;
+}
+
 std::string writeGitObject(const std::string& content) {
     // Create the Git object format: "blob <size>\0<content>"
     std::string header = "blob " + std::to_string(content.length());
@@ -195,12 +344,6 @@ std::string writeTreeObject(const std::vector<TreeEntry>& entries) {
     return hash;
 }
 
-// HTTP callback function for libcurl
-size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* userp) {
-    userp->append((char*)contents, size * nmemb);
-    return size * nmemb;
-}
-
 // HTTP callback function for headers
 size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userdata) {
     std::string* headers = static_cast<std::string*>(userdata);
@@ -208,50 +351,323 @@ size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userdata)
     return size * nitems;
 }
 
-HTTPResponse makeHTTPRequest(const std::string& url, const std::string& method = "GET", 
-                           const std::string& body = "", const std::vector<std::string>& headers = {}) {
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        throw std::runtime_error("Failed to initialize CURL");
+// Target of the libcurl write callback for HTTPSession::request. Bodies of
+// successful responses go to onData when one is given; anything else is kept
+// in body. Exceptions from onData cannot cross libcurl, so they are parked in
+// error and abort the transfer.
+struct HTTPStreamTarget {
+    CURL* curl;
+    const std::function<void(const char*, size_t)>* onData;
+    std::string body;
+    std::exception_ptr error;
+};
+
+size_t StreamWriteCallback(void* contents, size_t size, size_t nmemb, HTTPStreamTarget* target) {
+    size_t length = size * nmemb;
+    long status = 0;
+    curl_easy_getinfo(target->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (!target->onData || status != 200) {
+        target->body.append(static_cast<char*>(contents), length);
+        return length;
+    }
+    try {
+        (*target->onData)(static_cast<const char*>(contents), length);
+    } catch (...) {
+        target->error = std::current_exception();
+        return 0;
+    }
+    return length;
+}
+
+// Gzip a request body, as git does for large upload-pack requests
+std::string compressGzip(const std::string& data) {
+    z_stream strm{};
+    // 16 added to the window bits selects the gzip wrapper
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("Failed to initialize gzip compression");
+    }
+    // avail_in and avail_out are 32-bit, so larger bodies go in pieces
+    std::string result;
+    unsigned char scratch[16384];
+    size_t fed = 0;
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+        if (strm.avail_in == 0 && fed < data.length()) {
+            size_t chunk = std::min<size_t>(data.length() - fed, 1u << 30);
+            strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data() + fed));
+            strm.avail_in = static_cast<uInt>(chunk);
+            fed += chunk;
+        }
+        strm.next_out = scratch;
+        strm.avail_out = sizeof(scratch);
+        ret = deflate(&strm, fed == data.length() ? Z_FINISH : Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            deflateEnd(&strm);
+            throw std::runtime_error("Failed to compress request body");
+        }
+        result.append(reinterpret_cast<char*>(scratch), sizeof(scratch) - strm.avail_out);
+    }
+    deflateEnd(&strm);
+    return result;
+}
+
+// One request on a curl easy handle, together with everything its options
+// point into, which has to live until the transfer is over. HTTPS is spoken
+// over HTTP/2 when the server offers it, and POST bodies above gzipThreshold
+// are sent gzip-compressed. finish() turns the outcome into a response.
+class HTTPTransfer {
+public:
+    HTTPTransfer(CURL* curl, const std::string& url, const std::string& method, const std::string& body,
+                 const std::vector<std::string>& headers, std::function<void(const char*, size_t)> onData)
+        : onData(std::move(onData)), target{curl, this->onData ? &this->onData : nullptr, "", nullptr} {
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, StreamWriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &target);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &responseHeaders);
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl, CURLOPT_USERAGENT, "git/2.0.0");
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 300L);
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+        
+        std::vector<std::string> allHeaders = headers;
+        if (method == "POST") {
+            curl_easy_setopt(curl, CURLOPT_POST, 1L);
+            if (body.length() > gzipThreshold) {
+                sentBody = compressGzip(body);
+                allHeaders.push_back("Content-Encoding: gzip");
+            } else {
+                sentBody = body;
+            }
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sentBody.data());
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(sentBody.length()));
+        }
+        for (const auto& header : allHeaders) {
+            headerList = curl_slist_append(headerList, header.c_str());
+        }
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
+    }
+    
+    ~HTTPTransfer() {
+        curl_slist_free_all(headerList);
+    }
+    
+    HTTPTransfer(const HTTPTransfer&) = delete;
+    HTTPTransfer& operator=(const HTTPTransfer&) = delete;
+    
+    HTTPResponse finish(CURLcode result) {
+        long response_code = 0;
+        curl_easy_getinfo(target.curl, CURLINFO_RESPONSE_CODE, &response_code);
+        if (target.error) {
+            std::rethrow_exception(target.error);
+        }
+        if (result != CURLE_OK) {
+            throw std::runtime_error("HTTP request failed: " + std::string(curl_easy_strerror(result)));
+        }
+        return {std::move(target.body), static_cast<int>(response_code)};
+    }
+    
+private:
+    static constexpr size_t gzipThreshold = 1024;
+    
+    std::function<void(const char*, size_t)> onData;
+    HTTPStreamTarget target;
+    std::string sentBody;
+    std::string responseHeaders;
+    curl_slist* headerList = nullptr;
+};
+
+// A libcurl handle reused for every request of a clone or fetch, so its
+// connection cache keeps the connection to the remote alive between requests
+// and its DNS cache saves the lookups: only the first request pays for TCP
+// and TLS setup. Requests are made one at a time; the handle is locked for
+// the duration of each.
+class HTTPSession {
+public:
+    HTTPSession() : curl(curl_easy_init()) {
+        if (!curl) {
+            throw std::runtime_error("Failed to initialize CURL");
+        }
+    }
+    
+    ~HTTPSession() {
+        curl_easy_cleanup(curl);
+    }
+    
+    HTTPSession(const HTTPSession&) = delete;
+    HTTPSession& operator=(const HTTPSession&) = delete;
+    
+    // The session every user currently holding one shares; a new one is
+    // made once they are all gone, so none outlives curl_global_cleanup
+    static std::shared_ptr<HTTPSession> shared() {
+        static std::mutex mutex;
+        static std::weak_ptr<HTTPSession> current;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<HTTPSession> session = current.lock();
+        if (!session) {
+            session = std::make_shared<HTTPSession>();
+            current = session;
+        }
+        return session;
     }
     
-    std::string response_body;
-    std::string response_headers;
-    long response_code = 0;
+    // Bodies of 200 responses go to onData when it is given, as they arrive;
+    // the returned body then only holds error responses
+    HTTPResponse request(const std::string& url, const std::string& method, const std::string& body,
+                         const std::vector<std::string>& headers,
+                         const std::function<void(const char*, size_t)>* onData) {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Reset clears the options of the last request but keeps the
+        // connection and DNS caches
+        curl_easy_reset(curl);
+        
+        HTTPTransfer transfer(curl, url, method, body, headers, onData ? *onData : nullptr);
+        CURLcode res = curl_easy_perform(curl);
+        long connects = 0;
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+        requests++;
+        connections += static_cast<uint64_t>(connects);
+        return transfer.finish(res);
+    }
+    
+    // Requests made so far and the connections that had to be opened for them
+    uint64_t requestCount() const { return requests; }
+    uint64_t connectionCount() const { return connections; }
+    
+private:
+    CURL* curl;
+    std::mutex mutex;
+    uint64_t requests = 0;
+    uint64_t connections = 0;
+};
+
+void reportTransport(uint64_t requests, uint64_t connections) {
+    std::cerr << "HTTP: " << requests << " requests over " << connections
+              << (connections == 1 ? " connection" : " connections") << std::endl;
+}
+
+// Many requests in flight at once on a libcurl multi handle. Its transfers
+// share the handle's connection pool and DNS cache, so requests to one host
+// reuse its connections and, over HTTP/2, become streams multiplexed on one.
+// At most maxConnections connections are open at a time. Completions run on
+// the thread calling poll(); any thread may wake it with wakeup().
+class HTTPMulti {
+public:
+    using Completion = std::function<void(HTTPResponse, std::exception_ptr)>;
     
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_body);
-    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response_headers);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "git/2.0.0");
+    explicit HTTPMulti(long maxConnections) : multi(curl_multi_init()) {
+        if (!multi) {
+            throw std::runtime_error("Failed to initialize CURL");
+        }
+        curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, maxConnections);
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    }
     
-    if (method == "POST") {
-        curl_easy_setopt(curl, CURLOPT_POST, 1L);
-        if (!body.empty()) {
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    ~HTTPMulti() {
+        for (auto& [curl, transfer] : transfers) {
+            curl_multi_remove_handle(multi, curl);
+            transfer.reset();
+            curl_easy_cleanup(curl);
         }
+        curl_multi_cleanup(multi);
     }
     
-    if (!headers.empty()) {
-        struct curl_slist* header_list = nullptr;
-        for (const auto& header : headers) {
-            header_list = curl_slist_append(header_list, header.c_str());
+    HTTPMulti(const HTTPMulti&) = delete;
+    HTTPMulti& operator=(const HTTPMulti&) = delete;
+    
+    // Queue a request; bodies of 200 responses go to onData when it is given.
+    // done receives the response, or the error that ended the transfer.
+    void start(const std::string& url, const std::string& method, const std::string& body,
+               const std::vector<std::string>& headers, std::function<void(const char*, size_t)> onData,
+               Completion done) {
+        CURL* curl = curl_easy_init();
+        if (!curl) {
+            throw std::runtime_error("Failed to initialize CURL");
         }
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header_list);
+        auto transfer = std::make_unique<Transfer>(curl, url, method, body, headers, std::move(onData), std::move(done));
+        // Wait for a connection that can take another stream rather than
+        // opening a new one
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+        curl_multi_add_handle(multi, curl);
+        transfers[curl] = std::move(transfer);
     }
     
-    CURLcode res = curl_easy_perform(curl);
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    uint64_t requestCount() const { return requests; }
+    uint64_t connectionCount() const { return connections; }
     
-    curl_easy_cleanup(curl);
+    // Move every transfer along, waiting up to timeoutMs for activity, and
+    // run the completions of those that finished
+    void poll(int timeoutMs) {
+        int active = 0;
+        curl_multi_perform(multi, &active);
+        curl_multi_poll(multi, nullptr, 0, timeoutMs, nullptr);
+        curl_multi_perform(multi, &active);
+        
+        CURLMsg* message = nullptr;
+        int queued = 0;
+        while ((message = curl_multi_info_read(multi, &queued))) {
+            if (message->msg != CURLMSG_DONE) {
+                continue;
+            }
+            CURL* curl = message->easy_handle;
+            CURLcode result = message->data.result;
+            curl_multi_remove_handle(multi, curl);
+            auto node = transfers.extract(curl);
+            std::unique_ptr<Transfer> transfer = std::move(node.mapped());
+            
+            HTTPResponse response{"", 0};
+            std::exception_ptr error;
+            try {
+                response = transfer->http.finish(result);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            long connects = 0;
+            curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+            requests++;
+            connections += static_cast<uint64_t>(connects);
+            Completion done = std::move(transfer->done);
+            transfer.reset();
+            curl_easy_cleanup(curl);
+            done(std::move(response), error);
+        }
+    }
     
-    if (res != CURLE_OK) {
-        throw std::runtime_error("HTTP request failed: " + std::string(curl_easy_strerror(res)));
+    void wakeup() {
+        curl_multi_wakeup(multi);
     }
     
-    return {response_body, static_cast<int>(response_code)};
+private:
+    struct Transfer {
+        Transfer(CURL* curl, const std::string& url, const std::string& method, const std::string& body,
+                 const std::vector<std::string>& headers, std::function<void(const char*, size_t)> onData,
+                 Completion done)
+            : http(curl, url, method, body, headers, std::move(onData)), done(std::move(done)) {}
+        
+        HTTPTransfer http;
+        Completion done;
+    };
+    
+    CURLM* multi;
+    std::unordered_map<CURL*, std::unique_ptr<Transfer>> transfers;
+    uint64_t requests = 0;
+    uint64_t connections = 0;
+};
+
+HTTPResponse makeHTTPRequest(const std::string& url, const std::string& method = "GET", 
+                           const std::string& body = "", const std::vector<std::string>& headers = {}) {
+    return HTTPSession::shared()->request(url, method, body, headers, nullptr);
+}
+
+// Like makeHTTPRequest, but the body of a 200 response is handed to onData
+// piece by piece as it arrives instead of being collected; the returned body
+// only holds error responses
+HTTPResponse makeStreamingHTTPRequest(const std::string& url, const std::string& method, const std::string& body,
+                                      const std::vector<std::string>& headers,
+                                      const std::function<void(const char*, size_t)>& onData) {
+    return HTTPSession::shared()->request(url, method, body, headers, &onData);
 }
 
 std::string writeCommitObject(const std::string& treeHash, const std::string& parentHash, const std::string& message) {
@@ -320,418 +736,6926 @@ uint64_t parseVarint(const std::string& data, size_t& offset) {
     return result;
 }
 
-// Parse Git Smart HTTP response and extract packfile
-std::string extractPackfileFromResponse(const std::string& response) {
-    size_t packPos = response.find("PACK");
-    if (packPos != std::string::npos) {
-        // Return the packfile data starting from "PACK"
-        return response.substr(packPos);
+std::string toHex(const unsigned char* raw, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(length * 2, '0');
+    for (size_t i = 0; i < length; i++) {
+        hex[2 * i] = digits[raw[i] >> 4];
+        hex[2 * i + 1] = digits[raw[i] & 0x0F];
     }
-    throw std::runtime_error("No packfile found in response");
+    return hex;
 }
 
-// Parse packfile and extract objects
-std::vector<PackObject> parsePackfile(const std::string& packData) {
-    std::vector<PackObject> objects;
-    
-    try {
-        // Extract the actual packfile from the Smart HTTP response
-        std::string actualPackfile = extractPackfileFromResponse(packData);
-        
-        if (actualPackfile.length() < 12) {
-            throw std::runtime_error("Invalid packfile: too short");
-        }
-        
-        if (actualPackfile.substr(0, 4) != "PACK") {
-            throw std::runtime_error("Invalid packfile: missing PACK signature");
-        }
-        
-        // Read number of objects from header
-        uint32_t numObjects = 0;
-        numObjects |= static_cast<uint32_t>(static_cast<unsigned char>(actualPackfile[8])) << 24;
-        numObjects |= static_cast<uint32_t>(static_cast<unsigned char>(actualPackfile[9])) << 16;
-        numObjects |= static_cast<uint32_t>(static_cast<unsigned char>(actualPackfile[10])) << 8;
-        numObjects |= static_cast<uint32_t>(static_cast<unsigned char>(actualPackfile[11]));
-        
-        std::cerr << "Packfile contains " << numObjects << " objects" << std::endl;
-        
-        size_t offset = 12;
-        
-        for (uint32_t i = 0; i < numObjects && offset < actualPackfile.length(); i++) {
-            // Read object header byte by byte
-            unsigned char c = actualPackfile[offset++];
-            int type = (c >> 4) & 0x7;
-            size_t size = c & 0x0F;
-            
-            // Handle variable length size
-            int shift = 4;
-            while (c & 0x80) {
-                if (offset >= actualPackfile.length()) break;
-                c = actualPackfile[offset++];
-                size |= static_cast<size_t>(c & 0x7F) << shift;
-                shift += 7;
-            }
-            
-            if (offset >= actualPackfile.length()) break;
-            
-            // Extract compressed object data
-            std::vector<char> compressedData;
-            
-            // Find the end of this compressed stream (this is simplified)
-            // In a real implementation, we'd properly decompress and find the exact end
-            size_t remaining = actualPackfile.length() - offset;
-            size_t estimatedCompressedSize = std::min(remaining, size + 100); // Rough estimate
-            
-            compressedData.assign(actualPackfile.begin() + offset, 
-                                actualPackfile.begin() + offset + estimatedCompressedSize);
-            
-            try {
-                // Decompress the object data
-                std::string objectData = decompressZlib(compressedData);
-                
-                // Create object header based on type
-                std::string typeStr;
-                switch (type) {
-                    case 1: typeStr = "commit"; break;
-                    case 2: typeStr = "tree"; break;
-                    case 3: typeStr = "blob"; break;
-                    case 4: typeStr = "tag"; break;
-                    default: typeStr = "unknown"; break;
-                }
-                
-                // Create the Git object format: "type size\0content"
-                std::string fullObjectData = typeStr + " " + std::to_string(objectData.length()) + '\0' + objectData;
-                
-                // Compute SHA-1 hash
-                std::string hash = computeSHA1(fullObjectData);
-                
-                objects.push_back({hash, fullObjectData, type, size});
-                
-                // Move to next object (simplified)
-                offset += estimatedCompressedSize;
-                
-            } catch (const std::exception& e) {
-                std::cerr << "Failed to decompress object " << i << ": " << e.what() << std::endl;
-                break;
-            }
-        }
-        
-    } catch (const std::exception& e) {
-        std::cerr << "Error parsing packfile: " << e.what() << std::endl;
-        // Return empty vector on error
-    }
-    
-    return objects;
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    throw std::runtime_error(std::string("Invalid hex digit: ") + c);
 }
 
-std::vector<TreeEntry> parseTreeObject(const std::string& objectData) {
-    std::vector<TreeEntry> entries;
-    size_t pos = 0;
-    
-    // Skip the header (type size\0)
-    size_t nullPos = objectData.find('\0');
-    if (nullPos == std::string::npos) {
-        throw std::runtime_error("Invalid tree object format");
+std::string fromHex(const std::string& hex) {
+    if (hex.length() % 2 != 0) {
+        throw std::runtime_error("Invalid hex string: " + hex);
     }
-    
-    // Start parsing after the header
-    pos = nullPos + 1;
-    
-    while (pos < objectData.length()) {
-        // Find the next space (separates mode from name)
-        size_t spacePos = objectData.find(' ', pos);
-        if (spacePos == std::string::npos) {
-            break;
-        }
-        
-        // Extract mode
-        std::string mode = objectData.substr(pos, spacePos - pos);
-        
-        // Find the null byte (separates name from hash)
-        size_t nameEndPos = objectData.find('\0', spacePos);
-        if (nameEndPos == std::string::npos) {
-            break;
-        }
-        
-        // Extract name
-        std::string name = objectData.substr(spacePos + 1, nameEndPos - spacePos - 1);
-        
-        // Extract hash (20 bytes after the null byte)
-        if (nameEndPos + 20 > objectData.length()) {
-            break;
-        }
-        
-        std::string rawHash = objectData.substr(nameEndPos + 1, 20);
-        
-        // Convert raw bytes to hex string
-        std::stringstream ss;
-        for (unsigned char byte : rawHash) {
-            ss << std::hex << std::setfill('0') << std::setw(2) << static_cast<int>(byte);
-        }
-        std::string hash = ss.str();
-        
-        entries.push_back({mode, name, hash});
-        
-        // Move to next entry
-        pos = nameEndPos + 21;
+    std::string raw(hex.length() / 2, '\0');
+    for (size_t i = 0; i < raw.length(); i++) {
+        raw[i] = static_cast<char>((hexValue(hex[2 * i]) << 4) | hexValue(hex[2 * i + 1]));
     }
-    
-    return entries;
+    return raw;
 }
 
-std::string createTreeFromDirectory(const std::string& dirPath) {
-    std::vector<TreeEntry> entries;
+// Hash "<type> <size>\0<content>" incrementally so large objects are not copied
+std::string hashObject(const std::string& type, const std::string& content) {
+    std::string header = type + " " + std::to_string(content.length());
+    header += '\0';
     
-    // Iterate through directory entries
-    for (const auto& entry : std::filesystem::directory_iterator(dirPath)) {
-        std::string name = entry.path().filename().string();
-        
-        // Skip .git directory
-        if (name == ".git") {
-            continue;
-        }
-        
-        if (entry.is_regular_file()) {
-            // Create blob object for file
-            std::ifstream file(entry.path());
-            if (!file) {
-                throw std::runtime_error("Failed to open file: " + entry.path().string());
-            }
-            
-            std::string content((std::istreambuf_iterator<char>(file)),
-                              std::istreambuf_iterator<char>());
-            file.close();
-            
-            std::string hash = writeGitObject(content);
-            entries.push_back({"100644", name, hash}); // 100644 is regular file mode
-            
-        } else if (entry.is_directory()) {
-            // Recursively create tree object for subdirectory
-            std::string subTreeHash = createTreeFromDirectory(entry.path().string());
-            entries.push_back({"40000", name, subTreeHash}); // 40000 is directory mode
-        }
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashLength = 0;
+    bool ok = ctx != nullptr &&
+              EVP_DigestInit_ex(ctx, EVP_sha1(), nullptr) == 1 &&
+              EVP_DigestUpdate(ctx, header.data(), header.length()) == 1 &&
+              EVP_DigestUpdate(ctx, content.data(), content.length()) == 1 &&
+              EVP_DigestFinal_ex(ctx, hash, &hashLength) == 1;
+    EVP_MD_CTX_free(ctx);
+    if (!ok) {
+        throw std::runtime_error("Failed to compute object hash");
     }
-    
-    // Sort entries by name (Git requirement)
-    std::sort(entries.begin(), entries.end(), 
-             [](const TreeEntry& a, const TreeEntry& b) {
-                 return a.name < b.name;
-             });
-    
-    // Create and return tree object
-    return writeTreeObject(entries);
+    return toHex(hash, hashLength);
 }
 
-void cloneRepository(const std::string& url, const std::string& targetDir) {
-    // Parse GitHub URL
-    std::regex github_regex(R"(https://github\.com/([^/]+)/([^/]+))");
-    std::smatch match;
-    if (!std::regex_search(url, match, github_regex)) {
-        throw std::runtime_error("Invalid GitHub URL: " + url);
+// Output file whose bytes are hashed as they are written. finish() appends the
+// SHA-1 trailer that pack, idx and the other on-disk formats end with.
+class HashedFileWriter {
+public:
+    explicit HashedFileWriter(const std::string& path) : path(path), file(path, std::ios::binary) {
+        ctx = EVP_MD_CTX_new();
+        if (!file || !ctx || EVP_DigestInit_ex(ctx, EVP_sha1(), nullptr) != 1) {
+            EVP_MD_CTX_free(ctx);
+            throw std::runtime_error("Failed to create file: " + path);
+        }
     }
     
-    std::string owner = match[1];
-    std::string repo = match[2];
-    
-    // Remove .git suffix if present
-    if (repo.length() > 4 && repo.substr(repo.length() - 4) == ".git") {
-        repo = repo.substr(0, repo.length() - 4);
+    ~HashedFileWriter() {
+        EVP_MD_CTX_free(ctx);
     }
     
-    // Create target directory
-    std::filesystem::create_directories(targetDir);
-    
-    // Save current directory
-    std::string originalDir = std::filesystem::current_path().string();
-    
-    // Change to target directory
-    std::filesystem::current_path(targetDir);
-    
-    // Initialize git repository
-    std::filesystem::create_directories(".git");
-    std::filesystem::create_directories(".git/objects");
-    std::filesystem::create_directories(".git/refs");
-    std::filesystem::create_directories(".git/refs/heads");
+    HashedFileWriter(const HashedFileWriter&) = delete;
+    HashedFileWriter& operator=(const HashedFileWriter&) = delete;
     
-    std::ofstream headFile(".git/HEAD");
-    if (headFile.is_open()) {
-        headFile << "ref: refs/heads/main\n";
-        headFile.close();
+    void write(const void* data, size_t length) {
+        EVP_DigestUpdate(ctx, data, length);
+        file.write(static_cast<const char*>(data), length);
+        written += length;
     }
     
-    // Get info/refs to find the default branch
-    std::string infoRefsUrl = "https://github.com/" + owner + "/" + repo + "/info/refs?service=git-upload-pack";
-    std::cerr << "Requesting info/refs from: " << infoRefsUrl << std::endl;
-    HTTPResponse infoResponse = makeHTTPRequest(infoRefsUrl);
+    void write(const std::string& data) {
+        write(data.data(), data.length());
+    }
     
-    std::cerr << "Info/refs response status: " << infoResponse.status_code << std::endl;
-    std::cerr << "Info/refs response body (first 500 chars): " << infoResponse.body.substr(0, 500) << std::endl;
+    void writeUint32(uint32_t value) {
+        unsigned char bytes[4] = {
+            static_cast<unsigned char>(value >> 24), static_cast<unsigned char>(value >> 16),
+            static_cast<unsigned char>(value >> 8), static_cast<unsigned char>(value)
+        };
+        write(bytes, sizeof(bytes));
+    }
     
-    if (infoResponse.status_code != 200) {
-        throw std::runtime_error("Failed to get info/refs: " + std::to_string(infoResponse.status_code) + 
-                               " - Response: " + infoResponse.body.substr(0, 200));
+    void writeUint64(uint64_t value) {
+        writeUint32(static_cast<uint32_t>(value >> 32));
+        writeUint32(static_cast<uint32_t>(value));
     }
     
-    // Parse info/refs to find HEAD
-    std::string headRef;
-    std::string body = infoResponse.body;
+    uint64_t bytesWritten() const { return written; }
     
-    // Extract hash using a simple approach
-    // Find the hash that appears right before "refs/heads/master"
-    size_t masterPos = body.find("refs/heads/master");
-    if (masterPos != std::string::npos) {
-        // Look for a 40-character hex string before "refs/heads/master"
-        for (size_t i = masterPos; i >= 40; i--) {
-            std::string potentialHash = body.substr(i - 40, 40);
-            bool isValidHash = true;
-            for (char c : potentialHash) {
-                if (!std::isxdigit(c)) {
-                    isValidHash = false;
-                    break;
-                }
-            }
-            if (isValidHash) {
-                headRef = potentialHash;
-                std::cerr << "Found hash: " << headRef << std::endl;
-                break;
-            }
+    // Write the trailer, close the file and return the trailer as hex
+    std::string finish() {
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int hashLength = 0;
+        EVP_DigestFinal_ex(ctx, hash, &hashLength);
+        file.write(reinterpret_cast<const char*>(hash), hashLength);
+        file.close();
+        if (!file) {
+            throw std::runtime_error("Failed to write file: " + path);
         }
+        return toHex(hash, hashLength);
     }
     
-    if (headRef.empty()) {
-        std::cerr << "Could not find hash" << std::endl;
-    }
-    
-    if (headRef.empty()) {
-        throw std::runtime_error("Could not find HEAD reference");
+private:
+    std::string path;
+    std::ofstream file;
+    EVP_MD_CTX* ctx = nullptr;
+    uint64_t written = 0;
+};
+
+// Inflate one zlib stream and return the number of compressed bytes it
+// occupied. input(position, available) hands out the compressed bytes from
+// position on, possibly in several pieces (such as pack windows). When out is
+// null the inflated bytes are discarded, which is how object boundaries are found.
+size_t inflateStream(const std::function<const unsigned char*(uint64_t, size_t&)>& input, uint64_t expectedSize,
+                     std::string* out) {
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    
+    if (inflateInit(&strm) != Z_OK) {
+        throw std::runtime_error("Failed to initialize zlib decompression");
+    }
+    
+    if (out) {
+        out->resize(expectedSize);
+    }
+    
+    unsigned char scratch[16384];
+    size_t fed = 0;
+    uint64_t written = 0;
+    int ret = Z_OK;
+    
+    while (ret != Z_STREAM_END) {
+        if (strm.avail_in == 0) {
+            size_t available = 0;
+            const unsigned char* next = input(fed, available);
+            size_t chunk = std::min<size_t>(available, 1u << 30);
+            if (chunk == 0) {
+                inflateEnd(&strm);
+                throw std::runtime_error("Truncated zlib stream");
+            }
+            strm.next_in = const_cast<Bytef*>(next);
+            strm.avail_in = static_cast<uInt>(chunk);
+            fed += chunk;
+        }
+        
+        bool intoOutput = out && written < expectedSize;
+        if (intoOutput) {
+            strm.next_out = reinterpret_cast<Bytef*>(out->data() + written);
+            strm.avail_out = static_cast<uInt>(std::min<uint64_t>(expectedSize - written, 1u << 30));
+        } else {
+            strm.next_out = scratch;
+            strm.avail_out = sizeof(scratch);
+        }
+        uInt before = strm.avail_out;
+        
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            inflateEnd(&strm);
+            throw std::runtime_error("Failed to decompress zlib data");
+        }
+        
+        uInt produced = before - strm.avail_out;
+        if (intoOutput) {
+            written += produced;
+        } else if (out && produced > 0) {
+            inflateEnd(&strm);
+            throw std::runtime_error("Inflated object is larger than its recorded size");
+        }
+    }
+    
+    size_t consumed = fed - strm.avail_in;
+    inflateEnd(&strm);
+    
+    if (out && written != expectedSize) {
+        throw std::runtime_error("Inflated object is smaller than its recorded size");
+    }
+    return consumed;
+}
+
+// Inflate a zlib stream embedded in a larger contiguous buffer
+size_t inflateStream(const unsigned char* data, size_t length, uint64_t expectedSize, std::string* out) {
+    return inflateStream([&](uint64_t position, size_t& available) {
+        available = length - position;
+        return data + position;
+    }, expectedSize, out);
+}
+
+// Inflate at most limit bytes from the start of a zlib stream, enough to read
+// an object or delta header without inflating the rest
+std::string inflatePrefix(const std::function<const unsigned char*(uint64_t, size_t&)>& input, size_t limit) {
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    if (inflateInit(&strm) != Z_OK) {
+        throw std::runtime_error("Failed to initialize zlib decompression");
+    }
+    
+    std::string out(limit, '\0');
+    strm.next_out = reinterpret_cast<Bytef*>(out.data());
+    strm.avail_out = static_cast<uInt>(limit);
+    size_t fed = 0;
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END && strm.avail_out > 0) {
+        if (strm.avail_in == 0) {
+            size_t available = 0;
+            const unsigned char* next = input(fed, available);
+            size_t chunk = std::min<size_t>(available, 1u << 30);
+            if (chunk == 0) {
+                break;
+            }
+            strm.next_in = const_cast<Bytef*>(next);
+            strm.avail_in = static_cast<uInt>(chunk);
+            fed += chunk;
+        }
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            inflateEnd(&strm);
+            throw std::runtime_error("Failed to decompress zlib data");
+        }
+    }
+    out.resize(limit - strm.avail_out);
+    inflateEnd(&strm);
+    return out;
+}
+
+struct PackEntryHeader {
+    int type;
+    uint64_t size;          // inflated size of the stored data
+    uint64_t baseOffset;    // OFS_DELTA: absolute offset of the base entry
+    std::string baseHash;   // REF_DELTA: hex id of the base object
+    size_t headerLength;    // bytes between the entry start and its zlib stream
+};
+
+// Parse the entry header at pack offset. data holds length bytes of the pack
+// starting at bufferOffset: the whole pack, or just a mapped window of it.
+PackEntryHeader parsePackEntryHeader(const unsigned char* data, size_t length, uint64_t offset,
+                                     uint64_t bufferOffset = 0) {
+    PackEntryHeader header{0, 0, 0, "", 0};
+    uint64_t start = offset - bufferOffset;
+    uint64_t pos = start;
+    
+    if (pos >= length) {
+        throw std::runtime_error("Truncated pack entry header");
+    }
+    unsigned char c = data[pos++];
+    header.type = (c >> 4) & 0x7;
+    header.size = c & 0x0F;
+    
+    int shift = 4;
+    while (c & 0x80) {
+        if (pos >= length || shift > 57) {
+            throw std::runtime_error("Invalid pack entry size");
+        }
+        c = data[pos++];
+        header.size |= static_cast<uint64_t>(c & 0x7F) << shift;
+        shift += 7;
+    }
+    
+    if (header.type == 6) {
+        // Offset deltas use a big-endian varint where each continuation adds one
+        if (pos >= length) {
+            throw std::runtime_error("Truncated ofs-delta header");
+        }
+        c = data[pos++];
+        uint64_t distance = c & 0x7F;
+        while (c & 0x80) {
+            if (pos >= length) {
+                throw std::runtime_error("Truncated ofs-delta header");
+            }
+            c = data[pos++];
+            distance = ((distance + 1) << 7) | (c & 0x7F);
+        }
+        if (distance == 0 || distance > offset) {
+            throw std::runtime_error("Invalid ofs-delta base offset");
+        }
+        header.baseOffset = offset - distance;
+    } else if (header.type == 7) {
+        if (pos + 20 > length) {
+            throw std::runtime_error("Truncated ref-delta header");
+        }
+        header.baseHash = toHex(data + pos, 20);
+        pos += 20;
+    } else if (header.type < 1 || header.type > 4) {
+        throw std::runtime_error("Invalid pack entry type " + std::to_string(header.type));
+    }
+    
+    header.headerLength = pos - start;
+    return header;
+}
+
+// Type and size varint that starts every pack entry
+std::string encodePackEntryHeader(int type, uint64_t size) {
+    std::string header;
+    unsigned char c = static_cast<unsigned char>((type << 4) | (size & 0x0F));
+    size >>= 4;
+    while (size) {
+        header += static_cast<char>(c | 0x80);
+        c = size & 0x7F;
+        size >>= 7;
+    }
+    header += static_cast<char>(c);
+    return header;
+}
+
+// Apply a Git delta (copy/insert instruction stream) to its base object
+std::string applyDelta(const std::string& base, const std::string& delta) {
+    size_t pos = 0;
+    uint64_t baseSize = parseVarint(delta, pos);
+    uint64_t resultSize = parseVarint(delta, pos);
+    
+    if (baseSize != base.length()) {
+        throw std::runtime_error("Delta base size mismatch");
+    }
+    
+    std::string result;
+    result.reserve(resultSize);
+    
+    while (pos < delta.length()) {
+        unsigned char op = static_cast<unsigned char>(delta[pos++]);
+        if (op & 0x80) {
+            uint64_t copyOffset = 0;
+            uint64_t copySize = 0;
+            for (int i = 0; i < 4; i++) {
+                if (op & (1 << i)) {
+                    if (pos >= delta.length()) throw std::runtime_error("Truncated delta copy");
+                    copyOffset |= static_cast<uint64_t>(static_cast<unsigned char>(delta[pos++])) << (8 * i);
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                if (op & (0x10 << i)) {
+                    if (pos >= delta.length()) throw std::runtime_error("Truncated delta copy");
+                    copySize |= static_cast<uint64_t>(static_cast<unsigned char>(delta[pos++])) << (8 * i);
+                }
+            }
+            if (copySize == 0) {
+                copySize = 0x10000;
+            }
+            if (copyOffset + copySize > base.length()) {
+                throw std::runtime_error("Delta copy out of range");
+            }
+            result.append(base, copyOffset, copySize);
+        } else if (op != 0) {
+            if (pos + op > delta.length()) {
+                throw std::runtime_error("Truncated delta insert");
+            }
+            result.append(delta, pos, op);
+            pos += op;
+        } else {
+            throw std::runtime_error("Invalid delta opcode");
+        }
+    }
+    
+    if (result.length() != resultSize) {
+        throw std::runtime_error("Delta result size mismatch");
+    }
+    return result;
+}
+
+// Parse sizes such as "512M" or "1g"
+uint64_t parseByteSize(const std::string& value) {
+    size_t end = 0;
+    uint64_t size = 0;
+    try {
+        size = std::stoull(value, &end);
+    } catch (const std::exception&) {
+        throw std::runtime_error("Invalid size: " + value);
+    }
+    std::string suffix = value.substr(end);
+    if (suffix == "k" || suffix == "K") {
+        size <<= 10;
+    } else if (suffix == "m" || suffix == "M") {
+        size <<= 20;
+    } else if (suffix == "g" || suffix == "G") {
+        size <<= 30;
+    } else if (!suffix.empty()) {
+        throw std::runtime_error("Invalid size: " + value);
+    }
+    return size;
+}
+
+// Parse a point in time given as seconds since the epoch or as an ISO 8601
+// date such as "2024-01-31" or "2024-01-31 12:00:00" (taken as UTC)
+int64_t parseDate(const std::string& value) {
+    if (!value.empty() && std::all_of(value.begin(), value.end(), ::isdigit)) {
+        return std::stoll(value);
+    }
+    for (const char* format : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"}) {
+        std::tm time{};
+        const char* end = ::strptime(value.c_str(), format, &time);
+        if (end && *end == '\0') {
+            return static_cast<int64_t>(::timegm(&time));
+        }
+    }
+    throw std::runtime_error("Invalid date: " + value);
+}
+
+// Value of a key such as "core.packedGitLimit" or "remote.origin.url" in
+// .git/config, or an empty string when it is not set. Section and key names
+// are case-insensitive, subsection names are not; the last assignment wins.
+std::string readConfigValue(const std::string& key) {
+    auto lower = [](std::string text) {
+        std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+        return text;
+    };
+    auto trim = [](const std::string& text) {
+        size_t begin = text.find_first_not_of(" \t");
+        size_t end = text.find_last_not_of(" \t\r");
+        return begin == std::string::npos ? std::string() : text.substr(begin, end - begin + 1);
+    };
+    
+    size_t firstDot = key.find('.');
+    size_t lastDot = key.rfind('.');
+    if (firstDot == std::string::npos) {
+        return "";
+    }
+    std::string wantedSection = lower(key.substr(0, firstDot));
+    std::string wantedSubsection = firstDot == lastDot ? "" : key.substr(firstDot + 1, lastDot - firstDot - 1);
+    std::string wantedName = lower(key.substr(lastDot + 1));
+    
+    std::ifstream config(".git/config");
+    std::string line;
+    std::string section;
+    std::string subsection;
+    std::string value;
+    while (std::getline(config, line)) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';') {
+            continue;
+        }
+        if (line[0] == '[') {
+            std::string header = line.substr(1, line.find(']') - 1);
+            size_t quote = header.find('"');
+            section = lower(trim(header.substr(0, quote)));
+            subsection = quote == std::string::npos ? "" : header.substr(quote + 1, header.rfind('"') - quote - 1);
+            continue;
+        }
+        size_t equals = line.find('=');
+        std::string name = lower(trim(line.substr(0, equals)));
+        if (section == wantedSection && subsection == wantedSubsection && name == wantedName) {
+            value = equals == std::string::npos ? "true" : trim(line.substr(equals + 1));
+            if (value.length() >= 2 && value.front() == '"' && value.back() == '"') {
+                value = value.substr(1, value.length() - 2);
+            }
+        }
+    }
+    return value;
+}
+
+unsigned resolveThreadCount(unsigned requested) {
+    if (requested != 0) {
+        return requested;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Fixed-size pool where every worker owns a deque. A worker pops its newest task
+// first and, once its own deque is empty, steals the oldest task of a sibling.
+// Tasks may submit follow-up work, which lands on the submitting worker's deque.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned threadCount) {
+        threadCount = resolveThreadCount(threadCount);
+        for (unsigned i = 0; i < threadCount; i++) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (unsigned i = 0; i < threadCount; i++) {
+            workers.emplace_back([this, i] { run(i); });
+        }
+    }
+    
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+    
+    size_t size() const { return workers.size(); }
+    
+    void submit(std::function<void()> task) {
+        size_t target = currentPool == this ? currentWorker : nextQueue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            {
+                std::lock_guard<std::mutex> queueLock(queues[target]->mutex);
+                queues[target]->tasks.push_back(std::move(task));
+            }
+            pending++;
+            queued++;
+        }
+        workAvailable.notify_one();
+    }
+    
+    // Block until every submitted task (including ones they spawned) has finished,
+    // then rethrow the first exception raised by any task
+    void wait() {
+        std::unique_lock<std::mutex> lock(stateMutex);
+        allDone.wait(lock, [this] { return pending == 0; });
+        if (firstError) {
+            std::exception_ptr error = firstError;
+            firstError = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+    
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+    
+    bool popTask(size_t self, std::function<void()>& task) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue& queue = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> queueLock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+    
+    void run(size_t self) {
+        currentPool = this;
+        currentWorker = self;
+        while (true) {
+            std::function<void()> task;
+            if (popTask(self, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(stateMutex);
+                    queued--;
+                }
+                try {
+                    task();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(stateMutex);
+                    if (!firstError) {
+                        firstError = std::current_exception();
+                    }
+                }
+                std::lock_guard<std::mutex> lock(stateMutex);
+                if (--pending == 0) {
+                    allDone.notify_all();
+                }
+                continue;
+            }
+            
+            std::unique_lock<std::mutex> lock(stateMutex);
+            workAvailable.wait(lock, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+    }
+    
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex stateMutex;
+    std::condition_variable workAvailable;
+    std::condition_variable allDone;
+    size_t pending = 0;
+    size_t queued = 0;
+    bool stopping = false;
+    std::exception_ptr firstError;
+    std::atomic<size_t> nextQueue{0};
+    
+    static inline thread_local WorkStealingPool* currentPool = nullptr;
+    static inline thread_local size_t currentWorker = 0;
+};
+
+struct PackIndexEntry {
+    std::string hash;       // hex object id, filled in once resolved
+    uint64_t offset;        // start of the entry header within the pack
+    uint64_t dataOffset;    // start of the zlib stream
+    uint64_t endOffset;     // one past the last compressed byte
+    int type;               // type as stored in the pack (may be a delta)
+    int resolvedType;       // commit/tree/blob/tag after delta resolution
+    uint64_t size;          // inflated size of the stored data
+    uint64_t baseOffset;
+    std::string baseHash;
+    uint32_t crc32;         // CRC-32 of the raw entry bytes, as stored in .idx v2
+};
+
+// Invoked from worker threads for every object once it is resolved and hashed
+using PackObjectCallback = std::function<void(const PackIndexEntry&, const std::string&)>;
+
+// Contents of resolved objects that deltas still have to be applied to. An
+// object is dropped as soon as its last delta is resolved; beyond limit bytes
+// the least recently used are dropped early, to be rebuilt from the pack if a
+// delta needs them after all.
+class DeltaBaseCache {
+public:
+    explicit DeltaBaseCache(uint64_t limit) : limit(limit) {}
+    
+    std::shared_ptr<const std::string> get(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = cached.find(index);
+        if (found == cached.end()) {
+            return nullptr;
+        }
+        lru.splice(lru.end(), lru, found->second.position);
+        return found->second.content;
+    }
+    
+    void put(size_t index, std::shared_ptr<const std::string> content) {
+        std::lock_guard<std::mutex> lock(mutex);
+        eraseLocked(index);
+        bytes += content->length();
+        lru.push_back(index);
+        cached[index] = {std::move(content), std::prev(lru.end())};
+        // The newest object stays even if it alone is over the limit, since
+        // its deltas are about to be resolved
+        while (bytes > limit && lru.size() > 1) {
+            eraseLocked(lru.front());
+        }
+    }
+    
+    void erase(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        eraseLocked(index);
+    }
+    
+private:
+    struct Cached {
+        std::shared_ptr<const std::string> content;
+        std::list<size_t>::iterator position;
+    };
+    
+    void eraseLocked(size_t index) {
+        auto found = cached.find(index);
+        if (found == cached.end()) {
+            return;
+        }
+        bytes -= found->second.content->length();
+        lru.erase(found->second.position);
+        cached.erase(found);
+    }
+    
+    const uint64_t limit;
+    uint64_t bytes = 0;
+    std::list<size_t> lru;
+    std::unordered_map<size_t, Cached> cached;
+    std::mutex mutex;
+};
+
+// Hash every entry of a pack whose boundaries are known. Base objects are
+// inflated and hashed on a work-stealing pool, and each base resolves its delta
+// family as child tasks. Bases that arrive already hashed (and CRC'd) are only
+// inflated again when a delta needs them or onObject wants their content.
+// Objects with deltas against them wait in a DeltaBaseCache of baseCacheLimit
+// bytes. Waits for the pool, so tasks already submitted to it (such as
+// checksum verification) are finished too. Returns how many deltas were left
+// unresolved, with an empty hash, because their base is not among entries.
+size_t resolvePackEntries(const unsigned char* data, std::vector<PackIndexEntry>& entries, WorkStealingPool& pool,
+                        const PackObjectCallback& onObject, uint64_t baseCacheLimit = UINT64_MAX) {
+    std::unordered_map<uint64_t, std::vector<size_t>> ofsChildren;
+    std::unordered_map<std::string, std::vector<size_t>> refChildren;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].type == 6) {
+            ofsChildren[entries[i].baseOffset].push_back(i);
+        } else if (entries[i].type == 7) {
+            refChildren[entries[i].baseHash].push_back(i);
+        }
+    }
+    
+    DeltaBaseCache cache(baseCacheLimit);
+    std::vector<size_t> parentOf(entries.size(), SIZE_MAX);
+    std::vector<std::atomic<uint32_t>> unresolvedChildren(entries.size());
+    std::atomic<size_t> resolved{0};
+    std::function<void(size_t, std::string)> finish;
+    
+    // Content of a resolved object, rebuilt along its delta chain if the cache
+    // no longer has it
+    std::function<std::shared_ptr<const std::string>(size_t)> contentOf = [&](size_t i) {
+        if (auto content = cache.get(i)) {
+            return content;
+        }
+        const PackIndexEntry& entry = entries[i];
+        std::string stored;
+        inflateStream(data + entry.dataOffset, entry.endOffset - entry.dataOffset, entry.size, &stored);
+        if (parentOf[i] == SIZE_MAX) {
+            return std::make_shared<const std::string>(std::move(stored));
+        }
+        return std::make_shared<const std::string>(applyDelta(*contentOf(parentOf[i]), stored));
+    };
+    
+    auto resolveChildren = [&](size_t parent) {
+        std::vector<size_t> children;
+        auto ofsIt = ofsChildren.find(entries[parent].offset);
+        if (ofsIt != ofsChildren.end()) {
+            children = ofsIt->second;
+        }
+        auto refIt = refChildren.find(entries[parent].hash);
+        if (refIt != refChildren.end()) {
+            children.insert(children.end(), refIt->second.begin(), refIt->second.end());
+        }
+        
+        unresolvedChildren[parent] = static_cast<uint32_t>(children.size());
+        for (size_t child : children) {
+            parentOf[child] = parent;
+        }
+        for (size_t child : children) {
+            pool.submit([&, parent, child] {
+                PackIndexEntry& entry = entries[child];
+                std::string delta;
+                inflateStream(data + entry.dataOffset, entry.endOffset - entry.dataOffset, entry.size, &delta);
+                entry.resolvedType = entries[parent].resolvedType;
+                entry.crc32 = static_cast<uint32_t>(crc32_z(0, data + entry.offset, entry.endOffset - entry.offset));
+                std::string content = applyDelta(*contentOf(parent), delta);
+                if (--unresolvedChildren[parent] == 0) {
+                    cache.erase(parent);
+                }
+                finish(child, std::move(content));
+            });
+        }
+    };
+    
+    finish = [&](size_t i, std::string content) {
+        PackIndexEntry& entry = entries[i];
+        if (entry.hash.empty()) {
+            entry.hash = hashObject(packTypeName(entry.resolvedType), content);
+        }
+        if (onObject) {
+            onObject(entry, content);
+        }
+        resolved++;
+        
+        bool hasChildren = ofsChildren.count(entry.offset) || refChildren.count(entry.hash);
+        if (hasChildren) {
+            cache.put(i, std::make_shared<const std::string>(std::move(content)));
+            resolveChildren(i);
+        }
+    };
+    
+    for (size_t i = 0; i < entries.size(); i++) {
+        PackIndexEntry& entry = entries[i];
+        if (entry.type == 6 || entry.type == 7) {
+            continue;
+        }
+        bool hashed = !entry.hash.empty();
+        if (hashed && !onObject && !ofsChildren.count(entry.offset) && !refChildren.count(entry.hash)) {
+            resolved++;
+            continue;
+        }
+        pool.submit([&, i, hashed] {
+            PackIndexEntry& entry = entries[i];
+            std::string content;
+            inflateStream(data + entry.dataOffset, entry.endOffset - entry.dataOffset, entry.size, &content);
+            entry.resolvedType = entry.type;
+            if (!hashed) {
+                entry.crc32 = static_cast<uint32_t>(crc32_z(0, data + entry.offset, entry.endOffset - entry.offset));
+            }
+            finish(i, std::move(content));
+        });
+    }
+    
+    pool.wait();
+    return entries.size() - resolved;
+}
+
+// Index a complete packfile. A single sequential sweep inflates each entry only
+// to learn where it ends; resolvePackEntries then does the hashing.
+std::vector<PackIndexEntry> indexPack(std::string_view pack, unsigned threads,
+                                      const PackObjectCallback& onObject) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(pack.data());
+    
+    if (pack.length() < 32 || pack.compare(0, 4, "PACK") != 0) {
+        throw std::runtime_error("Invalid packfile: missing PACK signature");
+    }
+    uint32_t version = (uint32_t(data[4]) << 24) | (uint32_t(data[5]) << 16) | (uint32_t(data[6]) << 8) | data[7];
+    if (version != 2 && version != 3) {
+        throw std::runtime_error("Unsupported packfile version " + std::to_string(version));
+    }
+    uint32_t numObjects = (uint32_t(data[8]) << 24) | (uint32_t(data[9]) << 16) | (uint32_t(data[10]) << 8) | data[11];
+    size_t trailerOffset = pack.length() - 20;
+    
+    std::vector<PackIndexEntry> entries;
+    entries.reserve(numObjects);
+    
+    WorkStealingPool pool(threads);
+    std::cerr << "Indexing " << numObjects << " objects using " << pool.size() << " threads" << std::endl;
+    
+    // The trailing checksum is verified on the pool while the sweep runs
+    pool.submit([&] {
+        unsigned char checksum[SHA_DIGEST_LENGTH];
+        SHA1(data, trailerOffset, checksum);
+        if (std::memcmp(checksum, data + trailerOffset, SHA_DIGEST_LENGTH) != 0) {
+            throw std::runtime_error("Packfile checksum mismatch");
+        }
+    });
+    
+    uint64_t offset = 12;
+    for (uint32_t i = 0; i < numObjects; i++) {
+        PackEntryHeader header = parsePackEntryHeader(data, trailerOffset, offset);
+        uint64_t dataOffset = offset + header.headerLength;
+        size_t consumed = inflateStream(data + dataOffset, trailerOffset - dataOffset, header.size, nullptr);
+        
+        entries.push_back({"", offset, dataOffset, dataOffset + consumed, header.type, 0,
+                           header.size, header.baseOffset, header.baseHash, 0});
+        offset = dataOffset + consumed;
+    }
+    
+    if (offset != trailerOffset) {
+        pool.wait();
+        throw std::runtime_error("Packfile has trailing garbage after last object");
+    }
+    
+    size_t unresolved = resolvePackEntries(data, entries, pool, onObject);
+    if (unresolved > 0) {
+        throw std::runtime_error("Packfile has " + std::to_string(unresolved) + " unresolved deltas");
+    }
+    return entries;
+}
+
+// Incremental counterpart of indexPack's sweep. The pack is fed in arbitrary
+// pieces as it arrives; every entry's boundaries are recorded as soon as its
+// zlib stream ends, and the trailing checksum is verified against a running
+// SHA-1, so no more than one entry header is ever buffered. Non-delta objects
+// are CRC'd from the same inflate, and hashed too unless they are small enough
+// to be handed off inflated to another thread, leaving only deltas for
+// resolvePackEntries.
+class PackStreamParser {
+public:
+    PackStreamParser() : sha(EVP_MD_CTX_new()), objectSha(EVP_MD_CTX_new()) {
+        EVP_DigestInit_ex(sha, EVP_sha1(), nullptr);
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+    }
+    
+    ~PackStreamParser() {
+        if (inflating) {
+            inflateEnd(&strm);
+        }
+        EVP_MD_CTX_free(sha);
+        EVP_MD_CTX_free(objectSha);
+    }
+    
+    PackStreamParser(const PackStreamParser&) = delete;
+    PackStreamParser& operator=(const PackStreamParser&) = delete;
+    
+    void feed(const unsigned char* data, size_t length) {
+        while (length > 0) {
+            // The trailer is not part of its own checksum
+            bool hashed = state != State::Trailer && state != State::Done;
+            size_t used = 0;
+            switch (state) {
+            case State::Header:
+            case State::EntryHeader:
+                used = bufferHeader(data, length);
+                break;
+            case State::EntryData:
+                used = inflateData(data, length);
+                break;
+            case State::Trailer:
+                used = std::min(length, 20 - pending.length());
+                pending.append(reinterpret_cast<const char*>(data), used);
+                if (pending.length() == 20) {
+                    checkTrailer();
+                }
+                break;
+            case State::Done:
+                throw std::runtime_error("Packfile has trailing garbage after last object");
+            }
+            if (hashed) {
+                EVP_DigestUpdate(sha, data, used);
+            }
+            data += used;
+            length -= used;
+        }
+    }
+    
+    // Throw unless the whole pack, trailer included, has been fed
+    void finish() const {
+        if (state != State::Done) {
+            throw std::runtime_error("Truncated packfile");
+        }
+    }
+    
+    uint32_t objectCount() const { return objects; }
+    uint64_t bytesParsed() const { return offset; }
+    const std::string& checksum() const { return packChecksum; }
+    std::vector<PackIndexEntry>& entries() { return parsed; }
+    
+    // Pass base objects of up to sizeLimit bytes to onBaseObject with their
+    // content instead of hashing them here; it must fill in the entry's hash.
+    // Entries stay at a fixed address until the parser is destroyed.
+    void handOffBaseObjects(std::function<void(PackIndexEntry&, std::string)> callback, uint64_t sizeLimit) {
+        onBaseObject = std::move(callback);
+        handOffLimit = sizeLimit;
+    }
+    
+private:
+    enum class State { Header, EntryHeader, EntryData, Trailer, Done };
+    
+    // Length of the entry header at the start of data, or 0 while it is
+    // still incomplete
+    static size_t completeHeaderLength(const unsigned char* data, size_t length) {
+        size_t pos = 0;
+        while (pos < length && (data[pos] & 0x80)) {
+            pos++;
+        }
+        if (pos >= length) {
+            return 0;
+        }
+        int type = (data[0] >> 4) & 0x7;
+        pos++;
+        if (type == 6) {
+            while (pos < length && (data[pos] & 0x80)) {
+                pos++;
+            }
+            return pos < length ? pos + 1 : 0;
+        }
+        if (type == 7) {
+            return pos + 20 <= length ? pos + 20 : 0;
+        }
+        return pos;
+    }
+    
+    size_t bufferHeader(const unsigned char* data, size_t length) {
+        // Headers are at most 31 bytes, so 32 buffered bytes always hold one
+        size_t want = state == State::Header ? 12 : 32;
+        size_t used = std::min(length, want - pending.length());
+        pending.append(reinterpret_cast<const char*>(data), used);
+        const unsigned char* header = reinterpret_cast<const unsigned char*>(pending.data());
+        
+        if (state == State::Header) {
+            if (pending.length() < want) {
+                return used;
+            }
+            if (std::memcmp(header, "PACK", 4) != 0) {
+                throw std::runtime_error("Invalid packfile: missing PACK signature");
+            }
+            uint32_t version = (uint32_t(header[4]) << 24) | (uint32_t(header[5]) << 16) | (uint32_t(header[6]) << 8) | header[7];
+            if (version != 2 && version != 3) {
+                throw std::runtime_error("Unsupported packfile version " + std::to_string(version));
+            }
+            objects = (uint32_t(header[8]) << 24) | (uint32_t(header[9]) << 16) | (uint32_t(header[10]) << 8) | header[11];
+            parsed.reserve(objects);
+            pending.clear();
+            offset = 12;
+            nextEntry();
+            return used;
+        }
+        
+        size_t headerLength = completeHeaderLength(header, pending.length());
+        if (headerLength == 0) {
+            if (pending.length() >= want) {
+                throw std::runtime_error("Invalid pack entry header at offset " + std::to_string(offset));
+            }
+            return used;
+        }
+        
+        PackEntryHeader entry = parsePackEntryHeader(header, headerLength, offset, offset);
+        parsed.push_back({"", offset, offset + headerLength, 0, entry.type, 0,
+                          entry.size, entry.baseOffset, entry.baseHash, 0});
+        if (inflateInit(&strm) != Z_OK) {
+            throw std::runtime_error("Failed to initialize zlib decompression");
+        }
+        inflating = true;
+        inflated = 0;
+        entryCrc = crc32_z(0, header, headerLength);
+        bool base = entry.type >= 1 && entry.type <= 4;
+        collecting = base && onBaseObject && entry.size <= handOffLimit;
+        hashing = base && !collecting;
+        if (collecting) {
+            content.clear();
+            content.reserve(entry.size);
+        }
+        if (hashing) {
+            std::string objectHeader = std::string(packTypeName(entry.type)) + " " + std::to_string(entry.size);
+            objectHeader += '\0';
+            EVP_DigestInit_ex(objectSha, EVP_sha1(), nullptr);
+            EVP_DigestUpdate(objectSha, objectHeader.data(), objectHeader.length());
+        }
+        state = State::EntryData;
+        offset += headerLength;
+        
+        // The header was incomplete before this call, so every buffered byte
+        // past it came from data and is handed back for the zlib stream
+        size_t unused = pending.length() - headerLength;
+        pending.clear();
+        return used - unused;
+    }
+    
+    size_t inflateData(const unsigned char* data, size_t length) {
+        strm.next_in = const_cast<Bytef*>(data);
+        strm.avail_in = static_cast<uInt>(std::min<size_t>(length, 1u << 30));
+        uInt offered = strm.avail_in;
+        
+        int ret = Z_OK;
+        while (strm.avail_in > 0 && ret != Z_STREAM_END) {
+            strm.next_out = scratch;
+            strm.avail_out = sizeof(scratch);
+            ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                throw std::runtime_error("Failed to decompress pack entry at offset " +
+                                         std::to_string(parsed.back().offset));
+            }
+            size_t produced = sizeof(scratch) - strm.avail_out;
+            inflated += produced;
+            if (hashing) {
+                EVP_DigestUpdate(objectSha, scratch, produced);
+            } else if (collecting) {
+                content.append(reinterpret_cast<const char*>(scratch), produced);
+            }
+            if (ret == Z_BUF_ERROR) {
+                break;
+            }
+        }
+        
+        size_t consumed = offered - strm.avail_in;
+        offset += consumed;
+        entryCrc = crc32_z(entryCrc, data, consumed);
+        if (ret == Z_STREAM_END) {
+            inflateEnd(&strm);
+            inflating = false;
+            PackIndexEntry& entry = parsed.back();
+            if (inflated != entry.size) {
+                throw std::runtime_error("Inflated object size does not match its header");
+            }
+            entry.endOffset = offset;
+            if (hashing || collecting) {
+                entry.resolvedType = entry.type;
+                entry.crc32 = static_cast<uint32_t>(entryCrc);
+            }
+            if (hashing) {
+                unsigned char digest[EVP_MAX_MD_SIZE];
+                unsigned int digestLength = 0;
+                EVP_DigestFinal_ex(objectSha, digest, &digestLength);
+                entry.hash = toHex(digest, digestLength);
+            } else if (collecting) {
+                onBaseObject(entry, std::move(content));
+                content = std::string();
+            }
+            nextEntry();
+        }
+        return consumed;
+    }
+    
+    void nextEntry() {
+        state = parsed.size() < objects ? State::EntryHeader : State::Trailer;
+    }
+    
+    void checkTrailer() {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digestLength = 0;
+        EVP_DigestFinal_ex(sha, digest, &digestLength);
+        if (std::memcmp(digest, pending.data(), 20) != 0) {
+            throw std::runtime_error("Packfile checksum mismatch");
+        }
+        packChecksum = toHex(digest, 20);
+        state = State::Done;
+    }
+    
+    State state = State::Header;
+    std::string pending;
+    uint32_t objects = 0;
+    uint64_t offset = 0;
+    std::vector<PackIndexEntry> parsed;
+    EVP_MD_CTX* sha;
+    EVP_MD_CTX* objectSha;
+    z_stream strm{};
+    bool inflating = false;
+    bool hashing = false;
+    bool collecting = false;
+    std::string content;
+    std::function<void(PackIndexEntry&, std::string)> onBaseObject;
+    uint64_t handOffLimit = 0;
+    uint64_t inflated = 0;
+    unsigned long entryCrc = 0;
+    unsigned char scratch[16384];
+    std::string packChecksum;
+};
+
+// Write a version 2 pack index: fanout, sorted object ids, CRC-32s, 31-bit
+// offsets and a 64-bit offset table for entries beyond 2 GiB.
+void writePackIndex(const std::string& path, const std::vector<PackIndexEntry>& entries,
+                    const std::string& packChecksum) {
+    std::vector<size_t> order(entries.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return entries[a].hash < entries[b].hash;
+    });
+    
+    HashedFileWriter writer(path);
+    writer.write("\377tOc", 4);
+    writer.writeUint32(2);
+    
+    // fanout[i] is the number of objects whose first byte is <= i
+    size_t cursor = 0;
+    for (int i = 0; i < 256; i++) {
+        while (cursor < order.size() && (hexValue(entries[order[cursor]].hash[0]) << 4 | hexValue(entries[order[cursor]].hash[1])) <= i) {
+            cursor++;
+        }
+        writer.writeUint32(static_cast<uint32_t>(cursor));
+    }
+    
+    for (size_t i : order) {
+        writer.write(fromHex(entries[i].hash));
+    }
+    for (size_t i : order) {
+        writer.writeUint32(entries[i].crc32);
+    }
+    
+    std::vector<uint64_t> largeOffsets;
+    for (size_t i : order) {
+        if (entries[i].offset < 0x80000000ULL) {
+            writer.writeUint32(static_cast<uint32_t>(entries[i].offset));
+        } else {
+            writer.writeUint32(0x80000000U | static_cast<uint32_t>(largeOffsets.size()));
+            largeOffsets.push_back(entries[i].offset);
+        }
+    }
+    for (uint64_t offset : largeOffsets) {
+        writer.writeUint64(offset);
+    }
+    
+    writer.write(fromHex(packChecksum));
+    writer.finish();
+}
+
+// Write a .rev reverse index: the .idx position of every object, listed in
+// pack (offset) order, so readers can map offsets to positions without sorting
+void writePackReverseIndex(const std::string& path, const std::vector<PackIndexEntry>& entries,
+                           const std::string& packChecksum) {
+    std::vector<size_t> byHash(entries.size());
+    for (size_t i = 0; i < byHash.size(); i++) {
+        byHash[i] = i;
+    }
+    std::sort(byHash.begin(), byHash.end(), [&](size_t a, size_t b) {
+        return entries[a].hash < entries[b].hash;
+    });
+    
+    std::vector<uint32_t> byOffset(entries.size());
+    for (uint32_t position = 0; position < byOffset.size(); position++) {
+        byOffset[position] = position;
+    }
+    std::sort(byOffset.begin(), byOffset.end(), [&](uint32_t a, uint32_t b) {
+        return entries[byHash[a]].offset < entries[byHash[b]].offset;
+    });
+    
+    HashedFileWriter writer(path);
+    writer.write("RIDX", 4);
+    writer.writeUint32(1);
+    writer.writeUint32(1);
+    for (uint32_t position : byOffset) {
+        writer.writeUint32(position);
+    }
+    writer.write(fromHex(packChecksum));
+    writer.finish();
+}
+
+
+// Read-only mapping of an entire file
+class MappedFile {
+public:
+    // sequential tells the kernel the file will be read front to back, so it
+    // reads ahead aggressively and can drop pages once they are behind us
+    explicit MappedFile(const std::string& path, bool sequential = false) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open file: " + path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to stat file: " + path);
+        }
+        length = static_cast<size_t>(st.st_size);
+        if (length > 0) {
+            void* mapped = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Failed to mmap file: " + path);
+            }
+            bytes = static_cast<const unsigned char*>(mapped);
+            if (sequential) {
+                ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                ::madvise(mapped, length, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+    }
+    
+    ~MappedFile() {
+        if (bytes) {
+            ::munmap(const_cast<unsigned char*>(bytes), length);
+        }
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return length; }
+    
+private:
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+};
+
+uint32_t readUint32(const unsigned char* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+uint64_t readUint64(const unsigned char* p) {
+    return (uint64_t(readUint32(p)) << 32) | readUint32(p + 4);
+}
+
+// mmapped windows over pack files, shared by every open pack. A pack is mapped
+// in windows of core.packedGitWindowSize bytes (1 GiB by default) aligned to
+// half a window, so any offset has at least half a window mapped after it.
+// Once more than core.packedGitLimit bytes (8 GiB by default) are mapped the
+// least recently used windows are unmapped; a window still being read from is
+// only released when its last reader drops it.
+class PackWindowCache {
+public:
+    struct Window {
+        const unsigned char* data = nullptr;
+        size_t length = 0;
+        uint64_t offset = 0;
+        
+        ~Window() {
+            if (data) {
+                ::munmap(const_cast<unsigned char*>(data), length);
+            }
+        }
+    };
+    
+    PackWindowCache() {
+        size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        std::string size = readConfigValue("core.packedGitWindowSize");
+        std::string limit = readConfigValue("core.packedGitLimit");
+        windowSize = size.empty() ? (1ULL << 30) : parseByteSize(size);
+        mappedLimit = limit.empty() ? (8ULL << 30) : parseByteSize(limit);
+        windowSize = std::max<uint64_t>(2 * page, windowSize / (2 * page) * (2 * page));
+    }
+    
+    // Window of the file behind fd that contains offset
+    std::shared_ptr<const Window> acquire(const void* owner, int fd, uint64_t fileSize, uint64_t offset) {
+        uint64_t start = offset / (windowSize / 2) * (windowSize / 2);
+        std::lock_guard<std::mutex> lock(mutex);
+        
+        auto key = std::make_pair(owner, start);
+        auto found = windows.find(key);
+        if (found != windows.end()) {
+            lru.splice(lru.end(), lru, found->second);
+            return found->second->window;
+        }
+        
+        auto window = std::make_shared<Window>();
+        window->offset = start;
+        window->length = static_cast<size_t>(std::min<uint64_t>(windowSize, fileSize - start));
+        void* mapped = ::mmap(nullptr, window->length, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(start));
+        if (mapped == MAP_FAILED) {
+            // Address space may be exhausted by our own windows; drop them all and retry once
+            while (!lru.empty()) {
+                evictOldest();
+            }
+            mapped = ::mmap(nullptr, window->length, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(start));
+            if (mapped == MAP_FAILED) {
+                throw std::runtime_error("Failed to mmap pack window at offset " + std::to_string(start));
+            }
+        }
+        window->data = static_cast<const unsigned char*>(mapped);
+        
+        lru.push_back({owner, start, window});
+        windows[key] = std::prev(lru.end());
+        mappedBytes += window->length;
+        while (mappedBytes > mappedLimit && lru.size() > 1) {
+            evictOldest();
+        }
+        return window;
+    }
+    
+    // Forget every window of a pack that is being closed
+    void release(const void* owner) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = lru.begin(); it != lru.end();) {
+            if (it->owner == owner) {
+                windows.erase({it->owner, it->offset});
+                mappedBytes -= it->window->length;
+                it = lru.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    
+private:
+    struct Entry {
+        const void* owner;
+        uint64_t offset;
+        std::shared_ptr<const Window> window;
+    };
+    
+    void evictOldest() {
+        Entry& oldest = lru.front();
+        windows.erase({oldest.owner, oldest.offset});
+        mappedBytes -= oldest.window->length;
+        lru.pop_front();
+    }
+    
+    std::mutex mutex;
+    uint64_t windowSize = 0;
+    uint64_t mappedLimit = 0;
+    uint64_t mappedBytes = 0;
+    std::list<Entry> lru;
+    std::map<std::pair<const void*, uint64_t>, std::list<Entry>::iterator> windows;
+};
+
+PackWindowCache& packWindows() {
+    static PackWindowCache cache;
+    return cache;
+}
+
+// A pack and its mmapped .idx v2. Opening only maps the index and checks its
+// header; lookups use the fanout table and a binary search over the sorted ids.
+// The .pack is opened the first time an object is read from it and accessed
+// through the shared window cache, and the .rev reverse index is mapped the
+// first time pack order is needed. Packs without a .rev
+// fall back to sorting the offsets once.
+class PackFile {
+public:
+    explicit PackFile(const std::string& idxPath)
+        : idxPath(idxPath), packPath(idxPath.substr(0, idxPath.length() - 4) + ".pack"), idx(idxPath) {
+        const unsigned char* data = idx.data();
+        if (idx.size() < 8 + 1024 + 40 || std::memcmp(data, "\377tOc", 4) != 0 || readUint32(data + 4) != 2) {
+            throw std::runtime_error("Unsupported pack index: " + idxPath);
+        }
+        count = readUint32(data + 8 + 255 * 4);
+        // Every lookup trusts the fanout and the table sizes it implies, so a
+        // truncated or corrupt index is refused here rather than read past
+        for (int i = 1; i < 256; i++) {
+            if (readUint32(data + 8 + i * 4) < readUint32(data + 8 + (i - 1) * 4)) {
+                throw std::runtime_error("Corrupt pack index, fanout is not sorted: " + idxPath);
+            }
+        }
+        uint64_t tables = 8 + 1024 + static_cast<uint64_t>(count) * (20 + 4 + 4) + 40;
+        if (idx.size() < tables || (idx.size() - tables) % 8 != 0) {
+            throw std::runtime_error("Corrupt pack index, wrong size for " + std::to_string(count) +
+                                     " objects: " + idxPath);
+        }
+        largeOffsetCount = (idx.size() - tables) / 8;
+    }
+    
+    ~PackFile() {
+        packWindows().release(this);
+        if (packFd >= 0) {
+            ::close(packFd);
+        }
+    }
+    
+    PackFile(const PackFile&) = delete;
+    PackFile& operator=(const PackFile&) = delete;
+    
+    uint32_t objectCount() const { return count; }
+    const std::string& path() const { return packPath; }
+    
+    // Binary search the id table, narrowed by the fanout entry of the first byte
+    bool findPosition(const unsigned char* rawHash, uint32_t& position) const {
+        const unsigned char* fanout = idx.data() + 8;
+        uint32_t lo = rawHash[0] == 0 ? 0 : readUint32(fanout + (rawHash[0] - 1) * 4);
+        uint32_t hi = readUint32(fanout + rawHash[0] * 4);
+        const unsigned char* ids = fanout + 1024;
+        
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = std::memcmp(ids + static_cast<size_t>(mid) * 20, rawHash, 20);
+            if (cmp == 0) {
+                position = mid;
+                return true;
+            }
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return false;
+    }
+    
+    bool find(const unsigned char* rawHash, uint64_t& offset) const {
+        uint32_t position = 0;
+        if (!findPosition(rawHash, position)) {
+            return false;
+        }
+        offset = offsetAt(position);
+        return true;
+    }
+    
+    std::string packChecksum() const {
+        return toHex(idx.data() + idx.size() - 40, 20);
+    }
+    
+    const unsigned char* hashAt(uint32_t position) const {
+        return idx.data() + 8 + 1024 + static_cast<size_t>(position) * 20;
+    }
+    
+    uint64_t offsetAt(uint32_t position) const {
+        const unsigned char* offsets = idx.data() + 8 + 1024 + static_cast<size_t>(count) * 24;
+        uint32_t value = readUint32(offsets + static_cast<size_t>(position) * 4);
+        if (value & 0x80000000U) {
+            uint32_t index = value & 0x7FFFFFFFU;
+            if (index >= largeOffsetCount) {
+                throw std::runtime_error("Corrupt pack index, large offset " + std::to_string(index) +
+                                         " is out of range: " + idxPath);
+            }
+            const unsigned char* large = offsets + static_cast<size_t>(count) * 4;
+            return readUint64(large + static_cast<size_t>(index) * 8);
+        }
+        return value;
+    }
+    
+    // .idx position of the object at rank in pack order
+    uint32_t positionAtRank(uint32_t rank) const {
+        const ReverseIndex& reverse = reverseIndex();
+        if (reverse.file) {
+            return readUint32(reverse.file->data() + 12 + static_cast<size_t>(rank) * 4);
+        }
+        return reverse.positions[rank];
+    }
+    
+    // Rank in pack order of the object at offset, by binary search over the
+    // reverse index
+    bool rankOf(uint64_t offset, uint32_t& rank) const {
+        uint32_t lo = 0;
+        uint32_t hi = count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            uint64_t midOffset = offsetAt(positionAtRank(mid));
+            if (midOffset == offset) {
+                rank = mid;
+                return true;
+            }
+            if (midOffset < offset) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return false;
+    }
+    
+    // Bytes the entry at offset occupies in the pack, header included
+    uint64_t diskSizeAt(uint64_t offset) const {
+        uint32_t rank = 0;
+        if (!rankOf(offset, rank)) {
+            throw std::runtime_error("No object at offset " + std::to_string(offset) + " in " + packPath);
+        }
+        uint64_t next = rank + 1 < count ? offsetAt(positionAtRank(rank + 1)) : packSize() - 20;
+        return next - offset;
+    }
+    
+    // Inflate the object stored at offset, applying deltas. Returns the content
+    // and sets type to commit/tree/blob/tag.
+    std::string readObject(uint64_t offset, int& type) const {
+        PackEntryHeader header = readEntryHeader(offset);
+        std::string content;
+        inflateAt(offset + header.headerLength, header.size, &content);
+        
+        if (header.type == 6) {
+            std::string base = readObject(header.baseOffset, type);
+            return applyDelta(base, content);
+        }
+        if (header.type == 7) {
+            std::string base = readGitObject(header.baseHash);
+            size_t nullPos = base.find('\0');
+            type = packTypeFromName(base.substr(0, base.find(' ')));
+            return applyDelta(base.substr(nullPos + 1), content);
+        }
+        
+        type = header.type;
+        return content;
+    }
+    
+    // Inflated size of the object at offset. A delta records the size of its
+    // result at the start of its data, so only those bytes are inflated.
+    uint64_t sizeAt(uint64_t offset) const {
+        PackEntryHeader header = readEntryHeader(offset);
+        if (header.type != 6 && header.type != 7) {
+            return header.size;
+        }
+        std::shared_ptr<const PackWindowCache::Window> window;
+        uint64_t dataOffset = offset + header.headerLength;
+        std::string prefix = inflatePrefix([&](uint64_t position, size_t& available) {
+            uint64_t at = dataOffset + position;
+            window = windowAt(at);
+            available = usableLength(*window) - static_cast<size_t>(at - window->offset);
+            return window->data + (at - window->offset);
+        }, 20);
+        size_t pos = 0;
+        parseVarint(prefix, pos);       // size of the base
+        return parseVarint(prefix, pos);
+    }
+    
+    // Object type at offset, following delta headers to the base without inflating
+    int typeAt(uint64_t offset) const {
+        while (true) {
+            PackEntryHeader header = readEntryHeader(offset);
+            if (header.type == 6) {
+                offset = header.baseOffset;
+            } else if (header.type == 7) {
+                std::string rawBase = fromHex(header.baseHash);
+                if (!find(reinterpret_cast<const unsigned char*>(rawBase.data()), offset)) {
+                    int type = 0;
+                    readObjectContent(header.baseHash, type);
+                    return type;
+                }
+            } else {
+                return header.type;
+            }
+        }
+    }
+    
+private:
+    uint64_t packSize() const {
+        std::call_once(packOpened, [this] {
+            int fd = ::open(packPath.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Failed to open pack: " + packPath);
+            }
+            struct stat st;
+            char signature[4];
+            if (::fstat(fd, &st) != 0 || st.st_size < 32 || ::pread(fd, signature, 4, 0) != 4 ||
+                std::memcmp(signature, "PACK", 4) != 0) {
+                ::close(fd);
+                throw std::runtime_error("Invalid packfile: " + packPath);
+            }
+            packFd = fd;
+            packBytes = static_cast<uint64_t>(st.st_size);
+        });
+        return packBytes;
+    }
+    
+    std::shared_ptr<const PackWindowCache::Window> windowAt(uint64_t offset) const {
+        uint64_t size = packSize();
+        return packWindows().acquire(this, packFd, size, offset);
+    }
+    
+    // Bytes of the window usable from its start, stopping at the pack trailer
+    size_t usableLength(const PackWindowCache::Window& window) const {
+        return static_cast<size_t>(std::min(window.offset + window.length, packBytes - 20) - window.offset);
+    }
+    
+    PackEntryHeader readEntryHeader(uint64_t offset) const {
+        auto window = windowAt(offset);
+        return parsePackEntryHeader(window->data, usableLength(*window), offset, window->offset);
+    }
+    
+    // Inflate the zlib stream at dataOffset, moving across windows as needed
+    void inflateAt(uint64_t dataOffset, uint64_t size, std::string* out) const {
+        std::shared_ptr<const PackWindowCache::Window> window;
+        inflateStream([&](uint64_t position, size_t& available) {
+            uint64_t at = dataOffset + position;
+            window = windowAt(at);
+            available = usableLength(*window) - static_cast<size_t>(at - window->offset);
+            return window->data + (at - window->offset);
+        }, size, out);
+    }
+    
+    struct ReverseIndex {
+        std::unique_ptr<MappedFile> file;
+        std::vector<uint32_t> positions;
+    };
+    
+    const ReverseIndex& reverseIndex() const {
+        std::call_once(reverseLoaded, [this] {
+            std::string revPath = idxPath.substr(0, idxPath.length() - 4) + ".rev";
+            if (std::filesystem::exists(revPath)) {
+                auto file = std::make_unique<MappedFile>(revPath);
+                const unsigned char* data = file->data();
+                if (file->size() == 12 + static_cast<size_t>(count) * 4 + 40 && std::memcmp(data, "RIDX", 4) == 0 &&
+                    readUint32(data + 4) == 1 && readUint32(data + 8) == 1 &&
+                    std::memcmp(data + file->size() - 40, idx.data() + idx.size() - 40, 20) == 0) {
+                    reverse.file = std::move(file);
+                    return;
+                }
+                std::cerr << "Ignoring invalid reverse index: " << revPath << std::endl;
+            }
+            reverse.positions.resize(count);
+            for (uint32_t i = 0; i < count; i++) {
+                reverse.positions[i] = i;
+            }
+            std::sort(reverse.positions.begin(), reverse.positions.end(), [this](uint32_t a, uint32_t b) {
+                return offsetAt(a) < offsetAt(b);
+            });
+        });
+        return reverse;
+    }
+    
+    std::string idxPath;
+    std::string packPath;
+    MappedFile idx;
+    uint32_t count = 0;
+    uint64_t largeOffsetCount = 0;
+    mutable std::once_flag packOpened;
+    mutable int packFd = -1;
+    mutable uint64_t packBytes = 0;
+    mutable std::once_flag reverseLoaded;
+    mutable ReverseIndex reverse;
+};
+
+// Read side of .git/objects/pack/multi-pack-index: one fanout and sorted id
+// table covering many packs, mapping each object to (pack, offset). Opening
+// maps the file and reads the chunk table and pack names only.
+class MultiPackIndex {
+public:
+    explicit MultiPackIndex(const std::string& path) : file(path) {
+        const unsigned char* data = file.data();
+        if (file.size() < 12 + 20 || std::memcmp(data, "MIDX", 4) != 0 || data[4] != 1 || data[5] != 1) {
+            throw std::runtime_error("Unsupported multi-pack-index: " + path);
+        }
+        uint32_t chunkCount = data[6];
+        uint32_t packCount = readUint32(data + 8);
+        if (12 + (chunkCount + 1) * 12 > file.size()) {
+            throw std::runtime_error("Truncated multi-pack-index: " + path);
+        }
+        
+        for (uint32_t i = 0; i < chunkCount; i++) {
+            const unsigned char* chunk = data + 12 + i * 12;
+            uint64_t offset = readUint64(chunk + 4);
+            uint64_t next = readUint64(chunk + 16);
+            if (offset > next || next > file.size() - 20) {
+                throw std::runtime_error("Corrupt multi-pack-index chunk table: " + path);
+            }
+            std::string id(reinterpret_cast<const char*>(chunk), 4);
+            if (id == "PNAM") {
+                names = data + offset;
+                namesEnd = data + next;
+            } else if (id == "OIDF") {
+                fanout = data + offset;
+            } else if (id == "OIDL") {
+                ids = data + offset;
+            } else if (id == "OOFF") {
+                offsets = data + offset;
+            } else if (id == "LOFF") {
+                largeOffsets = data + offset;
+            }
+        }
+        if (!names || !fanout || !ids || !offsets) {
+            throw std::runtime_error("Multi-pack-index is missing a required chunk: " + path);
+        }
+        
+        count = readUint32(fanout + 255 * 4);
+        for (const unsigned char* p = names; p < namesEnd && packNames.size() < packCount; ) {
+            std::string name(reinterpret_cast<const char*>(p));
+            p += name.length() + 1;
+            packNames.push_back(name);
+        }
+        if (packNames.size() != packCount) {
+            throw std::runtime_error("Corrupt multi-pack-index pack names: " + path);
+        }
+    }
+    
+    // Index file names (pack-<checksum>.idx) in pack-int-id order
+    const std::vector<std::string>& packs() const { return packNames; }
+    uint32_t objectCount() const { return count; }
+    
+    const unsigned char* hashAt(uint32_t position) const {
+        return ids + static_cast<size_t>(position) * 20;
+    }
+    
+    uint32_t packAt(uint32_t position) const {
+        return readUint32(offsets + static_cast<size_t>(position) * 8);
+    }
+    
+    uint64_t offsetAt(uint32_t position) const {
+        uint32_t value = readUint32(offsets + static_cast<size_t>(position) * 8 + 4);
+        if ((value & 0x80000000U) && largeOffsets) {
+            return readUint64(largeOffsets + static_cast<size_t>(value & 0x7FFFFFFFU) * 8);
+        }
+        return value;
+    }
+    
+    bool find(const unsigned char* rawHash, uint32_t& pack, uint64_t& offset) const {
+        uint32_t lo = rawHash[0] == 0 ? 0 : readUint32(fanout + (rawHash[0] - 1) * 4);
+        uint32_t hi = readUint32(fanout + rawHash[0] * 4);
+        
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = std::memcmp(hashAt(mid), rawHash, 20);
+            if (cmp == 0) {
+                pack = packAt(mid);
+                offset = offsetAt(mid);
+                return true;
+            }
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return false;
+    }
+    
+private:
+    MappedFile file;
+    const unsigned char* names = nullptr;
+    const unsigned char* namesEnd = nullptr;
+    const unsigned char* fanout = nullptr;
+    const unsigned char* ids = nullptr;
+    const unsigned char* offsets = nullptr;
+    const unsigned char* largeOffsets = nullptr;
+    uint32_t count = 0;
+    std::vector<std::string> packNames;
+};
+
+// All packs of the current repository and of its alternates, discovered on
+// first use. In each object directory, ours first, objects are looked up in
+// the multi-pack-index first; only packs it does not cover are probed one by
+// one.
+class PackStore {
+public:
+    bool read(const std::string& hash, std::string& objectData) {
+        PackFile* pack = nullptr;
+        uint64_t offset = 0;
+        if (!locate(hash, pack, offset)) {
+            return false;
+        }
+        int type = 0;
+        std::string content = pack->readObject(offset, type);
+        objectData = std::string(packTypeName(type)) + " " + std::to_string(content.length()) + '\0' + content;
+        return true;
+    }
+    
+    // Type and inflated size of the object, read from entry headers
+    bool header(const std::string& hash, int& type, uint64_t& size) {
+        PackFile* pack = nullptr;
+        uint64_t offset = 0;
+        if (!locate(hash, pack, offset)) {
+            return false;
+        }
+        type = pack->typeAt(offset);
+        size = pack->sizeAt(offset);
+        return true;
+    }
+    
+    // Size of the object's entry in its pack, as stored (compressed, and as a
+    // delta when it is one)
+    bool diskSize(const std::string& hash, uint64_t& size) {
+        PackFile* pack = nullptr;
+        uint64_t offset = 0;
+        if (!locate(hash, pack, offset)) {
+            return false;
+        }
+        size = pack->diskSizeAt(offset);
+        return true;
+    }
+    
+    // Forget the current pack list so packs written by this process are seen
+    void reload() {
+        std::lock_guard<std::mutex> lock(mutex);
+        loaded = false;
+        directories.clear();
+    }
+    
+private:
+    // The packs of one object directory
+    struct PackDirectory {
+        std::string path;
+        std::unique_ptr<MultiPackIndex> midx;
+        std::vector<std::unique_ptr<PackFile>> midxPacks;
+        std::vector<std::unique_ptr<PackFile>> packs;
+    };
+    
+    bool locate(const std::string& hash, PackFile*& pack, uint64_t& offset) {
+        std::string rawHash = fromHex(hash);
+        const unsigned char* raw = reinterpret_cast<const unsigned char*>(rawHash.data());
+        load();
+        
+        for (auto& directory : directories) {
+            uint32_t packId = 0;
+            if (directory.midx && directory.midx->find(raw, packId, offset)) {
+                pack = &midxPack(directory, packId);
+                return true;
+            }
+            for (const auto& candidate : directory.packs) {
+                if (candidate->find(raw, offset)) {
+                    pack = candidate.get();
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    void load() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (loaded) {
+            return;
+        }
+        loaded = true;
+        
+        loadDirectory(".git/objects/pack");
+        for (const auto& dir : alternateObjectDirs()) {
+            loadDirectory((dir / "pack").string());
+        }
+    }
+    
+    void loadDirectory(const std::string& packDir) {
+        if (!std::filesystem::is_directory(packDir)) {
+            return;
+        }
+        PackDirectory& directory = directories.emplace_back();
+        directory.path = packDir;
+        
+        std::vector<std::string> covered;
+        if (std::filesystem::exists(packDir + "/multi-pack-index")) {
+            directory.midx = std::make_unique<MultiPackIndex>(packDir + "/multi-pack-index");
+            covered = directory.midx->packs();
+            directory.midxPacks.resize(covered.size());
+            std::sort(covered.begin(), covered.end());
+        }
+        
+        for (const auto& entry : std::filesystem::directory_iterator(packDir)) {
+            std::string name = entry.path().filename().string();
+            if (entry.path().extension() == ".idx" && !std::binary_search(covered.begin(), covered.end(), name)) {
+                directory.packs.push_back(std::make_unique<PackFile>(entry.path().string()));
+            }
+        }
+    }
+    
+    PackFile& midxPack(PackDirectory& directory, uint32_t packId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (packId >= directory.midxPacks.size()) {
+            throw std::runtime_error("Invalid pack id in multi-pack-index");
+        }
+        if (!directory.midxPacks[packId]) {
+            directory.midxPacks[packId] = std::make_unique<PackFile>(directory.path + "/" + directory.midx->packs()[packId]);
+        }
+        return *directory.midxPacks[packId];
+    }
+    
+    std::mutex mutex;
+    bool loaded = false;
+    std::vector<PackDirectory> directories;
+};
+
+PackStore& packStore() {
+    // The window cache is created first so it outlives the packs in the store
+    packWindows();
+    static PackStore store;
+    return store;
+}
+
+// Whether the object is stored loose or in a pack, here or in an alternate,
+// without reading it
+bool objectExists(const std::string& hash) {
+    if (std::filesystem::exists(".git/objects/" + hash.substr(0, 2) + "/" + hash.substr(2))) {
+        return true;
+    }
+    uint64_t size = 0;
+    return packStore().diskSize(hash, size) || !alternateLoosePath(hash).empty();
+}
+
+// Type and size of an object from its loose or pack entry header, inflating
+// only the first bytes of the object rather than all of it
+uint64_t readObjectHeader(const std::string& hash, int& type) {
+    std::string loosePath = ".git/objects/" + hash.substr(0, 2) + "/" + hash.substr(2);
+    uint64_t size = 0;
+    if (!std::filesystem::exists(loosePath)) {
+        if (packStore().header(hash, type, size)) {
+            return size;
+        }
+        loosePath = alternateLoosePath(hash);
+        if (loosePath.empty()) {
+            // A promised object has to be fetched first
+            return readObjectContent(hash, type).length();
+        }
+    }
+    
+    // Only the first blocks of the file are read, however large the object
+    std::ifstream file(loosePath, std::ios::binary);
+    char block[4096];
+    std::string prefix = inflatePrefix([&](uint64_t, size_t& available) {
+        file.read(block, sizeof(block));
+        available = static_cast<size_t>(file.gcount());
+        return reinterpret_cast<const unsigned char*>(block);
+    }, 64);
+    size_t spacePos = prefix.find(' ');
+    size_t nullPos = prefix.find('\0');
+    if (spacePos == std::string::npos || nullPos == std::string::npos || spacePos > nullPos) {
+        throw std::runtime_error("Invalid git object format: " + hash);
+    }
+    type = packTypeFromName(prefix.substr(0, spacePos));
+    return std::stoull(prefix.substr(spacePos + 1, nullPos - spacePos - 1));
+}
+
+// Remote that a partial clone's omitted objects can be fetched from, or an
+// empty string for a complete repository
+std::string promisorRemote() {
+    return readConfigValue("extensions.partialClone");
+}
+
+bool readPackedObject(const std::string& hash, std::string& objectData) {
+    return packStore().read(hash, objectData);
+}
+
+// Write .git/objects/pack/multi-pack-index covering every pack. Entries for
+// packs the existing file already covers are carried over from it, so only the
+// indexes of newly added packs are read. When an object is in several packs
+// the copy in the most recently modified pack wins.
+void writeMultiPackIndex() {
+    std::string packDir = ".git/objects/pack";
+    std::string midxPath = packDir + "/multi-pack-index";
+    
+    std::vector<std::string> names;
+    if (std::filesystem::is_directory(packDir)) {
+        for (const auto& entry : std::filesystem::directory_iterator(packDir)) {
+            if (entry.path().extension() == ".idx") {
+                names.push_back(entry.path().filename().string());
+            }
+        }
+    }
+    std::sort(names.begin(), names.end());
+    
+    std::vector<std::filesystem::file_time_type> mtimes;
+    for (const auto& name : names) {
+        mtimes.push_back(std::filesystem::last_write_time(packDir + "/" + name));
+    }
+    
+    struct MidxEntry {
+        unsigned char hash[20];
+        uint32_t pack;
+        uint64_t offset;
+    };
+    std::vector<MidxEntry> entries;
+    std::vector<bool> covered(names.size(), false);
+    
+    auto packIdOf = [&](const std::string& name) -> int64_t {
+        auto it = std::lower_bound(names.begin(), names.end(), name);
+        return it != names.end() && *it == name ? it - names.begin() : -1;
+    };
+    
+    std::unique_ptr<MultiPackIndex> existing;
+    try {
+        if (std::filesystem::exists(midxPath)) {
+            existing = std::make_unique<MultiPackIndex>(midxPath);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Rewriting unreadable multi-pack-index: " << e.what() << std::endl;
+    }
+    
+    if (existing) {
+        std::vector<int64_t> remap;
+        for (const auto& name : existing->packs()) {
+            remap.push_back(packIdOf(name));
+            if (remap.back() >= 0) {
+                covered[remap.back()] = true;
+            }
+        }
+        for (uint32_t i = 0; i < existing->objectCount(); i++) {
+            int64_t pack = remap[existing->packAt(i)];
+            if (pack >= 0) {
+                MidxEntry entry;
+                std::memcpy(entry.hash, existing->hashAt(i), 20);
+                entry.pack = static_cast<uint32_t>(pack);
+                entry.offset = existing->offsetAt(i);
+                entries.push_back(entry);
+            }
+        }
+    }
+    
+    size_t added = 0;
+    for (size_t p = 0; p < names.size(); p++) {
+        if (covered[p]) {
+            continue;
+        }
+        PackFile pack(packDir + "/" + names[p]);
+        for (uint32_t i = 0; i < pack.objectCount(); i++) {
+            MidxEntry entry;
+            std::memcpy(entry.hash, pack.hashAt(i), 20);
+            entry.pack = static_cast<uint32_t>(p);
+            entry.offset = pack.offsetAt(i);
+            entries.push_back(entry);
+        }
+        added++;
+    }
+    existing.reset();
+    
+    std::sort(entries.begin(), entries.end(), [&](const MidxEntry& a, const MidxEntry& b) {
+        int cmp = std::memcmp(a.hash, b.hash, 20);
+        if (cmp != 0) {
+            return cmp < 0;
+        }
+        return mtimes[a.pack] > mtimes[b.pack];
+    });
+    entries.erase(std::unique(entries.begin(), entries.end(), [](const MidxEntry& a, const MidxEntry& b) {
+        return std::memcmp(a.hash, b.hash, 20) == 0;
+    }), entries.end());
+    
+    std::string packNames;
+    for (const auto& name : names) {
+        packNames += name + '\0';
+    }
+    while (packNames.length() % 4 != 0) {
+        packNames += '\0';
+    }
+    
+    std::vector<uint64_t> largeOffsets;
+    for (const auto& entry : entries) {
+        if (entry.offset >= 0x80000000ULL) {
+            largeOffsets.push_back(entry.offset);
+        }
+    }
+    
+    std::vector<std::pair<std::string, uint64_t>> chunks = {
+        {"PNAM", packNames.length()},
+        {"OIDF", 256 * 4},
+        {"OIDL", entries.size() * 20},
+        {"OOFF", entries.size() * 8},
+    };
+    if (!largeOffsets.empty()) {
+        chunks.push_back({"LOFF", largeOffsets.size() * 8});
+    }
+    
+    std::string tmpPath = packDir + "/tmp_midx_" + std::to_string(::getpid());
+    HashedFileWriter writer(tmpPath);
+    writer.write("MIDX", 4);
+    unsigned char header[4] = {1, 1, static_cast<unsigned char>(chunks.size()), 0};
+    writer.write(header, sizeof(header));
+    writer.writeUint32(static_cast<uint32_t>(names.size()));
+    
+    uint64_t chunkOffset = 12 + (chunks.size() + 1) * 12;
+    for (const auto& chunk : chunks) {
+        writer.write(chunk.first);
+        writer.writeUint64(chunkOffset);
+        chunkOffset += chunk.second;
+    }
+    writer.writeUint32(0);
+    writer.writeUint64(chunkOffset);
+    
+    writer.write(packNames);
+    
+    size_t cursor = 0;
+    for (int i = 0; i < 256; i++) {
+        while (cursor < entries.size() && entries[cursor].hash[0] <= i) {
+            cursor++;
+        }
+        writer.writeUint32(static_cast<uint32_t>(cursor));
+    }
+    for (const auto& entry : entries) {
+        writer.write(entry.hash, 20);
+    }
+    
+    uint32_t largeIndex = 0;
+    for (const auto& entry : entries) {
+        writer.writeUint32(entry.pack);
+        if (entry.offset >= 0x80000000ULL) {
+            writer.writeUint32(0x80000000U | largeIndex++);
+        } else {
+            writer.writeUint32(static_cast<uint32_t>(entry.offset));
+        }
+    }
+    for (uint64_t offset : largeOffsets) {
+        writer.writeUint64(offset);
+    }
+    
+    writer.finish();
+    std::filesystem::rename(tmpPath, midxPath);
+    packStore().reload();
+    
+    std::cerr << "Wrote multi-pack-index with " << entries.size() << " objects from " << names.size()
+              << " packs (" << added << " newly indexed)" << std::endl;
+}
+
+// FIFO between pipeline stages, bounded by the total cost (usually bytes) of
+// what it holds. push blocks while the queue is over capacity, so a slow
+// consumer throttles its producer instead of letting the backlog grow. Any
+// number of threads may push and pop.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+    
+    // Returns false if the queue was closed, in which case item is dropped
+    bool push(T item, size_t cost) {
+        std::unique_lock<std::mutex> lock(mutex);
+        // An item costlier than the whole budget still enters an empty queue
+        notFull.wait(lock, [&] { return closed || queuedCost == 0 || queuedCost + cost <= capacity; });
+        if (closed) {
+            return false;
+        }
+        queuedCost += cost;
+        items.emplace_back(std::move(item), cost);
+        notEmpty.notify_one();
+        return true;
+    }
+    
+    // Returns false once the queue is closed and drained
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front().first);
+        queuedCost -= items.front().second;
+        items.pop_front();
+        notFull.notify_all();
+        return true;
+    }
+    
+    // No more pushes; consumers drain what is queued
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+    
+    // Drop anything still queued and wake both sides
+    void abort() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        items.clear();
+        queuedCost = 0;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+    
+private:
+    const size_t capacity;
+    std::deque<std::pair<T, size_t>> items;
+    size_t queuedCost = 0;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+// Throughput counters for one pipeline stage. busy counts only time spent
+// working, summed over the stage's threads, not time blocked on a neighbour,
+// so the stage with the largest busy time per thread bounds the pipeline. A
+// stage that waits on something outside the pipeline, like the network,
+// records elapsed wall time instead and is reported as such.
+struct PipelineStage {
+    explicit PipelineStage(std::string name, bool elapsed = false) : name(std::move(name)), elapsed(elapsed) {}
+    
+    void record(uint64_t itemCount, uint64_t byteCount, std::chrono::steady_clock::duration busy) {
+        items += itemCount;
+        bytes += byteCount;
+        busyNanos += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count());
+    }
+    
+    const std::string name;
+    const bool elapsed;
+    std::atomic<uint64_t> items{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> busyNanos{0};
+};
+
+void reportPipeline(const std::vector<const PipelineStage*>& stages, std::chrono::steady_clock::duration elapsed) {
+    auto seconds = [](double nanos) { return nanos / 1e9; };
+    std::cerr << std::fixed << std::setprecision(2);
+    for (const PipelineStage* stage : stages) {
+        double busy = seconds(static_cast<double>(stage->busyNanos));
+        double mib = static_cast<double>(stage->bytes) / (1 << 20);
+        std::cerr << "  " << std::left << std::setw(9) << stage->name << std::right
+                  << std::setw(9) << stage->items << " items " << std::setw(9) << mib << " MiB "
+                  << std::setw(7) << busy << (stage->elapsed ? " s elapsed" : " s busy   ");
+        if (busy > 0) {
+            std::cerr << std::setw(10) << mib / busy << " MiB/s";
+        }
+        std::cerr << '\n';
+    }
+    std::cerr << "  elapsed  " << seconds(static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()))
+              << " s" << std::endl;
+    std::cerr << std::defaultfloat;
+}
+
+// Append the objects a thin pack's ref-deltas are based on, read from the
+// local store, so that the pack stands on its own. The entry count in the
+// header and the trailing checksum are rewritten to cover them, and the
+// deltas that were waiting on them are resolved. Returns the new checksum.
+std::string completeThinPack(const std::string& path, std::vector<PackIndexEntry>& entries, WorkStealingPool& pool,
+                             uint64_t baseCacheLimit) {
+    std::vector<size_t> pending;
+    std::vector<std::string> bases;
+    std::unordered_set<std::string> seen;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (!entries[i].hash.empty()) {
+            continue;
+        }
+        pending.push_back(i);
+        // A base that is itself an unresolved delta in this pack is not here
+        // yet, and resolves along with the rest
+        const std::string& base = entries[i].baseHash;
+        if (entries[i].type == 7 && objectExists(base) && seen.insert(base).second) {
+            bases.push_back(base);
+        }
+    }
+    
+    uint64_t offset = std::filesystem::file_size(path) - 20;
+    std::filesystem::resize_file(path, offset);
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        for (const auto& base : bases) {
+            int type = 0;
+            std::string content = readObjectContent(base, type);
+            std::string header = encodePackEntryHeader(type, content.length());
+            std::vector<char> compressed = compressZlib(content);
+            uLong crc = crc32_z(0, reinterpret_cast<const Bytef*>(header.data()), header.length());
+            crc = crc32_z(crc, reinterpret_cast<const Bytef*>(compressed.data()), compressed.size());
+            
+            uint64_t dataOffset = offset + header.length();
+            entries.push_back({base, offset, dataOffset, dataOffset + compressed.size(), type, type,
+                               content.length(), 0, "", static_cast<uint32_t>(crc)});
+            pending.push_back(entries.size() - 1);
+            out.write(header.data(), header.length());
+            out.write(compressed.data(), compressed.size());
+            offset = dataOffset + compressed.size();
+        }
+        if (!out) {
+            throw std::runtime_error("Failed to write pack file: " + path);
+        }
+    }
+    {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        uint32_t count = static_cast<uint32_t>(entries.size());
+        char countBytes[4] = {static_cast<char>(count >> 24), static_cast<char>(count >> 16),
+                              static_cast<char>(count >> 8), static_cast<char>(count)};
+        file.seekp(8);
+        file.write(countBytes, sizeof(countBytes));
+        if (!file) {
+            throw std::runtime_error("Failed to write pack file: " + path);
+        }
+    }
+    
+    std::string checksum;
+    {
+        MappedFile pack(path);
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        SHA1(pack.data(), pack.size(), digest);
+        checksum = toHex(digest, SHA_DIGEST_LENGTH);
+        
+        // Only the objects still waiting are resolved again
+        std::vector<PackIndexEntry> waiting;
+        for (size_t i : pending) {
+            waiting.push_back(entries[i]);
+        }
+        size_t unresolved = resolvePackEntries(pack.data(), waiting, pool, nullptr, baseCacheLimit);
+        if (unresolved > 0) {
+            throw std::runtime_error("Packfile has " + std::to_string(unresolved) + " unresolved deltas");
+        }
+        for (size_t i = 0; i < pending.size(); i++) {
+            entries[pending[i]] = std::move(waiting[i]);
+        }
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::app);
+    out.write(fromHex(checksum).data(), SHA_DIGEST_LENGTH);
+    if (!out) {
+        throw std::runtime_error("Failed to write pack file: " + path);
+    }
+    
+    std::cerr << "Completed thin pack with " << bases.size() << " local objects" << std::endl;
+    return checksum;
+}
+
+// Receives a pack as it arrives and stores it verbatim under .git/objects/pack
+// together with a freshly generated .idx and .rev, instead of exploding it into
+// loose objects. Data is written straight to a temporary file while a
+// PackStreamParser finds the entry boundaries, so the pack is never held in
+// memory; finish() then resolves deltas against the mapped file. All files are
+// renamed into place, .idx last, so readers never see an index without its pack.
+class PackReceiver {
+public:
+    // threads sizes both the hash stage and the delta resolution pool; 0 picks
+    // one per core. A memoryLimit caps what the stages hold: the chunk queue
+    // gets 1/16 of it, the hash queue 1/8 and the delta base cache 1/2, which
+    // leaves the rest for objects in flight on the workers and the entry table.
+    // A spooled path names a pack already written to the pack directory: its
+    // bytes are still passed to write() to be scanned, but the file itself is
+    // indexed and moved into place rather than written again.
+    explicit PackReceiver(unsigned threads = 0, uint64_t memoryLimit = 0, const std::string& spooled = "")
+        : threads(threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads),
+          baseCacheLimit(memoryLimit ? memoryLimit / 2 : UINT64_MAX),
+          chunkQueue(memoryLimit ? std::min<uint64_t>(chunkCapacity, memoryLimit / 16) : chunkCapacity),
+          hashQueue(memoryLimit ? std::min<uint64_t>(hashCapacity, memoryLimit / 8) : hashCapacity),
+          started(std::chrono::steady_clock::now()) {
+        std::filesystem::create_directories(packDir);
+        std::string suffix = std::to_string(::getpid());
+        tmpPack = spooled.empty() ? packDir + "/tmp_pack_" + suffix : spooled;
+        tmpIdx = packDir + "/tmp_idx_" + suffix;
+        tmpRev = packDir + "/tmp_rev_" + suffix;
+        
+        if (spooled.empty()) {
+            packFile.open(tmpPack, std::ios::binary);
+            if (!packFile) {
+                throw std::runtime_error("Failed to create pack file: " + tmpPack);
+            }
+        }
+        
+        uint64_t handOffLimit = std::min<uint64_t>(1 << 20, (memoryLimit ? memoryLimit / 8 : hashCapacity) / 4);
+        parser.handOffBaseObjects([this](PackIndexEntry& entry, std::string content) {
+            size_t cost = content.length();
+            auto start = std::chrono::steady_clock::now();
+            hashQueue.push({&entry, std::move(content)}, cost);
+            scanBlocked += std::chrono::steady_clock::now() - start;
+        }, handOffLimit);
+        for (unsigned i = 0; i < this->threads; i++) {
+            hashers.emplace_back([this] { hash(); });
+        }
+        scanner = std::thread([this] { scan(); });
+    }
+    
+    ~PackReceiver() {
+        chunkQueue.abort();
+        hashQueue.abort();
+        joinStages();
+        if (!finished) {
+            packFile.close();
+            std::filesystem::remove(tmpPack);
+            std::filesystem::remove(tmpIdx);
+            std::filesystem::remove(tmpRev);
+        }
+    }
+    
+    PackReceiver(const PackReceiver&) = delete;
+    PackReceiver& operator=(const PackReceiver&) = delete;
+    
+    // Queue received bytes for the scan stage, which writes them to disk and
+    // finds object boundaries while the caller goes back to the network.
+    // Blocks while more than chunkCapacity bytes are waiting.
+    void write(const char* data, size_t length) {
+        if (!chunkQueue.push(std::string(data, length), length)) {
+            rethrowStageError();
+            throw std::runtime_error("Pack receiver is closed");
+        }
+        receivedBytes += length;
+        receivedChunks++;
+    }
+    
+    uint64_t bytesReceived() const { return receivedBytes; }
+    
+    // Index the complete pack and move it into place. Returns its checksum.
+    std::string finish() {
+        // Receiving is over once the caller stops writing. Most of that time
+        // is spent waiting on the network, so it is reported as elapsed
+        receiveStage.record(receivedChunks, receivedBytes, std::chrono::steady_clock::now() - started);
+        chunkQueue.close();
+        if (scanner.joinable()) {
+            scanner.join();
+        }
+        hashQueue.close();
+        joinStages();
+        rethrowStageError();
+        parser.finish();
+        if (packFile.is_open()) {
+            packFile.close();
+            if (!packFile) {
+                throw std::runtime_error("Failed to write pack file: " + tmpPack);
+            }
+        }
+        
+        std::vector<PackIndexEntry>& entries = parser.entries();
+        std::string checksum = parser.checksum();
+        WorkStealingPool pool(threads);
+        {
+            auto start = std::chrono::steady_clock::now();
+            size_t unresolved = 0;
+            uint64_t packSize = 0;
+            {
+                MappedFile pack(tmpPack);
+                std::cerr << "Indexing " << entries.size() << " objects using " << pool.size() << " threads" << std::endl;
+                unresolved = resolvePackEntries(pack.data(), entries, pool, nullptr, baseCacheLimit);
+                packSize = pack.size();
+            }
+            // Deltas against objects outside the pack: a thin pack
+            if (unresolved > 0) {
+                checksum = completeThinPack(tmpPack, entries, pool, baseCacheLimit);
+            }
+            resolveStage.record(entries.size(), packSize, std::chrono::steady_clock::now() - start);
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        pool.submit([&] { writePackIndex(tmpIdx, entries, checksum); });
+        pool.submit([&] { writePackReverseIndex(tmpRev, entries, checksum); });
+        pool.wait();
+        indexStage.record(2, entries.size() * 28, std::chrono::steady_clock::now() - start);
+        
+        std::string base = packDir + "/pack-" + checksum;
+        std::filesystem::rename(tmpPack, base + ".pack");
+        std::filesystem::rename(tmpRev, base + ".rev");
+        std::filesystem::rename(tmpIdx, base + ".idx");
+        finished = true;
+        
+        // Keep an existing multi-pack-index current
+        if (std::filesystem::exists(packDir + "/multi-pack-index")) {
+            writeMultiPackIndex();
+        } else {
+            packStore().reload();
+        }
+        
+        std::cerr << "Stored pack " << checksum << " with " << entries.size() << " objects" << std::endl;
+        return checksum;
+    }
+    
+    std::vector<const PipelineStage*> stages() const {
+        return {&receiveStage, &scanStage, &hashStage, &resolveStage, &indexStage};
+    }
+    
+private:
+    static constexpr size_t chunkCapacity = 16 << 20;
+    static constexpr size_t hashCapacity = 64 << 20;
+    
+    struct HashJob {
+        PackIndexEntry* entry = nullptr;
+        std::string content;
+    };
+    
+    // Stage 2: persist the bytes and find object boundaries. Small base
+    // objects leave here inflated, for the hash stage.
+    void scan() {
+        try {
+            std::string chunk;
+            while (chunkQueue.pop(chunk)) {
+                auto start = std::chrono::steady_clock::now();
+                scanBlocked = std::chrono::steady_clock::duration::zero();
+                size_t before = parser.entries().size();
+                parser.feed(reinterpret_cast<const unsigned char*>(chunk.data()), chunk.length());
+                if (packFile.is_open()) {
+                    packFile.write(chunk.data(), chunk.length());
+                    if (!packFile) {
+                        throw std::runtime_error("Failed to write pack file: " + tmpPack);
+                    }
+                }
+                // Time blocked on a full hash queue belongs to the hash stage
+                scanStage.record(parser.entries().size() - before, chunk.length(),
+                                 std::chrono::steady_clock::now() - start - scanBlocked);
+            }
+        } catch (...) {
+            failStages(std::current_exception());
+        }
+    }
+    
+    // Stage 3, on every hasher thread: object ids of the handed-off bases
+    void hash() {
+        try {
+            HashJob job;
+            while (hashQueue.pop(job)) {
+                auto start = std::chrono::steady_clock::now();
+                job.entry->hash = hashObject(packTypeName(job.entry->type), job.content);
+                hashStage.record(1, job.content.length(), std::chrono::steady_clock::now() - start);
+            }
+        } catch (...) {
+            failStages(std::current_exception());
+        }
+    }
+    
+    // Keep the first error and unblock every stage; write() and finish()
+    // report it
+    void failStages(std::exception_ptr error) {
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!stageError) {
+                stageError = error;
+            }
+        }
+        chunkQueue.abort();
+        hashQueue.abort();
+    }
+    
+    void rethrowStageError() {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (stageError) {
+            std::rethrow_exception(stageError);
+        }
+    }
+    
+    void joinStages() {
+        if (scanner.joinable()) {
+            scanner.join();
+        }
+        for (auto& hasher : hashers) {
+            if (hasher.joinable()) {
+                hasher.join();
+            }
+        }
+    }
+    
+    const std::string packDir = ".git/objects/pack";
+    const unsigned threads;
+    const uint64_t baseCacheLimit;
+    std::string tmpPack;
+    std::string tmpIdx;
+    std::string tmpRev;
+    std::ofstream packFile;
+    PackStreamParser parser;
+    BoundedQueue<std::string> chunkQueue;
+    BoundedQueue<HashJob> hashQueue;
+    std::thread scanner;
+    std::vector<std::thread> hashers;
+    std::mutex errorMutex;
+    std::exception_ptr stageError;
+    
+    const std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::duration scanBlocked{0};
+    uint64_t receivedBytes = 0;
+    uint64_t receivedChunks = 0;
+    PipelineStage receiveStage{"receive", true};
+    PipelineStage scanStage{"scan"};
+    PipelineStage hashStage{"hash"};
+    PipelineStage resolveStage{"resolve"};
+    PipelineStage indexStage{"index"};
+    bool finished = false;
+};
+
+// Store a pack that was spooled to a file in the pack directory, which
+// becomes the stored pack itself; see PackReceiver
+std::string storeSpooledPack(const std::string& path, unsigned threads) {
+    PackReceiver receiver(threads, 0, path);
+    {
+        MappedFile pack(path, true);
+        const char* data = reinterpret_cast<const char*>(pack.data());
+        for (size_t pos = 0; pos < pack.size(); pos += 1 << 20) {
+            receiver.write(data + pos, std::min<size_t>(1 << 20, pack.size() - pos));
+        }
+    }
+    return receiver.finish();
+}
+
+// Rolling-hash index over the fixed-size blocks of a delta base. A target is
+// scanned with the same rolling hash and every hit is verified and extended
+// into a copy instruction; everything else becomes literal inserts.
+class DeltaIndex {
+public:
+    static constexpr size_t blockSize = 16;
+    static constexpr size_t maxBucketEntries = 64;
+    
+    explicit DeltaIndex(std::shared_ptr<const std::string> base) : base(std::move(base)) {
+        const std::string& source = *this->base;
+        if (source.length() < blockSize || source.length() >= 0xFFFFFFFFULL) {
+            return;
+        }
+        
+        size_t blocks = source.length() / blockSize;
+        size_t buckets = 1;
+        while (buckets < blocks) {
+            buckets <<= 1;
+        }
+        mask = buckets - 1;
+        
+        // Counting sort of block offsets into buckets, capping crowded buckets
+        std::vector<uint32_t> hashes(blocks);
+        std::vector<uint32_t> counts(buckets, 0);
+        for (size_t b = 0; b < blocks; b++) {
+            hashes[b] = blockHash(reinterpret_cast<const unsigned char*>(source.data()) + b * blockSize);
+            uint32_t& count = counts[hashes[b] & mask];
+            if (count < maxBucketEntries) {
+                count++;
+            }
+        }
+        
+        bucketStart.assign(buckets + 1, 0);
+        for (size_t i = 0; i < buckets; i++) {
+            bucketStart[i + 1] = bucketStart[i] + counts[i];
+        }
+        offsets.resize(bucketStart[buckets]);
+        std::vector<uint32_t> fill(bucketStart.begin(), bucketStart.end() - 1);
+        for (size_t b = 0; b < blocks; b++) {
+            size_t bucket = hashes[b] & mask;
+            if (fill[bucket] < bucketStart[bucket + 1]) {
+                offsets[fill[bucket]++] = static_cast<uint32_t>(b * blockSize);
+            }
+        }
+    }
+    
+    const std::string& source() const { return *base; }
+    
+    size_t memoryUsage() const {
+        return base->capacity() + offsets.capacity() * 4 + bucketStart.capacity() * 4;
+    }
+    
+    // Encode target as a delta against the base. Returns an empty string when
+    // the delta would be larger than maxSize.
+    std::string createDelta(const std::string& target, size_t maxSize) const {
+        const std::string& source = *base;
+        const unsigned char* src = reinterpret_cast<const unsigned char*>(source.data());
+        const unsigned char* trg = reinterpret_cast<const unsigned char*>(target.data());
+        size_t targetSize = target.length();
+        
+        std::string delta;
+        appendDeltaVarint(delta, source.length());
+        appendDeltaVarint(delta, targetSize);
+        
+        size_t insertStart = 0;
+        size_t pos = 0;
+        uint32_t hash = offsets.empty() || targetSize < blockSize ? 0 : blockHash(trg);
+        
+        while (!offsets.empty() && pos + blockSize <= targetSize) {
+            size_t bucket = hash & mask;
+            size_t bestLength = 0;
+            size_t bestOffset = 0;
+            
+            for (uint32_t e = bucketStart[bucket]; e < bucketStart[bucket + 1]; e++) {
+                size_t offset = offsets[e];
+                size_t limit = std::min(source.length() - offset, targetSize - pos);
+                size_t length = 0;
+                while (length < limit && src[offset + length] == trg[pos + length]) {
+                    length++;
+                }
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestOffset = offset;
+                }
+            }
+            
+            if (bestLength < blockSize) {
+                pos++;
+                if (pos + blockSize <= targetSize) {
+                    hash = (hash - trg[pos - 1] * highPower) * multiplier + trg[pos + blockSize - 1];
+                }
+                continue;
+            }
+            
+            // Grow the match backwards into bytes that would otherwise be inserted
+            while (pos > insertStart && bestOffset > 0 && src[bestOffset - 1] == trg[pos - 1]) {
+                pos--;
+                bestOffset--;
+                bestLength++;
+            }
+            
+            appendInserts(delta, target, insertStart, pos);
+            appendCopies(delta, bestOffset, bestLength);
+            pos += bestLength;
+            insertStart = pos;
+            
+            if (delta.length() > maxSize) {
+                return "";
+            }
+            if (pos + blockSize <= targetSize) {
+                hash = blockHash(trg + pos);
+            }
+        }
+        
+        appendInserts(delta, target, insertStart, targetSize);
+        if (delta.length() > maxSize) {
+            return "";
+        }
+        return delta;
+    }
+    
+private:
+    static constexpr uint32_t multiplier = 0x01000193;
+    static constexpr uint32_t highPower = [] {
+        uint32_t power = 1;
+        for (size_t i = 1; i < blockSize; i++) {
+            power *= multiplier;
+        }
+        return power;
+    }();
+    
+    static uint32_t blockHash(const unsigned char* block) {
+        uint32_t hash = 0;
+        for (size_t i = 0; i < blockSize; i++) {
+            hash = hash * multiplier + block[i];
+        }
+        return hash;
+    }
+    
+    static void appendDeltaVarint(std::string& out, uint64_t value) {
+        do {
+            unsigned char byte = value & 0x7F;
+            value >>= 7;
+            out += static_cast<char>(value ? byte | 0x80 : byte);
+        } while (value);
+    }
+    
+    static void appendInserts(std::string& out, const std::string& target, size_t start, size_t end) {
+        while (start < end) {
+            size_t length = std::min<size_t>(end - start, 0x7F);
+            out += static_cast<char>(length);
+            out.append(target, start, length);
+            start += length;
+        }
+    }
+    
+    static void appendCopies(std::string& out, uint64_t offset, uint64_t length) {
+        while (length > 0) {
+            uint64_t size = std::min<uint64_t>(length, 0x10000);
+            unsigned char op = 0x80;
+            std::string args;
+            for (int i = 0; i < 4; i++) {
+                unsigned char byte = (offset >> (8 * i)) & 0xFF;
+                if (byte) {
+                    op |= 1 << i;
+                    args += static_cast<char>(byte);
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                unsigned char byte = (size >> (8 * i)) & 0xFF;
+                if (byte) {
+                    op |= 0x10 << i;
+                    args += static_cast<char>(byte);
+                }
+            }
+            out += static_cast<char>(op);
+            out += args;
+            offset += size;
+            length -= size;
+        }
+    }
+    
+    std::shared_ptr<const std::string> base;
+    size_t mask = 0;
+    std::vector<uint32_t> bucketStart;
+    std::vector<uint32_t> offsets;
+};
+
+// Git's path name hash: weighted towards the last characters so files with the
+// same name or extension sort next to each other as delta candidates
+uint32_t packNameHash(const std::string& path) {
+    uint32_t hash = 0;
+    for (unsigned char c : path) {
+        if (std::isspace(c)) {
+            continue;
+        }
+        hash = (hash >> 2) + (static_cast<uint32_t>(c) << 24);
+    }
+    return hash;
+}
+
+struct PackInput {
+    std::string hash;
+    std::string path;   // optional, only used to group delta candidates
+};
+
+struct PackObjectsOptions {
+    unsigned window = 10;
+    unsigned depth = 50;
+    unsigned threads = 0;
+    uint64_t windowMemory = 0;  // per-thread cap on window contents and indexes, 0 = unlimited
+};
+
+struct PackCandidate {
+    std::string hash;
+    int type;
+    uint64_t size;
+    uint32_t nameHash;
+    int64_t deltaBase;      // candidate index of the base, or -1
+    std::string delta;
+    unsigned depth;
+};
+
+// Choose deltas for one partition of the sorted candidates: each is compared
+// against the previous `window` objects of the same type in the partition,
+// keeping the smallest delta within the depth limit. When windowMemory is set,
+// the oldest window entries are dropped to stay under it.
+void findDeltas(std::vector<PackCandidate>& candidates, const std::vector<size_t>& sorted,
+                size_t begin, size_t end, const PackObjectsOptions& options) {
+    struct WindowSlot {
+        size_t candidate;
+        std::shared_ptr<const std::string> content;
+        std::unique_ptr<DeltaIndex> index;
+        
+        size_t memoryUsage() const {
+            return index ? index->memoryUsage() : content->capacity();
+        }
+    };
+    std::deque<WindowSlot> window;
+    size_t windowMemory = 0;
+    
+    for (size_t s = begin; s < end; s++) {
+        size_t i = sorted[s];
+        PackCandidate& target = candidates[i];
+        if (!window.empty() && candidates[window.back().candidate].type != target.type) {
+            window.clear();
+            windowMemory = 0;
+        }
+        
+        int type = 0;
+        auto content = std::make_shared<const std::string>(readObjectContent(target.hash, type));
+        
+        for (auto slot = window.rbegin(); slot != window.rend() && options.depth > 0; ++slot) {
+            const PackCandidate& base = candidates[slot->candidate];
+            if (base.depth >= options.depth) {
+                continue;
+            }
+            
+            // Same budget as git: half the target, shrinking as the chain grows
+            uint64_t maxSize = target.size / 2;
+            maxSize = maxSize > 20 ? maxSize - 20 : 0;
+            maxSize = maxSize * (options.depth - base.depth) / options.depth;
+            if (target.deltaBase >= 0) {
+                maxSize = std::min<uint64_t>(maxSize, target.delta.length() - 1);
+            }
+            uint64_t sizeDiff = base.size > target.size ? base.size - target.size : target.size - base.size;
+            if (maxSize == 0 || sizeDiff >= maxSize) {
+                continue;
+            }
+            
+            if (!slot->index) {
+                windowMemory -= slot->memoryUsage();
+                slot->index = std::make_unique<DeltaIndex>(slot->content);
+                windowMemory += slot->memoryUsage();
+            }
+            std::string delta = slot->index->createDelta(*content, maxSize);
+            if (!delta.empty()) {
+                target.delta = std::move(delta);
+                target.deltaBase = static_cast<int64_t>(slot->candidate);
+                target.depth = base.depth + 1;
+            }
+        }
+        
+        window.push_back({i, content, nullptr});
+        windowMemory += window.back().memoryUsage();
+        while (window.size() > options.window ||
+               (options.windowMemory && windowMemory > options.windowMemory && window.size() > 1)) {
+            windowMemory -= window.front().memoryUsage();
+            window.pop_front();
+        }
+    }
+}
+
+// Split the sorted candidates into a number of partitions that depends only on
+// the thread count, so output is deterministic for a given --threads. Several
+// partitions per thread let idle workers steal the rest of an uneven split.
+// Boundaries move forward to the next name hash change so groups of related
+// objects are not separated.
+std::vector<std::pair<size_t, size_t>> partitionCandidates(const std::vector<PackCandidate>& candidates,
+                                                           const std::vector<size_t>& sorted,
+                                                           unsigned threads) {
+    std::vector<std::pair<size_t, size_t>> partitions;
+    size_t chunks = threads <= 1 ? 1 : static_cast<size_t>(threads) * 4;
+    size_t chunkSize = std::max<size_t>(1, (sorted.size() + chunks - 1) / chunks);
+    
+    size_t begin = 0;
+    while (begin < sorted.size()) {
+        size_t end = std::min(sorted.size(), begin + chunkSize);
+        while (end < sorted.size() &&
+               candidates[sorted[end]].nameHash == candidates[sorted[end - 1]].nameHash &&
+               candidates[sorted[end]].type == candidates[sorted[end - 1]].type) {
+            end++;
+        }
+        partitions.push_back({begin, end});
+        begin = end;
+    }
+    return partitions;
+}
+
+// Write a pack (and its .idx) containing the given objects as
+// <baseName>-<checksum>.pack, using ofs-deltas found by a sliding-window
+// search. Returns the pack checksum.
+std::string packObjects(const std::vector<PackInput>& inputs, const std::string& baseName,
+                        const PackObjectsOptions& options) {
+    std::vector<PackCandidate> candidates;
+    candidates.reserve(inputs.size());
+    std::unordered_map<std::string, size_t> seen;
+    
+    for (const auto& input : inputs) {
+        if (seen.emplace(input.hash, candidates.size()).second) {
+            candidates.push_back({input.hash, 0, 0, packNameHash(input.path), -1, "", 0});
+        }
+    }
+    
+    unsigned threads = resolveThreadCount(options.threads);
+    WorkStealingPool pool(threads);
+    
+    // Types and sizes come from the object headers; nothing is inflated in
+    // full until the delta search needs the content
+    size_t statChunk = 256;
+    for (size_t begin = 0; begin < candidates.size(); begin += statChunk) {
+        pool.submit([&, begin] {
+            size_t end = std::min(candidates.size(), begin + statChunk);
+            for (size_t i = begin; i < end; i++) {
+                candidates[i].size = readObjectHeader(candidates[i].hash, candidates[i].type);
+            }
+        });
+    }
+    pool.wait();
+    
+    std::vector<size_t> sorted(candidates.size());
+    for (size_t i = 0; i < sorted.size(); i++) {
+        sorted[i] = i;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b) {
+        const PackCandidate& x = candidates[a];
+        const PackCandidate& y = candidates[b];
+        if (x.type != y.type) return x.type < y.type;
+        if (x.nameHash != y.nameHash) return x.nameHash < y.nameHash;
+        return x.size > y.size;
+    });
+    
+    std::vector<std::pair<size_t, size_t>> partitions = partitionCandidates(candidates, sorted, threads);
+    std::cerr << "Delta search over " << candidates.size() << " objects in " << partitions.size()
+              << " partitions using " << threads << " threads" << std::endl;
+    for (const auto& partition : partitions) {
+        pool.submit([&, partition] {
+            findDeltas(candidates, sorted, partition.first, partition.second, options);
+        });
+    }
+    pool.wait();
+    
+    std::filesystem::path basePath(baseName);
+    if (basePath.has_parent_path()) {
+        std::filesystem::create_directories(basePath.parent_path());
+    }
+    std::string tmpPack = baseName + "-tmp_pack_" + std::to_string(::getpid());
+    
+    std::vector<PackIndexEntry> entries(candidates.size());
+    std::vector<bool> written(candidates.size(), false);
+    size_t deltas = 0;
+    
+    HashedFileWriter writer(tmpPack);
+    writer.write("PACK", 4);
+    writer.writeUint32(2);
+    writer.writeUint32(static_cast<uint32_t>(candidates.size()));
+    
+    // Objects go out in input order, except that a delta's base is written first
+    std::function<void(size_t)> writeOne = [&](size_t i) {
+        if (written[i]) {
+            return;
+        }
+        PackCandidate& candidate = candidates[i];
+        if (candidate.deltaBase >= 0) {
+            writeOne(static_cast<size_t>(candidate.deltaBase));
+        }
+        
+        uint64_t offset = writer.bytesWritten();
+        std::string data;
+        int type = candidate.type;
+        if (candidate.deltaBase >= 0) {
+            data = std::move(candidate.delta);
+            type = 6;
+            deltas++;
+        } else {
+            int ignored = 0;
+            data = readObjectContent(candidate.hash, ignored);
+        }
+        
+        std::string header = encodePackEntryHeader(type, data.length());
+        if (type == 6) {
+            uint64_t distance = offset - entries[candidate.deltaBase].offset;
+            unsigned char buffer[16];
+            int pos = sizeof(buffer) - 1;
+            buffer[pos] = distance & 0x7F;
+            while (distance >>= 7) {
+                buffer[--pos] = static_cast<unsigned char>(0x80 | (--distance & 0x7F));
+            }
+            header.append(reinterpret_cast<const char*>(buffer + pos), sizeof(buffer) - pos);
+        }
+        
+        std::vector<char> compressed = compressZlib(data);
+        writer.write(header);
+        writer.write(compressed.data(), compressed.size());
+        
+        uLong crc = crc32_z(0, reinterpret_cast<const Bytef*>(header.data()), header.length());
+        crc = crc32_z(crc, reinterpret_cast<const Bytef*>(compressed.data()), compressed.size());
+        entries[i] = {candidate.hash, offset, offset + header.length(), writer.bytesWritten(),
+                      type, candidate.type, data.length(), 0, "", static_cast<uint32_t>(crc)};
+        written[i] = true;
+    };
+    
+    for (size_t i = 0; i < candidates.size(); i++) {
+        writeOne(i);
+    }
+    
+    std::string checksum = writer.finish();
+    std::string tmpIdx = baseName + "-tmp_idx_" + std::to_string(::getpid());
+    std::string tmpRev = baseName + "-tmp_rev_" + std::to_string(::getpid());
+    writePackIndex(tmpIdx, entries, checksum);
+    writePackReverseIndex(tmpRev, entries, checksum);
+    std::filesystem::rename(tmpPack, baseName + "-" + checksum + ".pack");
+    std::filesystem::rename(tmpRev, baseName + "-" + checksum + ".rev");
+    std::filesystem::rename(tmpIdx, baseName + "-" + checksum + ".idx");
+    
+    std::cerr << "Total " << candidates.size() << " (delta " << deltas << ")" << std::endl;
+    return checksum;
+}
+
+std::vector<std::string> listLooseObjects() {
+    std::vector<std::string> hashes;
+    std::string objectsDir = ".git/objects";
+    if (!std::filesystem::is_directory(objectsDir)) {
+        return hashes;
+    }
+    
+    for (const auto& dir : std::filesystem::directory_iterator(objectsDir)) {
+        std::string prefix = dir.path().filename().string();
+        if (!dir.is_directory() || prefix.length() != 2 || !std::isxdigit(prefix[0]) || !std::isxdigit(prefix[1])) {
+            continue;
+        }
+        for (const auto& file : std::filesystem::directory_iterator(dir.path())) {
+            std::string rest = file.path().filename().string();
+            if (rest.length() == 38) {
+                hashes.push_back(prefix + rest);
+            }
+        }
+    }
+    std::sort(hashes.begin(), hashes.end());
+    return hashes;
+}
+
+// Paths of every .idx in .git/objects/pack
+std::vector<std::string> listPackIndexes() {
+    std::vector<std::string> indexes;
+    std::string packDir = ".git/objects/pack";
+    if (std::filesystem::is_directory(packDir)) {
+        for (const auto& entry : std::filesystem::directory_iterator(packDir)) {
+            if (entry.path().extension() == ".idx") {
+                indexes.push_back(entry.path().string());
+            }
+        }
+    }
+    std::sort(indexes.begin(), indexes.end());
+    return indexes;
+}
+
+// Delete a pack and its companion files, index first so no reader finds an
+// index whose pack is already gone
+void removePackFiles(const std::string& idxPath) {
+    std::string base = idxPath.substr(0, idxPath.length() - 4);
+    std::filesystem::remove(base + ".idx");
+    std::filesystem::remove(base + ".rev");
+    std::filesystem::remove(base + ".bitmap");
+    std::filesystem::remove(base + ".promisor");
+    std::filesystem::remove(base + ".pack");
+}
+
+// Re-index a freshly written pack from scratch and make sure every expected
+// object came out of it with a matching id
+void verifyPack(const std::string& packPath, const std::vector<std::string>& expected, unsigned threads) {
+    MappedFile pack(packPath, true);
+    std::vector<PackIndexEntry> entries =
+        indexPack(std::string_view(reinterpret_cast<const char*>(pack.data()), pack.size()), threads, nullptr);
+    std::vector<std::string> found;
+    for (const auto& entry : entries) {
+        found.push_back(entry.hash);
+    }
+    std::sort(found.begin(), found.end());
+    
+    for (const auto& hash : expected) {
+        if (!std::binary_search(found.begin(), found.end(), hash)) {
+            throw std::runtime_error("Pack verification failed, missing " + hash);
+        }
+    }
+}
+
+struct RepackOptions {
+    bool all = false;               // also fold every existing pack into the new one
+    bool removeRedundant = false;   // delete loose objects and packs the new pack covers
+    unsigned geometricFactor = 0;   // roll up only packs breaking a progression of this factor
+    PackObjectsOptions pack;
+};
+
+// Choose the packs a geometric repack rolls up. Packs sorted by object count
+// should grow by at least `factor` each step; the largest packs that already
+// do are kept, everything below them is merged. If the merged pack would then
+// break the progression with the next kept pack, that pack joins as well, so
+// maintenance cost stays proportional to the data added since the last run.
+std::vector<std::string> selectGeometricRollup(unsigned factor) {
+    std::vector<std::pair<uint64_t, std::string>> packs;
+    for (const auto& idxPath : listPackIndexes()) {
+        packs.push_back({PackFile(idxPath).objectCount(), idxPath});
+    }
+    std::sort(packs.begin(), packs.end());
+    
+    size_t split = 0;
+    if (!packs.empty()) {
+        size_t i = packs.size() - 1;
+        for (; i > 0; i--) {
+            if (packs[i].first < factor * packs[i - 1].first) {
+                break;
+            }
+        }
+        split = i == 0 ? 0 : i + 1;
+    }
+    
+    uint64_t rolledUp = 0;
+    for (size_t i = 0; i < split; i++) {
+        rolledUp += packs[i].first;
+    }
+    while (split < packs.size() && packs[split].first < factor * rolledUp) {
+        rolledUp += packs[split].first;
+        split++;
+    }
+    
+    std::vector<std::string> selected;
+    for (size_t i = 0; i < split; i++) {
+        selected.push_back(packs[i].second);
+    }
+    return selected;
+}
+
+// Write loose objects (and with `all`, every packed object) into one new pack,
+// verify it, then optionally delete what it made redundant. Returns the new
+// pack's checksum, or an empty string when there was nothing to pack.
+std::string repack(const RepackOptions& options) {
+    std::vector<std::string> loose = listLooseObjects();
+    std::vector<std::string> oldPacks;
+    if (options.geometricFactor > 1) {
+        oldPacks = selectGeometricRollup(options.geometricFactor);
+        if (oldPacks.size() <= 1 && loose.empty()) {
+            std::cerr << "Packs already form a geometric progression" << std::endl;
+            return "";
+        }
+    } else if (options.all) {
+        oldPacks = listPackIndexes();
+    }
+    
+    std::vector<PackInput> inputs;
+    for (const auto& hash : loose) {
+        inputs.push_back({hash, ""});
+    }
+    bool promisor = false;
+    for (const auto& idxPath : oldPacks) {
+        promisor = promisor || std::filesystem::exists(idxPath.substr(0, idxPath.length() - 4) + ".promisor");
+        PackFile pack(idxPath);
+        for (uint32_t i = 0; i < pack.objectCount(); i++) {
+            inputs.push_back({toHex(pack.hashAt(i), 20), ""});
+        }
+    }
+    
+    if (inputs.empty()) {
+        std::cerr << "Nothing new to pack" << std::endl;
+        return "";
+    }
+    
+    std::string base = ".git/objects/pack/pack";
+    std::string checksum = packObjects(inputs, base, options.pack);
+    std::string newIdx = base + "-" + checksum + ".idx";
+    
+    std::vector<std::string> expected;
+    for (const auto& input : inputs) {
+        expected.push_back(input.hash);
+    }
+    verifyPack(base + "-" + checksum + ".pack", expected, options.pack.threads);
+    // Objects from promisor packs keep vouching for what they refer to, or
+    // the blobs a partial clone omitted would turn from promised to missing
+    if (promisor) {
+        markPromisorPack(checksum);
+    }
+    
+    if (options.removeRedundant) {
+        size_t removedPacks = 0;
+        for (const auto& idxPath : oldPacks) {
+            if (std::filesystem::path(idxPath) != std::filesystem::path(newIdx)) {
+                removePackFiles(idxPath);
+                removedPacks++;
+            }
+        }
+        for (const auto& hash : loose) {
+            std::filesystem::path dir = ".git/objects/" + hash.substr(0, 2);
+            std::filesystem::remove(dir / hash.substr(2));
+            if (std::filesystem::is_empty(dir)) {
+                std::filesystem::remove(dir);
+            }
+        }
+        std::cerr << "Removed " << loose.size() << " loose objects and "
+                  << removedPacks << " redundant packs" << std::endl;
+    }
+    
+    // Geometric repacks leave several packs behind, so they always keep a
+    // multi-pack-index covering them
+    if (options.geometricFactor > 1 || std::filesystem::exists(".git/objects/pack/multi-pack-index")) {
+        writeMultiPackIndex();
+    } else {
+        packStore().reload();
+    }
+    return checksum;
+}
+
+// Same heuristic as git gc --auto: estimate the loose object count from one
+// fan-out directory, and also repack once packs pile up
+bool needsAutoGc(size_t looseLimit = 6700, size_t packLimit = 50) {
+    size_t sample = 0;
+    std::string sampleDir = ".git/objects/17";
+    if (std::filesystem::is_directory(sampleDir)) {
+        for (const auto& entry : std::filesystem::directory_iterator(sampleDir)) {
+            if (entry.path().filename().string().length() == 38) {
+                sample++;
+            }
+        }
+    }
+    if (sample * 256 > looseLimit) {
+        return true;
+    }
+    return listPackIndexes().size() > packLimit;
+}
+
+// Called after commands that write objects. Failures are reported but never
+// fail the command that triggered them.
+void runAutoGc() {
+    try {
+        if (needsAutoGc()) {
+            std::cerr << "Auto packing the repository for optimum performance" << std::endl;
+            RepackOptions options;
+            options.all = true;
+            options.removeRedundant = true;
+            repack(options);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Auto gc failed: " << e.what() << std::endl;
+    }
+}
+
+std::vector<TreeEntry> parseTreeObject(const std::string& objectData) {
+    std::vector<TreeEntry> entries;
+    size_t pos = 0;
+    
+    // Skip the header (type size\0)
+    size_t nullPos = objectData.find('\0');
+    if (nullPos == std::string::npos) {
+        throw std::runtime_error("Invalid tree object format");
+    }
+    
+    // Start parsing after the header
+    pos = nullPos + 1;
+    
+    while (pos < objectData.length()) {
+        // Find the next space (separates mode from name)
+        size_t spacePos = objectData.find(' ', pos);
+        if (spacePos == std::string::npos) {
+            break;
+        }
+        
+        // Extract mode
+        std::string mode = objectData.substr(pos, spacePos - pos);
+        
+        // Find the null byte (separates name from hash)
+        size_t nameEndPos = objectData.find('\0', spacePos);
+        if (nameEndPos == std::string::npos) {
+            break;
+        }
+        
+        // Extract name
+        std::string name = objectData.substr(spacePos + 1, nameEndPos - spacePos - 1);
+        
+        // Extract hash (20 bytes after the null byte)
+        if (nameEndPos + 20 > objectData.length()) {
+            break;
+        }
+        
+        std::string rawHash = objectData.substr(nameEndPos + 1, 20);
+        
+        // Convert raw bytes to hex string
+        std::stringstream ss;
+        for (unsigned char byte : rawHash) {
+            ss << std::hex << std::setfill('0') << std::setw(2) << static_cast<int>(byte);
+        }
+        std::string hash = ss.str();
+        
+        entries.push_back({mode, name, hash});
+        
+        // Move to next entry
+        pos = nameEndPos + 21;
+    }
+    
+    return entries;
+}
+
+std::string createTreeFromDirectory(const std::string& dirPath) {
+    std::vector<TreeEntry> entries;
+    
+    // Iterate through directory entries
+    for (const auto& entry : std::filesystem::directory_iterator(dirPath)) {
+        std::string name = entry.path().filename().string();
+        
+        // Skip .git directory
+        if (name == ".git") {
+            continue;
+        }
+        
+        if (entry.is_regular_file()) {
+            // Create blob object for file
+            std::ifstream file(entry.path());
+            if (!file) {
+                throw std::runtime_error("Failed to open file: " + entry.path().string());
+            }
+            
+            std::string content((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+            file.close();
+            
+            std::string hash = writeGitObject(content);
+            entries.push_back({"100644", name, hash}); // 100644 is regular file mode
+            
+        } else if (entry.is_directory()) {
+            // Recursively create tree object for subdirectory
+            std::string subTreeHash = createTreeFromDirectory(entry.path().string());
+            entries.push_back({"40000", name, subTreeHash}); // 40000 is directory mode
+        }
+    }
+    
+    // Sort entries by name (Git requirement)
+    std::sort(entries.begin(), entries.end(), 
+             [](const TreeEntry& a, const TreeEntry& b) {
+                 return a.name < b.name;
+             });
+    
+    // Create and return tree object
+    return writeTreeObject(entries);
+}
+
+struct CommitInfo {
+    std::string tree;
+    std::vector<std::string> parents;
+    int64_t commitTime = 0;
+};
+
+CommitInfo parseCommitObject(const std::string& content) {
+    CommitInfo commit;
+    size_t pos = 0;
+    
+    // Headers run until the first blank line
+    while (pos < content.length() && content[pos] != '\n') {
+        size_t lineEnd = content.find('\n', pos);
+        if (lineEnd == std::string::npos) {
+            lineEnd = content.length();
+        }
+        std::string line = content.substr(pos, lineEnd - pos);
+        
+        if (line.rfind("tree ", 0) == 0) {
+            commit.tree = line.substr(5, 40);
+        } else if (line.rfind("parent ", 0) == 0) {
+            commit.parents.push_back(line.substr(7, 40));
+        } else if (line.rfind("committer ", 0) == 0) {
+            // "committer Name <email> <timestamp> <tz>"
+            size_t tzPos = line.rfind(' ');
+            size_t timePos = tzPos == std::string::npos ? std::string::npos : line.rfind(' ', tzPos - 1);
+            if (timePos != std::string::npos) {
+                commit.commitTime = std::stoll(line.substr(timePos + 1, tzPos - timePos - 1));
+            }
+        }
+        pos = lineEnd + 1;
+    }
+    
+    if (commit.tree.length() != 40) {
+        throw std::runtime_error("Invalid commit object: missing tree");
+    }
+    return commit;
+}
+
+std::unordered_set<std::string> readShallowFile() {
+    std::unordered_set<std::string> listed;
+    std::ifstream file(".git/shallow");
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.length() >= 40) {
+            listed.insert(line.substr(0, 40));
+        }
+    }
+    return listed;
+}
+
+// Commits listed in .git/shallow. History was cut below them, so they are
+// treated as root commits even though their objects name parents.
+std::unordered_set<std::string>& shallowCommits() {
+    static std::unordered_set<std::string> commits = readShallowFile();
+    return commits;
+}
+
+// Replace .git/shallow; a repository with no shallow commits has no file
+void writeShallowFile(const std::unordered_set<std::string>& commits) {
+    shallowCommits() = commits;
+    if (commits.empty()) {
+        std::filesystem::remove(".git/shallow");
+        return;
+    }
+    std::vector<std::string> sorted(commits.begin(), commits.end());
+    std::sort(sorted.begin(), sorted.end());
+    std::string tmpPath = ".git/shallow.lock";
+    std::ofstream file(tmpPath);
+    for (const auto& hash : sorted) {
+        file << hash << '\n';
+    }
+    file.close();
+    if (!file) {
+        throw std::runtime_error("Failed to write .git/shallow");
+    }
+    std::filesystem::rename(tmpPath, ".git/shallow");
+}
+
+// Every ref under .git/refs and in .git/packed-refs as (name, hash); loose
+// refs take precedence over packed ones
+std::vector<std::pair<std::string, std::string>> listRefs(const std::filesystem::path& gitDir = ".git") {
+    std::map<std::string, std::string> refs;
+    
+    std::ifstream packed(gitDir / "packed-refs");
+    std::string line;
+    while (std::getline(packed, line)) {
+        if (line.length() > 41 && line[0] != '#' && line[0] != '^') {
+            refs[line.substr(41)] = line.substr(0, 40);
+        }
+    }
+    
+    if (std::filesystem::is_directory(gitDir / "refs")) {
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(gitDir / "refs")) {
+            if (!entry.is_regular_file()) {
+                continue;
+            }
+            std::ifstream file(entry.path());
+            std::string hash;
+            if (std::getline(file, hash) && hash.length() >= 40 && hash.rfind("ref: ", 0) != 0) {
+                std::string name = std::filesystem::relative(entry.path(), gitDir).generic_string();
+                refs[name] = hash.substr(0, 40);
+            }
+        }
+    }
+    
+    return std::vector<std::pair<std::string, std::string>>(refs.begin(), refs.end());
+}
+
+// Commits and tags the refs of the alternates point at. Their objects are
+// available to us, so fetches offer them as haves, as git does.
+std::vector<std::string> alternateRefTips() {
+    std::vector<std::string> tips;
+    std::unordered_set<std::string> seen;
+    for (const auto& dir : alternateObjectDirs()) {
+        for (const auto& ref : listRefs(dir.parent_path())) {
+            if (seen.insert(ref.second).second && objectExists(ref.second)) {
+                tips.push_back(ref.second);
+            }
+        }
+    }
+    return tips;
+}
+
+// Replace .git/objects/info/alternates and start using the new list
+void writeAlternates(const std::vector<std::filesystem::path>& dirs) {
+    std::filesystem::create_directories(".git/objects/info");
+    std::ofstream file(".git/objects/info/alternates");
+    for (const auto& dir : dirs) {
+        file << dir.string() << "\n";
+    }
+    file.close();
+    if (!file) {
+        throw std::runtime_error("Failed to write .git/objects/info/alternates");
+    }
+    alternateObjectDirs() = readAlternates();
+    packStore().reload();
+}
+
+// Whether name is a well-formed ref under refs/, by git's check_refname_format
+// rules. Ref names become paths under .git, so anything that could climb out
+// of it or collide with lock files is refused: empty components, components
+// starting with '.' or ending in ".lock", "..", "@{", a trailing '.' or '/',
+// and control characters, spaces and ~^:?*[\ anywhere.
+bool isValidRefName(const std::string& name) {
+    if (name.rfind("refs/", 0) != 0 || name.back() == '/' || name.back() == '.' ||
+        name.find("..") != std::string::npos || name.find("@{") != std::string::npos) {
+        return false;
+    }
+    for (unsigned char c : name) {
+        if (c < 0x20 || c == 0x7f || std::strchr(" ~^:?*[\\", c)) {
+            return false;
+        }
+    }
+    size_t begin = 0;
+    while (begin <= name.length()) {
+        size_t end = name.find('/', begin);
+        if (end == std::string::npos) {
+            end = name.length();
+        }
+        std::string_view component(name.data() + begin, end - begin);
+        if (component.empty() || component[0] == '.' ||
+            (component.length() >= 5 && component.substr(component.length() - 5) == ".lock")) {
+            return false;
+        }
+        begin = end + 1;
+    }
+    return true;
+}
+
+// Point a ref at hash by writing its loose file, which takes precedence over
+// any packed-refs entry
+void updateRef(const std::string& name, const std::string& hash) {
+    if (!isValidRefName(name)) {
+        throw std::runtime_error("Refusing to write ref with a dangerous name: " + name);
+    }
+    std::filesystem::path path = std::filesystem::path(".git") / name;
+    std::filesystem::create_directories(path.parent_path());
+    std::string lockPath = path.string() + ".lock";
+    std::ofstream file(lockPath);
+    file << hash << '\n';
+    file.close();
+    if (!file) {
+        throw std::runtime_error("Failed to write ref " + name);
+    }
+    std::filesystem::rename(lockPath, path);
+}
+
+// Resolve a full object id, HEAD, a full ref name, or a branch or tag name
+std::string resolveRevision(const std::string& name) {
+    if (name.length() == 40 && std::all_of(name.begin(), name.end(), ::isxdigit)) {
+        return name;
+    }
+    
+    std::string refName = name;
+    if (name == "HEAD") {
+        std::ifstream head(".git/HEAD");
+        std::string line;
+        std::getline(head, line);
+        if (line.rfind("ref: ", 0) != 0) {
+            if (line.length() >= 40) {
+                return line.substr(0, 40);
+            }
+            throw std::runtime_error("Invalid HEAD");
+        }
+        refName = line.substr(5);
+    }
+    
+    auto refs = listRefs();
+    for (const std::string& candidate : {refName, "refs/" + refName, "refs/heads/" + refName, "refs/tags/" + refName}) {
+        for (const auto& ref : refs) {
+            if (ref.first == candidate) {
+                return ref.second;
+            }
+        }
+    }
+    throw std::runtime_error("Unknown revision: " + name);
+}
+
+// Changed-path Bloom filters, bit-compatible with git's version 1 filters:
+// seven hashes per path derived from two murmur3 values, ten bits per path,
+// and filters capped at 512 changed paths
+constexpr uint32_t bloomHashCount = 7;
+constexpr uint32_t bloomBitsPerEntry = 10;
+constexpr size_t bloomMaxChangedPaths = 512;
+
+// Version 1 filters hash the bytes as plain (signed) char, so bytes above 0x7f
+// are sign-extended exactly as git does
+uint32_t murmur3Seeded(uint32_t seed, const std::string& data) {
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    auto rotl = [](uint32_t value, int bits) { return (value << bits) | (value >> (32 - bits)); };
+    auto byteAt = [&](size_t i) { return static_cast<uint32_t>(static_cast<int32_t>(static_cast<signed char>(data[i]))); };
+    
+    size_t blocks = data.length() / 4;
+    for (size_t i = 0; i < blocks; i++) {
+        uint32_t k = byteAt(4 * i) | (byteAt(4 * i + 1) << 8) | (byteAt(4 * i + 2) << 16) | (byteAt(4 * i + 3) << 24);
+        k *= c1;
+        k = rotl(k, 15);
+        k *= c2;
+        seed ^= k;
+        seed = rotl(seed, 13) * 5 + 0xe6546b64;
+    }
+    
+    uint32_t k1 = 0;
+    size_t tail = blocks * 4;
+    switch (data.length() & 3) {
+    case 3:
+        k1 ^= byteAt(tail + 2) << 16;
+        [[fallthrough]];
+    case 2:
+        k1 ^= byteAt(tail + 1) << 8;
+        [[fallthrough]];
+    case 1:
+        k1 ^= byteAt(tail);
+        k1 *= c1;
+        k1 = rotl(k1, 15);
+        k1 *= c2;
+        seed ^= k1;
+        break;
+    }
+    
+    seed ^= static_cast<uint32_t>(data.length());
+    seed ^= seed >> 16;
+    seed *= 0x85ebca6b;
+    seed ^= seed >> 13;
+    seed *= 0xc2b2ae35;
+    seed ^= seed >> 16;
+    return seed;
+}
+
+std::array<uint32_t, bloomHashCount> bloomKey(const std::string& path) {
+    uint32_t first = murmur3Seeded(0x293ae76f, path);
+    uint32_t second = murmur3Seeded(0x7e646e2c, path);
+    std::array<uint32_t, bloomHashCount> hashes;
+    for (uint32_t i = 0; i < bloomHashCount; i++) {
+        hashes[i] = first + i * second;
+    }
+    return hashes;
+}
+
+void addBloomKey(std::string& filter, const std::array<uint32_t, bloomHashCount>& key) {
+    uint64_t bits = static_cast<uint64_t>(filter.length()) * 8;
+    for (uint32_t hash : key) {
+        uint64_t bit = hash % bits;
+        filter[bit / 8] = static_cast<char>(static_cast<unsigned char>(filter[bit / 8]) | (1u << (bit % 8)));
+    }
+}
+
+bool bloomMayContain(const unsigned char* filter, size_t length, const std::array<uint32_t, bloomHashCount>& key) {
+    if (length == 0) {
+        return true;
+    }
+    uint64_t bits = static_cast<uint64_t>(length) * 8;
+    for (uint32_t hash : key) {
+        uint64_t bit = hash % bits;
+        if (!(filter[bit / 8] & (1u << (bit % 8)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<TreeEntry> readTreeEntries(const std::string& hash) {
+    if (hash.empty()) {
+        return {};
+    }
+    return parseTreeObject(readGitObject(hash));
+}
+
+// Add every file path that differs between two trees (either may be empty) to
+// paths. Returns false once more than limit paths have been collected.
+bool collectChangedPaths(const std::string& oldTree, const std::string& newTree, const std::string& prefix,
+                         std::set<std::string>& paths, size_t limit) {
+    std::map<std::string, TreeEntry> oldEntries;
+    for (auto& entry : readTreeEntries(oldTree)) {
+        oldEntries.emplace(entry.name, std::move(entry));
+    }
+    std::map<std::string, TreeEntry> newEntries;
+    for (auto& entry : readTreeEntries(newTree)) {
+        newEntries.emplace(entry.name, std::move(entry));
+    }
+    
+    auto changed = [&](const std::string& name, const TreeEntry* oldEntry, const TreeEntry* newEntry) {
+        bool oldIsTree = oldEntry && oldEntry->mode == "40000";
+        bool newIsTree = newEntry && newEntry->mode == "40000";
+        std::string path = prefix + name;
+        if (oldIsTree || newIsTree) {
+            if (!collectChangedPaths(oldIsTree ? oldEntry->hash : "", newIsTree ? newEntry->hash : "",
+                                     path + "/", paths, limit)) {
+                return false;
+            }
+        }
+        if ((oldEntry && !oldIsTree) || (newEntry && !newIsTree)) {
+            paths.insert(path);
+        }
+        return paths.size() <= limit;
+    };
+    
+    for (const auto& [name, entry] : oldEntries) {
+        auto other = newEntries.find(name);
+        if (other == newEntries.end()) {
+            if (!changed(name, &entry, nullptr)) {
+                return false;
+            }
+        } else if (other->second.mode != entry.mode || other->second.hash != entry.hash) {
+            if (!changed(name, &entry, &other->second)) {
+                return false;
+            }
+        }
+    }
+    for (const auto& [name, entry] : newEntries) {
+        if (oldEntries.count(name) == 0 && !changed(name, nullptr, &entry)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Filter over the paths a commit changed relative to its first parent, plus
+// the directories leading to them. Commits touching too many paths get the
+// one-byte all-ones filter that matches everything.
+std::string computeBloomFilter(const std::string& tree, const std::string& parentTree) {
+    std::set<std::string> paths;
+    bool complete = collectChangedPaths(parentTree, tree, "", paths, bloomMaxChangedPaths);
+    if (complete) {
+        std::vector<std::string> files(paths.begin(), paths.end());
+        for (const auto& file : files) {
+            for (size_t slash = file.find('/'); slash != std::string::npos; slash = file.find('/', slash + 1)) {
+                paths.insert(file.substr(0, slash));
+            }
+        }
+    }
+    if (!complete || paths.size() > bloomMaxChangedPaths) {
+        return std::string(1, static_cast<char>(0xFF));
+    }
+    
+    std::string filter(std::max<size_t>(1, (paths.size() * bloomBitsPerEntry + 7) / 8), '\0');
+    for (const auto& path : paths) {
+        addBloomKey(filter, bloomKey(path));
+    }
+    return filter;
+}
+
+// Commit metadata from .git/objects/info/commit-graph, or from a split chain
+// listed in .git/objects/info/commit-graphs/commit-graph-chain. Each layer
+// holds a fanout, sorted ids and per-commit tree, parent positions, generation
+// number and commit date, so walks can skip inflating and parsing commits.
+// Positions are global across the chain: a layer numbers its commits after
+// all the commits of the layers below it.
+class CommitGraph {
+public:
+    static constexpr uint32_t parentNone = 0x70000000;
+    
+    void load() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (loaded) {
+            return;
+        }
+        loaded = true;
+        
+        // Generation numbers computed over a cut history go stale as soon as
+        // it is deepened, so shallow repositories ignore the graph as git does
+        if (!shallowCommits().empty()) {
+            return;
+        }
+        
+        std::string infoDir = ".git/objects/info";
+        std::ifstream chain(infoDir + "/commit-graphs/commit-graph-chain");
+        if (chain) {
+            std::string hash;
+            while (std::getline(chain, hash)) {
+                if (hash.length() >= 40) {
+                    chained = true;
+                    addLayer(infoDir + "/commit-graphs/graph-" + hash.substr(0, 40) + ".graph");
+                }
+            }
+        } else if (std::filesystem::exists(infoDir + "/commit-graph")) {
+            addLayer(infoDir + "/commit-graph");
+        }
+    }
+    
+    void reload() {
+        std::lock_guard<std::mutex> lock(mutex);
+        loaded = false;
+        chained = false;
+        layers.clear();
+    }
+    
+    uint32_t size() const {
+        return layers.empty() ? 0 : layers.back().base + layers.back().count;
+    }
+    
+    bool isChain() const { return chained; }
+    size_t layerCount() const { return layers.size(); }
+    uint32_t layerSize(size_t layer) const { return layers[layer].count; }
+    const std::string& layerHash(size_t layer) const { return layers[layer].hash; }
+    
+    bool find(const std::string& hash, uint32_t& position) const {
+        if (layers.empty()) {
+            return false;
+        }
+        std::string raw = fromHex(hash);
+        const unsigned char* rawHash = reinterpret_cast<const unsigned char*>(raw.data());
+        
+        for (auto layer = layers.rbegin(); layer != layers.rend(); ++layer) {
+            uint32_t lo = rawHash[0] == 0 ? 0 : readUint32(layer->fanout + (rawHash[0] - 1) * 4);
+            uint32_t hi = readUint32(layer->fanout + rawHash[0] * 4);
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                int cmp = std::memcmp(layer->ids + static_cast<size_t>(mid) * 20, rawHash, 20);
+                if (cmp == 0) {
+                    position = layer->base + mid;
+                    return true;
+                }
+                if (cmp < 0) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+        }
+        return false;
+    }
+    
+    std::string hashAt(uint32_t position) const {
+        const Layer& layer = layerOf(position);
+        return toHex(layer.ids + static_cast<size_t>(position - layer.base) * 20, 20);
+    }
+    
+    std::vector<uint32_t> parentPositions(uint32_t position) const {
+        const Layer& layer = layerOf(position);
+        const unsigned char* data = layer.data + static_cast<size_t>(position - layer.base) * 36;
+        
+        std::vector<uint32_t> parents;
+        uint32_t first = readUint32(data + 20);
+        uint32_t second = readUint32(data + 24);
+        if (first != parentNone) {
+            parents.push_back(first);
+        }
+        if (second & 0x80000000U) {
+            // Octopus merges continue in the extra edge list
+            const unsigned char* edge = layer.edges + static_cast<size_t>(second & 0x7FFFFFFFU) * 4;
+            while (true) {
+                uint32_t value = readUint32(edge);
+                parents.push_back(value & 0x7FFFFFFFU);
+                if (value & 0x80000000U) {
+                    break;
+                }
+                edge += 4;
+            }
+        } else if (second != parentNone) {
+            parents.push_back(second);
+        }
+        return parents;
+    }
+    
+    uint32_t generationAt(uint32_t position) const {
+        const Layer& layer = layerOf(position);
+        return readUint32(layer.data + static_cast<size_t>(position - layer.base) * 36 + 28) >> 2;
+    }
+    
+    bool hasBloomFilters() const {
+        return std::any_of(layers.begin(), layers.end(), [](const Layer& layer) { return layer.bloomData != nullptr; });
+    }
+    
+    // Changed-path filter of the commit at position, when its layer has them
+    bool bloomFilter(uint32_t position, const unsigned char*& filter, size_t& length) const {
+        const Layer& layer = layerOf(position);
+        if (!layer.bloomData) {
+            return false;
+        }
+        uint32_t index = position - layer.base;
+        uint32_t begin = index == 0 ? 0 : readUint32(layer.bloomIndex + (index - 1) * 4);
+        uint32_t end = readUint32(layer.bloomIndex + index * 4);
+        if (end < begin || 12 + static_cast<uint64_t>(end) > layer.bloomDataLength) {
+            return false;
+        }
+        filter = layer.bloomData + 12 + begin;
+        length = end - begin;
+        return true;
+    }
+    
+    CommitInfo commitAt(uint32_t position) const {
+        const Layer& layer = layerOf(position);
+        const unsigned char* data = layer.data + static_cast<size_t>(position - layer.base) * 36;
+        
+        CommitInfo commit;
+        commit.tree = toHex(data, 20);
+        for (uint32_t parent : parentPositions(position)) {
+            commit.parents.push_back(hashAt(parent));
+        }
+        commit.commitTime = static_cast<int64_t>((static_cast<uint64_t>(readUint32(data + 28) & 3) << 32) |
+                                                 readUint32(data + 32));
+        return commit;
+    }
+    
+private:
+    struct Layer {
+        std::unique_ptr<MappedFile> file;
+        std::string hash;
+        const unsigned char* fanout = nullptr;
+        const unsigned char* ids = nullptr;
+        const unsigned char* data = nullptr;
+        const unsigned char* edges = nullptr;
+        const unsigned char* bloomIndex = nullptr;
+        const unsigned char* bloomData = nullptr;
+        uint64_t bloomDataLength = 0;
+        uint32_t count = 0;
+        uint32_t base = 0;
+    };
+    
+    void addLayer(const std::string& path) {
+        Layer layer;
+        layer.file = std::make_unique<MappedFile>(path);
+        const unsigned char* data = layer.file->data();
+        size_t fileSize = layer.file->size();
+        if (fileSize < 8 + 20 || std::memcmp(data, "CGPH", 4) != 0 || data[4] != 1 || data[5] != 1) {
+            throw std::runtime_error("Unsupported commit-graph: " + path);
+        }
+        
+        uint32_t chunkCount = data[6];
+        for (uint32_t i = 0; i < chunkCount && 8 + (i + 2) * 12 <= fileSize; i++) {
+            const unsigned char* chunk = data + 8 + i * 12;
+            uint64_t offset = readUint64(chunk + 4);
+            if (offset >= fileSize) {
+                throw std::runtime_error("Corrupt commit-graph chunk table: " + path);
+            }
+            std::string id(reinterpret_cast<const char*>(chunk), 4);
+            if (id == "OIDF") {
+                layer.fanout = data + offset;
+            } else if (id == "OIDL") {
+                layer.ids = data + offset;
+            } else if (id == "CDAT") {
+                layer.data = data + offset;
+            } else if (id == "EDGE") {
+                layer.edges = data + offset;
+            } else if (id == "BIDX") {
+                layer.bloomIndex = data + offset;
+            } else if (id == "BDAT") {
+                uint64_t next = readUint64(chunk + 12 + 4);
+                layer.bloomData = data + offset;
+                layer.bloomDataLength = next > offset ? next - offset : 0;
+            }
+        }
+        
+        // Filters hashed with other settings cannot be queried with our keys
+        if (layer.bloomData && (layer.bloomDataLength < 12 || readUint32(layer.bloomData) != 1 ||
+                                readUint32(layer.bloomData + 4) != bloomHashCount)) {
+            layer.bloomIndex = nullptr;
+            layer.bloomData = nullptr;
+        }
+        if (!layer.bloomIndex || !layer.bloomData) {
+            layer.bloomIndex = nullptr;
+            layer.bloomData = nullptr;
+        }
+        if (!layer.fanout || !layer.ids || !layer.data) {
+            throw std::runtime_error("Commit-graph is missing a required chunk: " + path);
+        }
+        
+        layer.count = readUint32(layer.fanout + 255 * 4);
+        layer.base = size();
+        layer.hash = toHex(data + fileSize - 20, 20);
+        layers.push_back(std::move(layer));
+    }
+    
+    const Layer& layerOf(uint32_t position) const {
+        for (const auto& layer : layers) {
+            if (position < layer.base + layer.count) {
+                return layer;
+            }
+        }
+        throw std::runtime_error("Commit-graph position out of range");
+    }
+    
+    std::mutex mutex;
+    bool loaded = false;
+    bool chained = false;
+    std::vector<Layer> layers;
+};
+
+CommitGraph& commitGraph() {
+    static CommitGraph graph;
+    graph.load();
+    return graph;
+}
+
+// Parents, tree and date of a commit, from the commit-graph when it covers the
+// commit and by inflating and parsing the object otherwise. Shallow commits
+// have no parents, so every history walk stops at the shallow boundary.
+CommitInfo loadCommit(const std::string& hash) {
+    CommitGraph& graph = commitGraph();
+    uint32_t position = 0;
+    if (graph.find(hash, position)) {
+        return graph.commitAt(position);
+    }
+    int type = 0;
+    std::string content = readObjectContent(hash, type);
+    if (type != 1) {
+        throw std::runtime_error("Not a commit: " + hash);
+    }
+    CommitInfo commit = parseCommitObject(content);
+    if (shallowCommits().count(hash)) {
+        commit.parents.clear();
+    }
+    return commit;
+}
+
+// Write a commit-graph covering every commit reachable from the refs. With
+// split, only commits missing from the existing chain go into a new layer,
+// which absorbs the layers below it while it is at least half their size, so
+// the chain stays logarithmic in length. Without split, one full file replaces
+// any chain. Changed-path Bloom filters are written when asked for, or when
+// the existing graph already carries them.
+void writeCommitGraph(bool split, bool changedPaths) {
+    if (!shallowCommits().empty()) {
+        throw std::runtime_error("commit-graph is not supported in a shallow repository");
+    }
+    CommitGraph& graph = commitGraph();
+    std::string infoDir = ".git/objects/info";
+    std::string chainDir = infoDir + "/commit-graphs";
+    
+    // Existing layers that stay as the base of the new one; a single
+    // non-split file is folded into the first layer of a new chain. Layers
+    // are numbered from the base, so the kept ones hold the first keptSize
+    // positions.
+    size_t keptLayers = split && graph.isChain() ? graph.layerCount() : 0;
+    uint32_t keptSize = 0;
+    auto keepLayers = [&](size_t count) {
+        keptLayers = count;
+        keptSize = 0;
+        for (size_t i = 0; i < keptLayers; i++) {
+            keptSize += graph.layerSize(i);
+        }
+    };
+    keepLayers(keptLayers);
+    auto inKeptLayers = [&](const std::string& hash) {
+        uint32_t position = 0;
+        return keptLayers > 0 && graph.find(hash, position) && position < keptSize;
+    };
+    
+    std::vector<std::string> tips;
+    for (const auto& ref : listRefs()) {
+        tips.push_back(ref.second);
+    }
+    
+    auto collect = [&](std::vector<std::string>& commits) {
+        commits.clear();
+        std::unordered_set<std::string> seen;
+        std::vector<std::string> stack;
+        for (const auto& tip : tips) {
+            int type = 0;
+            uint32_t position = 0;
+            if (graph.find(tip, position)) {
+                stack.push_back(tip);
+            } else {
+                readObjectContent(tip, type);
+                if (type == 1) {
+                    stack.push_back(tip);
+                }
+            }
+        }
+        while (!stack.empty()) {
+            std::string hash = stack.back();
+            stack.pop_back();
+            if (inKeptLayers(hash) || !seen.insert(hash).second) {
+                continue;
+            }
+            commits.push_back(hash);
+            for (const auto& parent : loadCommit(hash).parents) {
+                stack.push_back(parent);
+            }
+        }
+    };
+    
+    std::vector<std::string> commits;
+    collect(commits);
+    
+    while (keptLayers > 0 && commits.size() * 2 > graph.layerSize(keptLayers - 1)) {
+        keepLayers(keptLayers - 1);
+        collect(commits);
+    }
+    
+    if (split && commits.empty()) {
+        std::cerr << "Commit-graph is up to date" << std::endl;
+        return;
+    }
+    
+    std::sort(commits.begin(), commits.end());
+    uint32_t base = keptSize;
+    
+    std::unordered_map<std::string, uint32_t> newPositions;
+    for (size_t i = 0; i < commits.size(); i++) {
+        newPositions[commits[i]] = base + static_cast<uint32_t>(i);
+    }
+    
+    struct GraphCommit {
+        CommitInfo info;
+        std::vector<uint32_t> parents;
+        uint32_t generation = 0;
+    };
+    std::vector<GraphCommit> data(commits.size());
+    for (size_t i = 0; i < commits.size(); i++) {
+        data[i].info = loadCommit(commits[i]);
+        for (const auto& parent : data[i].info.parents) {
+            auto it = newPositions.find(parent);
+            uint32_t position = 0;
+            if (it != newPositions.end()) {
+                data[i].parents.push_back(it->second);
+            } else if (graph.find(parent, position) && position < keptSize) {
+                data[i].parents.push_back(position);
+            } else {
+                // Commits of replaced layers must all be rewritten, or their
+                // positions would dangle once the old files are removed
+                throw std::runtime_error("Parent " + parent + " of " + commits[i] + " is missing");
+            }
+        }
+    }
+    
+    // Topological levels: one more than the highest parent, computed with an
+    // explicit stack so long histories cannot overflow the call stack
+    for (size_t start = 0; start < data.size(); start++) {
+        std::vector<size_t> stack = {start};
+        while (!stack.empty()) {
+            size_t i = stack.back();
+            if (data[i].generation != 0) {
+                stack.pop_back();
+                continue;
+            }
+            uint32_t generation = 1;
+            bool ready = true;
+            for (uint32_t parent : data[i].parents) {
+                if (parent >= base) {
+                    uint32_t parentGeneration = data[parent - base].generation;
+                    if (parentGeneration == 0) {
+                        stack.push_back(parent - base);
+                        ready = false;
+                    }
+                    generation = std::max(generation, parentGeneration + 1);
+                } else {
+                    generation = std::max(generation, graph.generationAt(parent) + 1);
+                }
+            }
+            if (ready) {
+                data[i].generation = std::min<uint32_t>(generation, 0x3FFFFFFF);
+                stack.pop_back();
+            }
+        }
+    }
+    
+    changedPaths = changedPaths || graph.hasBloomFilters();
+    std::vector<std::string> filters(changedPaths ? commits.size() : 0);
+    if (changedPaths) {
+        // Every filter needs a tree diff, so they are computed in parallel;
+        // filters already in the graph being replaced are reused
+        WorkStealingPool pool(0);
+        size_t filterChunk = 64;
+        for (size_t begin = 0; begin < commits.size(); begin += filterChunk) {
+            pool.submit([&, begin] {
+                size_t end = std::min(commits.size(), begin + filterChunk);
+                for (size_t i = begin; i < end; i++) {
+                    uint32_t position = 0;
+                    const unsigned char* existing = nullptr;
+                    size_t length = 0;
+                    if (graph.find(commits[i], position) && graph.bloomFilter(position, existing, length)) {
+                        filters[i].assign(reinterpret_cast<const char*>(existing), length);
+                        continue;
+                    }
+                    const auto& parents = data[i].info.parents;
+                    filters[i] = computeBloomFilter(data[i].info.tree,
+                                                    parents.empty() ? "" : loadCommit(parents[0]).tree);
+                }
+            });
+        }
+        pool.wait();
+    }
+    
+    std::vector<uint32_t> edges;
+    for (auto& commit : data) {
+        if (commit.parents.size() > 2) {
+            uint32_t start = static_cast<uint32_t>(edges.size());
+            for (size_t p = 1; p < commit.parents.size(); p++) {
+                edges.push_back(commit.parents[p] | (p + 1 == commit.parents.size() ? 0x80000000U : 0));
+            }
+            commit.parents.resize(2);
+            commit.parents[1] = 0x80000000U | start;
+        }
+    }
+    
+    std::vector<std::pair<std::string, uint64_t>> chunks = {
+        {"OIDF", 256 * 4},
+        {"OIDL", commits.size() * 20},
+        {"CDAT", commits.size() * 36},
+    };
+    if (!edges.empty()) {
+        chunks.push_back({"EDGE", edges.size() * 4});
+    }
+    uint64_t filterBytes = 0;
+    for (const auto& filter : filters) {
+        filterBytes += filter.length();
+    }
+    if (changedPaths) {
+        chunks.push_back({"BIDX", commits.size() * 4});
+        chunks.push_back({"BDAT", 12 + filterBytes});
+    }
+    if (keptLayers > 0) {
+        chunks.push_back({"BASE", keptLayers * 20});
+    }
+    
+    std::filesystem::create_directories(split ? chainDir : infoDir);
+    std::string tmpPath = (split ? chainDir : infoDir) + "/tmp_graph_" + std::to_string(::getpid());
+    HashedFileWriter writer(tmpPath);
+    writer.write("CGPH", 4);
+    unsigned char header[4] = {1, 1, static_cast<unsigned char>(chunks.size()), static_cast<unsigned char>(keptLayers)};
+    writer.write(header, sizeof(header));
+    
+    uint64_t chunkOffset = 8 + (chunks.size() + 1) * 12;
+    for (const auto& chunk : chunks) {
+        writer.write(chunk.first);
+        writer.writeUint64(chunkOffset);
+        chunkOffset += chunk.second;
+    }
+    writer.writeUint32(0);
+    writer.writeUint64(chunkOffset);
+    
+    size_t cursor = 0;
+    for (int i = 0; i < 256; i++) {
+        while (cursor < commits.size() && hexValue(commits[cursor][0]) * 16 + hexValue(commits[cursor][1]) <= i) {
+            cursor++;
+        }
+        writer.writeUint32(static_cast<uint32_t>(cursor));
+    }
+    for (const auto& hash : commits) {
+        writer.write(fromHex(hash));
+    }
+    for (const auto& commit : data) {
+        writer.write(fromHex(commit.info.tree));
+        writer.writeUint32(commit.parents.size() > 0 ? commit.parents[0] : CommitGraph::parentNone);
+        writer.writeUint32(commit.parents.size() > 1 ? commit.parents[1] : CommitGraph::parentNone);
+        uint64_t time = static_cast<uint64_t>(commit.info.commitTime);
+        writer.writeUint32((commit.generation << 2) | static_cast<uint32_t>((time >> 32) & 3));
+        writer.writeUint32(static_cast<uint32_t>(time));
+    }
+    for (uint32_t edge : edges) {
+        writer.writeUint32(edge);
+    }
+    if (changedPaths) {
+        uint32_t filterEnd = 0;
+        for (const auto& filter : filters) {
+            filterEnd += static_cast<uint32_t>(filter.length());
+            writer.writeUint32(filterEnd);
+        }
+        writer.writeUint32(1);
+        writer.writeUint32(bloomHashCount);
+        writer.writeUint32(bloomBitsPerEntry);
+        for (const auto& filter : filters) {
+            writer.write(filter);
+        }
+    }
+    for (size_t i = 0; i < keptLayers; i++) {
+        writer.write(fromHex(graph.layerHash(i)));
+    }
+    std::string checksum = writer.finish();
+    
+    if (split) {
+        std::vector<std::string> chain;
+        for (size_t i = 0; i < keptLayers; i++) {
+            chain.push_back(graph.layerHash(i));
+        }
+        std::vector<std::string> dropped;
+        for (size_t i = keptLayers; i < graph.layerCount(); i++) {
+            dropped.push_back(graph.layerHash(i));
+        }
+        chain.push_back(checksum);
+        std::filesystem::rename(tmpPath, chainDir + "/graph-" + checksum + ".graph");
+        
+        std::string tmpChain = chainDir + "/tmp_chain_" + std::to_string(::getpid());
+        std::ofstream chainFile(tmpChain);
+        for (const auto& hash : chain) {
+            chainFile << hash << "\n";
+        }
+        chainFile.close();
+        std::filesystem::rename(tmpChain, chainDir + "/commit-graph-chain");
+        std::filesystem::remove(infoDir + "/commit-graph");
+        for (const auto& hash : dropped) {
+            std::filesystem::remove(chainDir + "/graph-" + hash + ".graph");
+        }
+        std::cerr << "Wrote commit-graph layer with " << commits.size() << " commits ("
+                  << chain.size() << " layers in chain)" << std::endl;
+    } else {
+        std::filesystem::rename(tmpPath, infoDir + "/commit-graph");
+        std::filesystem::remove_all(chainDir);
+        std::cerr << "Wrote commit-graph with " << commits.size() << " commits" << std::endl;
+    }
+    
+    graph.reload();
+}
+
+// True when ancestor is reachable from descendant. Generation numbers bound
+// the search: a commit whose generation is below the ancestor's cannot lead
+// back to it, so those branches are never expanded.
+bool isAncestor(const std::string& ancestor, const std::string& descendant) {
+    CommitGraph& graph = commitGraph();
+    uint32_t position = 0;
+    uint32_t minGeneration = graph.find(ancestor, position) ? graph.generationAt(position) : 0;
+    
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> stack = {descendant};
+    while (!stack.empty()) {
+        std::string hash = stack.back();
+        stack.pop_back();
+        if (hash == ancestor) {
+            return true;
+        }
+        if (!seen.insert(hash).second) {
+            continue;
+        }
+        if (graph.find(hash, position) && graph.generationAt(position) < minGeneration) {
+            continue;
+        }
+        for (const auto& parent : loadCommit(hash).parents) {
+            stack.push_back(parent);
+        }
+    }
+    return false;
+}
+
+// Mode and id of the entry at path inside a tree; empty when it does not exist
+std::string lookupTreePath(const std::string& tree, const std::string& path) {
+    std::string current = tree;
+    size_t start = 0;
+    while (true) {
+        size_t slash = path.find('/', start);
+        std::string name = path.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+        std::string found;
+        for (const auto& entry : readTreeEntries(current)) {
+            if (entry.name == name) {
+                found = entry.mode + " " + entry.hash;
+                if (slash != std::string::npos && entry.mode == "40000") {
+                    current = entry.hash;
+                } else if (slash != std::string::npos) {
+                    return "";
+                }
+                break;
+            }
+        }
+        if (found.empty() || slash == std::string::npos) {
+            return found;
+        }
+        start = slash + 1;
+    }
+}
+
+// Commits reachable from tips that change any of paths, with git's default
+// history simplification: a commit identical to one of its parents at those
+// paths is hidden and only that parent is followed. The changed-path Bloom
+// filter answers the first-parent comparison whenever it rules the paths out,
+// which skips the tree lookups for most commits.
+void walkPathLimited(const std::vector<std::string>& tips, const std::vector<std::string>& paths,
+                     const std::function<void(const std::string&)>& visit) {
+    CommitGraph& graph = commitGraph();
+    
+    // A path only matches a filter when it and every leading directory do
+    std::vector<std::vector<std::array<uint32_t, bloomHashCount>>> keys;
+    for (const auto& path : paths) {
+        std::vector<std::array<uint32_t, bloomHashCount>> pathKeys;
+        for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+            pathKeys.push_back(bloomKey(path.substr(0, slash)));
+        }
+        pathKeys.push_back(bloomKey(path));
+        keys.push_back(std::move(pathKeys));
+    }
+    
+    auto bloomRulesOut = [&](const std::string& hash) {
+        uint32_t position = 0;
+        const unsigned char* filter = nullptr;
+        size_t length = 0;
+        if (!graph.find(hash, position) || !graph.bloomFilter(position, filter, length)) {
+            return false;
+        }
+        for (const auto& pathKeys : keys) {
+            bool mayContain = std::all_of(pathKeys.begin(), pathKeys.end(), [&](const auto& key) {
+                return bloomMayContain(filter, length, key);
+            });
+            if (mayContain) {
+                return false;
+            }
+        }
+        return true;
+    };
+    
+    auto sameAtPaths = [&](const std::string& tree, const std::string& otherTree) {
+        if (tree == otherTree) {
+            return true;
+        }
+        for (const auto& path : paths) {
+            if (lookupTreePath(tree, path) != lookupTreePath(otherTree, path)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    
+    // Annotated tags are peeled; tips that are not commits underneath have
+    // no history to walk
+    std::vector<std::string> stack;
+    for (auto tip = tips.rbegin(); tip != tips.rend(); ++tip) {
+        std::string hash = *tip;
+        int type = 0;
+        std::string content = readObjectContent(hash, type);
+        while (type == 4 && content.rfind("object ", 0) == 0) {
+            hash = content.substr(7, 40);
+            content = readObjectContent(hash, type);
+        }
+        if (type == 1) {
+            stack.push_back(hash);
+        }
+    }
+    
+    std::unordered_set<std::string> seen;
+    while (!stack.empty()) {
+        std::string hash = stack.back();
+        stack.pop_back();
+        if (!seen.insert(hash).second) {
+            continue;
+        }
+        
+        CommitInfo commit = loadCommit(hash);
+        if (commit.parents.empty()) {
+            // A root commit counts as changing the paths it contains
+            if (!sameAtPaths(commit.tree, "")) {
+                visit(hash);
+            }
+            continue;
+        }
+        
+        int sameParent = -1;
+        for (size_t i = 0; i < commit.parents.size() && sameParent < 0; i++) {
+            if ((i == 0 && bloomRulesOut(hash)) || sameAtPaths(commit.tree, loadCommit(commit.parents[i]).tree)) {
+                sameParent = static_cast<int>(i);
+            }
+        }
+        
+        if (sameParent >= 0) {
+            stack.push_back(commit.parents[sameParent]);
+        } else {
+            visit(hash);
+            stack.insert(stack.end(), commit.parents.rbegin(), commit.parents.rend());
+        }
+    }
+}
+
+// Enumerate objects reachable from tips by parsing commits, tags and trees.
+// visit(hash, type, path) returns false for objects that should not be
+// descended into, such as ones already seen.
+void walkReachable(const std::vector<std::string>& tips,
+                   const std::function<bool(const std::string&, int, const std::string&)>& visit) {
+    std::vector<std::tuple<std::string, int, std::string>> stack;
+    for (const auto& tip : tips) {
+        stack.emplace_back(tip, 0, "");
+    }
+    // A partial clone's omitted blobs are the promisor remote's to provide,
+    // so walks pass over them instead of fetching each one. A blob that is
+    // neither here nor promised means the repository is corrupt.
+    bool partial = !promisorRemote().empty();
+    
+    while (!stack.empty()) {
+        auto [hash, type, path] = stack.back();
+        stack.pop_back();
+        
+        // Tips are read first to learn their type; everything else is visited
+        // before being read so already-seen objects cost nothing. Commits come
+        // from the commit-graph when it covers them.
+        uint32_t position = 0;
+        std::string content;
+        bool haveContent = false;
+        if (type == 0) {
+            if (commitGraph().find(hash, position)) {
+                type = 1;
+            } else {
+                content = readObjectContent(hash, type);
+                haveContent = true;
+            }
+        }
+        if (!visit(hash, type, path)) {
+            continue;
+        }
+        if (type != 1 && !haveContent) {
+            int actualType = 0;
+            content = readObjectContent(hash, actualType);
+        }
+        
+        if (type == 1) {
+            CommitInfo commit = loadCommit(hash);
+            for (auto parent = commit.parents.rbegin(); parent != commit.parents.rend(); ++parent) {
+                stack.emplace_back(*parent, 1, "");
+            }
+            stack.emplace_back(commit.tree, 2, "");
+        } else if (type == 2) {
+            std::string objectData = std::string("tree ") + std::to_string(content.length()) + '\0' + content;
+            for (const auto& entry : parseTreeObject(objectData)) {
+                std::string entryPath = path.empty() ? entry.name : path + "/" + entry.name;
+                if (entry.mode == "40000") {
+                    stack.emplace_back(entry.hash, 2, entryPath);
+                } else if (entry.mode != "160000") {
+                    ObjectState state = partial ? objectState(entry.hash) : ObjectState::Present;
+                    if (state == ObjectState::Missing) {
+                        throw std::runtime_error("Missing blob " + entry.hash + " at " + entryPath);
+                    }
+                    // Blobs have no children, so they are visited without being read
+                    if (state == ObjectState::Present) {
+                        visit(entry.hash, 3, entryPath);
+                    }
+                }
+            }
+        } else if (type == 4) {
+            if (content.rfind("object ", 0) == 0) {
+                stack.emplace_back(content.substr(7, 40), 0, "");
+            }
+        }
+    }
+}
+
+// Uncompressed bitset with the EWAH serialisation git uses in .bitmap files.
+// Bit i lives in word i / 64 at position i % 64.
+class EwahBitmap {
+public:
+    void set(size_t bit) {
+        if (bit / 64 >= words.size()) {
+            words.resize(bit / 64 + 1, 0);
+        }
+        words[bit / 64] |= 1ULL << (bit % 64);
+    }
+    
+    bool get(size_t bit) const {
+        return bit / 64 < words.size() && (words[bit / 64] >> (bit % 64)) & 1;
+    }
+    
+    void orWith(const EwahBitmap& other) {
+        if (other.words.size() > words.size()) {
+            words.resize(other.words.size(), 0);
+        }
+        for (size_t i = 0; i < other.words.size(); i++) {
+            words[i] |= other.words[i];
+        }
+    }
+    
+    void xorWith(const EwahBitmap& other) {
+        if (other.words.size() > words.size()) {
+            words.resize(other.words.size(), 0);
+        }
+        for (size_t i = 0; i < other.words.size(); i++) {
+            words[i] ^= other.words[i];
+        }
+    }
+    
+    void andNot(const EwahBitmap& other) {
+        for (size_t i = 0; i < words.size() && i < other.words.size(); i++) {
+            words[i] &= ~other.words[i];
+        }
+    }
+    
+    size_t count() const {
+        size_t total = 0;
+        for (uint64_t word : words) {
+            total += static_cast<size_t>(__builtin_popcountll(word));
+        }
+        return total;
+    }
+    
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (size_t i = 0; i < words.size(); i++) {
+            uint64_t word = words[i];
+            while (word) {
+                fn(i * 64 + static_cast<size_t>(__builtin_ctzll(word)));
+                word &= word - 1;
+            }
+        }
+    }
+    
+    // Each run-length word holds the running bit, a 32-bit count of clean
+    // (all-zero or all-one) words and a 31-bit count of literal words that follow
+    void serialize(HashedFileWriter& writer, size_t bitSize) const {
+        std::vector<uint64_t> buffer;
+        size_t lastRlw = 0;
+        size_t wordCount = (bitSize + 63) / 64;
+        size_t i = 0;
+        
+        do {
+            lastRlw = buffer.size();
+            buffer.push_back(0);
+            
+            uint64_t runBit = 0;
+            uint64_t runLength = 0;
+            uint64_t first = wordAt(i);
+            if (i < wordCount && (first == 0 || first == ~0ULL)) {
+                runBit = first == ~0ULL;
+                while (i < wordCount && wordAt(i) == first && runLength < 0xFFFFFFFFULL) {
+                    runLength++;
+                    i++;
+                }
+            }
+            
+            uint64_t literals = 0;
+            while (i < wordCount && literals < 0x7FFFFFFFULL && wordAt(i) != 0 && wordAt(i) != ~0ULL) {
+                buffer.push_back(wordAt(i));
+                literals++;
+                i++;
+            }
+            
+            buffer[lastRlw] = runBit | (runLength << 1) | (literals << 33);
+        } while (i < wordCount);
+        
+        writer.writeUint32(static_cast<uint32_t>(bitSize));
+        writer.writeUint32(static_cast<uint32_t>(buffer.size()));
+        for (uint64_t word : buffer) {
+            writer.writeUint64(word);
+        }
+        writer.writeUint32(static_cast<uint32_t>(lastRlw));
+    }
+    
+    static EwahBitmap parse(const unsigned char* data, size_t length, size_t& consumed) {
+        if (length < 8) {
+            throw std::runtime_error("Truncated EWAH bitmap");
+        }
+        uint32_t bufferWords = readUint32(data + 4);
+        consumed = 8 + static_cast<size_t>(bufferWords) * 8 + 4;
+        if (consumed > length) {
+            throw std::runtime_error("Truncated EWAH bitmap");
+        }
+        
+        EwahBitmap bitmap;
+        const unsigned char* buffer = data + 8;
+        for (uint32_t i = 0; i < bufferWords; ) {
+            uint64_t rlw = readUint64(buffer + static_cast<size_t>(i) * 8);
+            uint64_t runLength = (rlw >> 1) & 0xFFFFFFFFULL;
+            uint64_t literals = rlw >> 33;
+            bitmap.words.insert(bitmap.words.end(), runLength, (rlw & 1) ? ~0ULL : 0);
+            i++;
+            for (uint64_t l = 0; l < literals && i < bufferWords; l++, i++) {
+                bitmap.words.push_back(readUint64(buffer + static_cast<size_t>(i) * 8));
+            }
+        }
+        return bitmap;
+    }
+    
+private:
+    uint64_t wordAt(size_t i) const {
+        return i < words.size() ? words[i] : 0;
+    }
+    
+    std::vector<uint64_t> words;
+};
+
+// A pack with its reachability bitmap. Bit positions follow pack (offset)
+// order, taken from the pack's reverse index; the commit bitmaps in the .bitmap file are decoded on demand,
+// following XOR chains against earlier entries.
+class PackBitmapIndex {
+public:
+    explicit PackBitmapIndex(const std::string& idxPath) : pack(idxPath) {
+        buildPackOrder();
+        
+        std::string bitmapPath = idxPath.substr(0, idxPath.length() - 4) + ".bitmap";
+        if (!std::filesystem::exists(bitmapPath)) {
+            return;
+        }
+        file = std::make_unique<MappedFile>(bitmapPath);
+        const unsigned char* data = file->data();
+        size_t length = file->size() - 20;
+        if (file->size() < 32 + 20 || std::memcmp(data, "BITM", 4) != 0 || ((data[4] << 8) | data[5]) != 1) {
+            throw std::runtime_error("Unsupported bitmap: " + bitmapPath);
+        }
+        if (toHex(data + 12, 20) != pack.packChecksum()) {
+            throw std::runtime_error("Bitmap does not match its pack: " + bitmapPath);
+        }
+        uint32_t entryCount = readUint32(data + 8);
+        
+        size_t pos = 32;
+        for (int t = 0; t < 4; t++) {
+            size_t consumed = 0;
+            typeBitmaps[t] = EwahBitmap::parse(data + pos, length - pos, consumed);
+            pos += consumed;
+        }
+        
+        for (uint32_t i = 0; i < entryCount; i++) {
+            if (pos + 6 > length) {
+                throw std::runtime_error("Truncated bitmap entry: " + bitmapPath);
+            }
+            uint32_t position = readUint32(data + pos);
+            entries.push_back({position, data[pos + 4], pos + 6});
+            commitEntries[position] = i;
+            size_t consumed = 0;
+            EwahBitmap::parse(data + pos + 6, length - pos - 6, consumed);
+            pos += 6 + consumed;
+        }
+    }
+    
+    const PackFile& packFile() const { return pack; }
+    bool hasBitmaps() const { return file != nullptr; }
+    size_t objectCount() const { return order.size(); }
+    
+    bool bitFor(const std::string& hash, uint32_t& bit) const {
+        std::string raw = fromHex(hash);
+        uint32_t position = 0;
+        if (!pack.findPosition(reinterpret_cast<const unsigned char*>(raw.data()), position)) {
+            return false;
+        }
+        bit = bitOf[position];
+        return true;
+    }
+    
+    std::string hashAtBit(size_t bit) const {
+        return toHex(pack.hashAt(order[bit]), 20);
+    }
+    
+    uint64_t offsetAtBit(size_t bit) const {
+        return pack.offsetAt(order[bit]);
+    }
+    
+    // Type bitmaps in commit, tree, blob, tag order; only set when loaded from disk
+    const EwahBitmap& typeBitmap(int type) const {
+        return typeBitmaps[type - 1];
+    }
+    
+    bool commitBitmap(const std::string& hash, EwahBitmap& out) const {
+        std::string raw = fromHex(hash);
+        uint32_t position = 0;
+        if (!file || !pack.findPosition(reinterpret_cast<const unsigned char*>(raw.data()), position)) {
+            return false;
+        }
+        auto it = commitEntries.find(position);
+        if (it == commitEntries.end()) {
+            return false;
+        }
+        out = decodeEntry(it->second);
+        return true;
+    }
+    
+private:
+    struct Entry {
+        uint32_t position;      // index of the commit in the .idx
+        uint8_t xorOffset;      // entry this one is XORed against, counting back
+        size_t bitmapOffset;
+    };
+    
+    void buildPackOrder() {
+        order.resize(pack.objectCount());
+        for (uint32_t bit = 0; bit < order.size(); bit++) {
+            order[bit] = pack.positionAtRank(bit);
+        }
+        bitOf.resize(order.size());
+        for (uint32_t bit = 0; bit < order.size(); bit++) {
+            bitOf[order[bit]] = bit;
+        }
+    }
+    
+    EwahBitmap decodeEntry(uint32_t index) const {
+        const Entry& entry = entries[index];
+        size_t consumed = 0;
+        EwahBitmap bitmap = EwahBitmap::parse(file->data() + entry.bitmapOffset,
+                                              file->size() - 20 - entry.bitmapOffset, consumed);
+        if (entry.xorOffset > 0) {
+            if (entry.xorOffset > index) {
+                throw std::runtime_error("Invalid bitmap XOR offset");
+            }
+            bitmap.xorWith(decodeEntry(index - entry.xorOffset));
+        }
+        return bitmap;
+    }
+    
+    PackFile pack;
+    std::vector<uint32_t> order;     // bit -> .idx position
+    std::vector<uint32_t> bitOf;     // .idx position -> bit
+    std::unique_ptr<MappedFile> file;
+    EwahBitmap typeBitmaps[4];
+    std::vector<Entry> entries;
+    std::unordered_map<uint32_t, uint32_t> commitEntries;
+};
+
+// The first pack that has a .bitmap next to it, if any
+std::unique_ptr<PackBitmapIndex> openBitmappedPack() {
+    for (const auto& idxPath : listPackIndexes()) {
+        if (std::filesystem::exists(idxPath.substr(0, idxPath.length() - 4) + ".bitmap")) {
+            return std::make_unique<PackBitmapIndex>(idxPath);
+        }
+    }
+    return nullptr;
+}
+
+// Mark everything reachable from tips in `result`. Commits with a bitmap (from
+// the file, or from `computed` while one is being written) are OR-ed in without
+// walking. Reachable objects outside the pack are collected in `extra`.
+void fillReachabilityBitmap(const PackBitmapIndex& index, const std::vector<std::string>& tips,
+                            const std::unordered_map<std::string, EwahBitmap>* computed,
+                            EwahBitmap& result, std::unordered_set<std::string>* extra) {
+    auto storedBitmap = [&](const std::string& hash, EwahBitmap& out) {
+        if (computed) {
+            auto it = computed->find(hash);
+            if (it != computed->end()) {
+                out = it->second;
+                return true;
+            }
+        }
+        return index.commitBitmap(hash, out);
+    };
+    
+    walkReachable(tips, [&](const std::string& hash, int type, const std::string&) {
+        uint32_t bit = 0;
+        bool inPack = index.bitFor(hash, bit);
+        if (inPack ? result.get(bit) : (extra && extra->count(hash))) {
+            return false;
+        }
+        if (type == 1) {
+            EwahBitmap stored;
+            if (storedBitmap(hash, stored)) {
+                result.orWith(stored);
+                return false;
+            }
+        }
+        if (inPack) {
+            result.set(bit);
+        } else if (extra) {
+            extra->insert(hash);
+        } else {
+            throw std::runtime_error("Reachable object " + hash + " is not in the bitmapped pack");
+        }
+        return true;
+    });
+}
+
+// Write <pack>.bitmap for the pack behind idxPath. Bitmaps are stored for every
+// ref tip plus every 100th commit of the history walk, computed oldest first so
+// each one reuses the bitmaps below it. Every object reachable from the refs
+// must be in the pack.
+void writePackBitmap(const std::string& idxPath) {
+    PackBitmapIndex index(idxPath);
+    const PackFile& pack = index.packFile();
+    size_t objectCount = index.objectCount();
+    
+    EwahBitmap typeBitmaps[4];
+    for (size_t bit = 0; bit < objectCount; bit++) {
+        typeBitmaps[pack.typeAt(index.offsetAtBit(bit)) - 1].set(bit);
+    }
+    
+    // Commits in walk order from the ref tips, newest first
+    std::vector<std::string> tips;
+    for (const auto& ref : listRefs()) {
+        tips.push_back(ref.second);
+    }
+    std::vector<std::string> commits;
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> stack(tips.rbegin(), tips.rend());
+    while (!stack.empty()) {
+        std::string hash = stack.back();
+        stack.pop_back();
+        uint32_t bit = 0;
+        if (!seen.insert(hash).second || !index.bitFor(hash, bit) || !typeBitmaps[0].get(bit)) {
+            continue;
+        }
+        commits.push_back(hash);
+        CommitInfo commit = loadCommit(hash);
+        stack.insert(stack.end(), commit.parents.rbegin(), commit.parents.rend());
+    }
+    
+    std::unordered_set<std::string> tipSet(tips.begin(), tips.end());
+    std::vector<std::string> selected;
+    for (size_t i = 0; i < commits.size(); i++) {
+        if (i % 100 == 0 || tipSet.count(commits[i])) {
+            selected.push_back(commits[i]);
+        }
+    }
+    
+    std::unordered_map<std::string, EwahBitmap> computed;
+    for (auto it = selected.rbegin(); it != selected.rend(); ++it) {
+        EwahBitmap bitmap;
+        fillReachabilityBitmap(index, {*it}, &computed, bitmap, nullptr);
+        computed[*it] = std::move(bitmap);
+    }
+    
+    std::string bitmapPath = idxPath.substr(0, idxPath.length() - 4) + ".bitmap";
+    std::string tmpPath = bitmapPath + ".tmp";
+    HashedFileWriter writer(tmpPath);
+    writer.write("BITM", 4);
+    unsigned char header[4] = {0, 1, 0, 1};  // version 1, BITMAP_OPT_FULL_DAG
+    writer.write(header, sizeof(header));
+    writer.writeUint32(static_cast<uint32_t>(selected.size()));
+    writer.write(fromHex(pack.packChecksum()));
+    
+    for (const auto& bitmap : typeBitmaps) {
+        bitmap.serialize(writer, objectCount);
+    }
+    for (const auto& hash : selected) {
+        std::string raw = fromHex(hash);
+        uint32_t position = 0;
+        pack.findPosition(reinterpret_cast<const unsigned char*>(raw.data()), position);
+        writer.writeUint32(position);
+        unsigned char flags[2] = {0, 0};  // no XOR base, no flags
+        writer.write(flags, sizeof(flags));
+        computed[hash].serialize(writer, objectCount);
+    }
+    writer.finish();
+    std::filesystem::rename(tmpPath, bitmapPath);
+    
+    std::cerr << "Wrote bitmaps for " << selected.size() << " of " << commits.size() << " commits" << std::endl;
+}
+
+// Objects reachable from tips. With a bitmapped pack the walk stops at the
+// first commit that has a bitmap, so counting a whole history is a handful of
+// bitmap ORs; otherwise every commit and tree is parsed.
+std::vector<std::string> listReachableObjects(const std::vector<std::string>& tips, bool useBitmaps,
+                                              std::vector<std::string>* paths = nullptr) {
+    std::vector<std::string> objects;
+    
+    std::unique_ptr<PackBitmapIndex> index = useBitmaps ? openBitmappedPack() : nullptr;
+    if (index && index->hasBitmaps()) {
+        EwahBitmap result;
+        std::unordered_set<std::string> extra;
+        fillReachabilityBitmap(*index, tips, nullptr, result, &extra);
+        result.forEach([&](size_t bit) {
+            objects.push_back(index->hashAtBit(bit));
+        });
+        objects.insert(objects.end(), extra.begin(), extra.end());
+        if (paths) {
+            paths->assign(objects.size(), "");
+        }
+        return objects;
+    }
+    
+    std::unordered_set<std::string> seen;
+    walkReachable(tips, [&](const std::string& hash, int, const std::string& path) {
+        if (!seen.insert(hash).second) {
+            return false;
+        }
+        objects.push_back(hash);
+        if (paths) {
+            paths->push_back(path);
+        }
+        return true;
+    });
+    return objects;
+}
+
+// pkt-line framing used by the smart protocol: four hex digits giving the
+// packet length (themselves included) and the payload. The special lengths
+// 0000, 0001 and 0002 are the flush, delimiter and response-end packets.
+std::string pktLine(const std::string& payload) {
+    if (payload.length() + 4 > 65520) {
+        throw std::runtime_error("pkt-line payload too long");
+    }
+    static const char digits[] = "0123456789abcdef";
+    size_t length = payload.length() + 4;
+    std::string line(4, '0');
+    for (int i = 3; i >= 0; i--) {
+        line[i] = digits[length & 0xF];
+        length >>= 4;
+    }
+    return line + payload;
+}
+
+const std::string pktFlush = "0000";
+const std::string pktDelim = "0001";
+
+enum class PktType { Data, Flush, Delim, ResponseEnd };
+
+class PktLineReader {
+public:
+    explicit PktLineReader(std::string_view data) : data(data) {}
+    
+    // Read the next packet; false once the buffer is exhausted. Data payloads
+    // keep their trailing newline, if any.
+    bool next(PktType& type, std::string_view& payload) {
+        if (pos >= data.length()) {
+            return false;
+        }
+        if (pos + 4 > data.length()) {
+            throw std::runtime_error("Truncated pkt-line length");
+        }
+        size_t length = 0;
+        for (size_t i = 0; i < 4; i++) {
+            length = (length << 4) | static_cast<size_t>(hexValue(data[pos + i]));
+        }
+        
+        payload = std::string_view();
+        if (length < 4) {
+            type = length == 0 ? PktType::Flush : length == 1 ? PktType::Delim : PktType::ResponseEnd;
+            pos += 4;
+            return true;
+        }
+        if (pos + length > data.length()) {
+            throw std::runtime_error("Truncated pkt-line");
+        }
+        type = PktType::Data;
+        payload = data.substr(pos + 4, length - 4);
+        pos += length;
+        
+        if (payload.substr(0, 4) == "ERR ") {
+            throw std::runtime_error("Remote error: " + std::string(payload.substr(4)));
+        }
+        return true;
+    }
+    
+private:
+    std::string_view data;
+    size_t pos = 0;
+};
+
+std::string_view trimNewline(std::string_view line) {
+    if (!line.empty() && line.back() == '\n') {
+        line.remove_suffix(1);
+    }
+    return line;
+}
+
+// Shallow boundary changes reported in a fetch response's shallow-info section
+struct ShallowUpdate {
+    std::vector<std::string> shallow;      // now cut below these commits
+    std::vector<std::string> unshallow;    // their parents were sent after all
+};
+
+// Incremental reader for the response to a protocol v2 fetch. Bytes are fed
+// as they arrive and pkt-lines are reassembled across pieces. The commits
+// acknowledged during negotiation and shallow-info are collected and other
+// sections before the packfile are skipped; inside the
+// packfile the sideband channel byte routes band 1 to onPackData, band 2 to
+// stderr as progress and band 3 to an error.
+class FetchResponseDemuxer {
+public:
+    explicit FetchResponseDemuxer(std::function<void(const char*, size_t)> onPackData)
+        : onPackData(std::move(onPackData)) {}
+    
+    void feed(const char* data, size_t length) {
+        pending.append(data, length);
+        std::string_view buffer(pending);
+        size_t pos = 0;
+        while (state != State::Done && pos + 4 <= buffer.length()) {
+            size_t packetLength = 0;
+            for (size_t i = 0; i < 4; i++) {
+                packetLength = (packetLength << 4) | static_cast<size_t>(hexValue(buffer[pos + i]));
+            }
+            size_t total = packetLength < 4 ? 4 : packetLength;
+            if (pos + total > buffer.length()) {
+                break;
+            }
+            PktLineReader reader(buffer.substr(pos, total));
+            PktType type;
+            std::string_view payload;
+            reader.next(type, payload);
+            handlePacket(type, payload);
+            pos += total;
+        }
+        pending.erase(0, pos);
+        if (state == State::Done && !pending.empty()) {
+            throw std::runtime_error("Unexpected data after the fetch response");
+        }
+    }
+    
+    // Throw unless the response was terminated. A negotiation round that is
+    // not ready yet ends after its acknowledgments, without a packfile.
+    void finish() const {
+        if (state != State::Done) {
+            throw std::runtime_error("Fetch response ended early");
+        }
+    }
+    
+    bool hasPackfile() const { return sawPackfile; }
+    const std::vector<std::string>& acknowledged() const { return acks; }
+    const ShallowUpdate& shallowInfo() const { return shallow; }
+    
+private:
+    enum class State { SectionHeader, SectionBody, Packfile, Done };
+    
+    void handlePacket(PktType type, std::string_view payload) {
+        if (type == PktType::Flush || type == PktType::ResponseEnd) {
+            state = State::Done;
+            return;
+        }
+        if (type == PktType::Delim) {
+            state = State::SectionHeader;
+            return;
+        }
+        
+        switch (state) {
+        case State::SectionHeader:
+            section = trimNewline(payload);
+            if (section == "packfile") {
+                state = State::Packfile;
+                sawPackfile = true;
+            } else {
+                state = State::SectionBody;
+            }
+            break;
+        case State::SectionBody:
+            // wanted-refs carries nothing needed yet
+            if (section == "acknowledgments") {
+                std::string_view line = trimNewline(payload);
+                if (line.rfind("ACK ", 0) == 0) {
+                    acks.emplace_back(line.substr(4));
+                }
+            } else if (section == "shallow-info") {
+                std::string_view line = trimNewline(payload);
+                if (line.rfind("shallow ", 0) == 0) {
+                    shallow.shallow.emplace_back(line.substr(8));
+                } else if (line.rfind("unshallow ", 0) == 0) {
+                    shallow.unshallow.emplace_back(line.substr(10));
+                }
+            }
+            break;
+        case State::Packfile:
+            if (payload.empty()) {
+                break;
+            }
+            if (payload[0] == 1) {
+                onPackData(payload.data() + 1, payload.length() - 1);
+            } else if (payload[0] == 2) {
+                // Progress arrives in arbitrary pieces; print whole lines
+                progress.append(payload.substr(1));
+                size_t end;
+                while ((end = progress.find_first_of("\r\n")) != std::string::npos) {
+                    std::cerr << "remote: " << progress.substr(0, end) << progress[end] << std::flush;
+                    progress.erase(0, end + 1);
+                }
+            } else if (payload[0] == 3) {
+                throw std::runtime_error("Remote error: " + std::string(trimNewline(payload.substr(1))));
+            } else {
+                throw std::runtime_error("Invalid sideband channel " + std::to_string(static_cast<int>(payload[0])));
+            }
+            break;
+        case State::Done:
+            break;
+        }
+    }
+    
+    std::function<void(const char*, size_t)> onPackData;
+    std::string pending;
+    std::string progress;
+    std::string section;
+    std::vector<std::string> acks;
+    ShallowUpdate shallow;
+    State state = State::SectionHeader;
+    bool sawPackfile = false;
+};
+
+struct RemoteRef {
+    std::string name;
+    std::string hash;           // empty for an unborn HEAD
+    std::string symrefTarget;
+    std::string peeled;         // object an annotated tag points at
+};
+
+// Whether a ref a remote advertised is safe to act on: HEAD or a well-formed
+// name under refs/, with full object ids and, for a symref, a target that is
+// itself well-formed. Anything else is dropped with a warning, as git refuses
+// to fetch refs with dangerous names.
+bool acceptRemoteRef(const RemoteRef& ref) {
+    auto isObjectId = [](const std::string& hash) {
+        return hash.length() == 40 && std::all_of(hash.begin(), hash.end(), ::isxdigit);
+    };
+    bool valid = (ref.name == "HEAD" || isValidRefName(ref.name)) &&
+                 (ref.hash.empty() || isObjectId(ref.hash)) && (ref.peeled.empty() || isObjectId(ref.peeled)) &&
+                 (ref.symrefTarget.empty() || isValidRefName(ref.symrefTarget));
+    if (!valid) {
+        std::cerr << "warning: ignoring ref with a dangerous name or bad object id: " << ref.name << std::endl;
+    }
+    return valid;
+}
+
+// How far history is fetched: depth commits below each want (counted from the
+// current shallow boundary when relative), or commits newer than since
+struct DeepenRequest {
+    int depth = 0;
+    bool relative = false;
+    int64_t since = 0;
+};
+
+// Arguments of one fetch command. shallow lists the commits this repository
+// is already cut below; filter is a partial clone filter spec such as
+// "blob:none".
+struct FetchRequest {
+    std::vector<std::string> wants;
+    std::vector<std::string> haves;     // local tips; their history is negotiated
+    DeepenRequest deepen;
+    std::vector<std::string> shallow;
+    std::string filter;
+    bool thinPack = false;              // allow deltas against objects we have
+    bool noProgress = false;            // no progress messages on sideband 2
+};
+
+// Chooses the haves offered in fetch negotiation. Local history is walked
+// newest first from the tips, but after every have that is sent a run of
+// commits is skipped, each run half again as long as the one before, so a long
+// history takes a logarithmic number of haves to reach what the server has.
+// Acknowledged commits and everything walked below them are common and never
+// offered.
+class SkippingNegotiator {
+public:
+    explicit SkippingNegotiator(const std::vector<std::string>& tips) {
+        for (std::string hash : tips) {
+            int type = 0;
+            std::string content = readObjectContent(hash, type);
+            while (type == 4 && content.rfind("object ", 0) == 0 && objectExists(content.substr(7, 40))) {
+                hash = content.substr(7, 40);
+                content = readObjectContent(hash, type);
+            }
+            if (type == 1 && !walked.count(hash)) {
+                push(hash, 0, 0);
+            }
+        }
+    }
+    
+    // Next commit to offer, or an empty string once every commit not known to
+    // be common has been walked
+    std::string next() {
+        while (!queue.empty()) {
+            std::string hash = queue.top().second;
+            queue.pop();
+            Walked& commit = walked[hash];
+            commit.popped = true;
+            if (commit.common) {
+                continue;
+            }
+            bool pushedParent = false;
+            for (const auto& parent : commit.parents) {
+                pushedParent = pushParent(commit, parent) || pushedParent;
+            }
+            // The end of a line of history is offered even in the middle of a skip
+            if (commit.ttl == 0 || !pushedParent) {
+                return hash;
+            }
+        }
+        return "";
+    }
+    
+    // Record a commit the server acknowledged. Returns false if it was
+    // already known to be common.
+    bool acknowledge(const std::string& hash) {
+        auto found = walked.find(hash);
+        if (found == walked.end() || found->second.common) {
+            return false;
+        }
+        std::vector<std::string> stack = {hash};
+        while (!stack.empty()) {
+            auto commit = walked.find(stack.back());
+            stack.pop_back();
+            if (commit == walked.end() || commit->second.common) {
+                continue;
+            }
+            commit->second.common = true;
+            stack.insert(stack.end(), commit->second.parents.begin(), commit->second.parents.end());
+        }
+        return true;
+    }
+    
+private:
+    // ttl counts the commits still to skip on this line of history, and
+    // originalTtl the length of the run it belongs to
+    struct Walked {
+        std::vector<std::string> parents;
+        uint32_t ttl = 0;
+        uint32_t originalTtl = 0;
+        bool popped = false;
+        bool common = false;
+    };
+    
+    void push(const std::string& hash, uint32_t ttl, uint32_t originalTtl) {
+        CommitInfo info = loadCommit(hash);
+        Walked& commit = walked[hash];
+        commit.parents = std::move(info.parents);
+        commit.ttl = ttl;
+        commit.originalTtl = originalTtl;
+        queue.emplace(info.commitTime, hash);
+    }
+    
+    bool pushParent(const Walked& child, const std::string& parent) {
+        uint32_t originalTtl = child.ttl > 0 ? child.originalTtl : child.originalTtl * 3 / 2 + 1;
+        uint32_t ttl = child.ttl > 0 ? child.ttl - 1 : originalTtl;
+        auto found = walked.find(parent);
+        if (found == walked.end()) {
+            push(parent, ttl, originalTtl);
+            return true;
+        }
+        Walked& queued = found->second;
+        if (queued.popped || queued.common) {
+            return false;
+        }
+        // Reached along two lines of history; the shorter skip wins
+        if (ttl < queued.ttl) {
+            queued.ttl = ttl;
+            queued.originalTtl = originalTtl;
+        }
+        return true;
+    }
+    
+    std::unordered_map<std::string, Walked> walked;
+    std::priority_queue<std::pair<int64_t, std::string>> queue;
+};
+
+// The have/ack exchange of one fetch, a round at a time. Rounds double in
+// size up to largeRound haves and then grow by a tenth; every round repeats
+// the commits already found common, since each request is stateless. Once
+// something is common, maxInVain haves in a row without a new acknowledgment
+// end the negotiation, as in git.
+class FetchNegotiation {
+public:
+    explicit FetchNegotiation(const std::vector<std::string>& tips) {
+        if (!tips.empty()) {
+            negotiator.emplace(tips);
+        }
+    }
+    
+    // Haves for the next round, or false when it is time for done
+    bool nextRound(std::vector<std::string>& haves) {
+        if (!negotiator || (!commonCommits.empty() && inVain >= maxInVain)) {
+            return false;
+        }
+        haves = commonCommits;
+        std::string have;
+        while (haves.size() < commonCommits.size() + roundSize && !(have = negotiator->next()).empty()) {
+            haves.push_back(have);
+        }
+        lastFresh = haves.size() - commonCommits.size();
+        if (lastFresh == 0) {
+            return false;
+        }
+        offered += lastFresh;
+        rounds++;
+        roundSize = roundSize < largeRound ? roundSize * 2 : roundSize * 11 / 10;
+        return true;
+    }
+    
+    // Acknowledgments in the response to the last round
+    void acknowledged(const std::vector<std::string>& acks) {
+        bool found = false;
+        for (const auto& ack : acks) {
+            if (negotiator && negotiator->acknowledge(ack)) {
+                commonCommits.push_back(ack);
+                found = true;
+            }
+        }
+        inVain = found ? 0 : inVain + lastFresh;
+    }
+    
+    const std::vector<std::string>& common() const { return commonCommits; }
+    
+    void report() const {
+        if (rounds > 0) {
+            std::cerr << "Negotiated in " << rounds << " rounds (" << offered << " haves, "
+                      << commonCommits.size() << " common)" << std::endl;
+        }
+    }
+    
+private:
+    static constexpr size_t initialRound = 16;
+    static constexpr size_t largeRound = 16384;
+    static constexpr size_t maxInVain = 256;
+    
+    std::optional<SkippingNegotiator> negotiator;
+    std::vector<std::string> commonCommits;
+    size_t roundSize = initialRound;
+    size_t lastFresh = 0;
+    size_t inVain = 0;
+    size_t rounds = 0;
+    size_t offered = 0;
+};
+
+// Client for git's smart HTTP protocol version 2. connect() reads the
+// capability advertisement; every command is then one stateless POST to
+// git-upload-pack. Requests are built and responses parsed by separate
+// members, so that a driver with its own transport can reuse them.
+class ProtocolV2Client {
+public:
+    explicit ProtocolV2Client(const std::string& url) : url(url), session(HTTPSession::shared()) {
+        while (this->url.length() > 1 && this->url.back() == '/') {
+            this->url.pop_back();
+        }
+    }
+    
+    void connect() {
+        readAdvertisement(makeHTTPRequest(advertisementUrl(), "GET", "", {"Git-Protocol: version=2"}));
+    }
+    
+    std::string advertisementUrl() const {
+        return url + "/info/refs?service=git-upload-pack";
+    }
+    
+    // Take the capabilities from the response to advertisementUrl(). A server
+    // whose upload-pack fails can still answer 200 with an empty or garbled
+    // body, which is reported as such rather than as a protocol mismatch.
+    void readAdvertisement(const HTTPResponse& response) {
+        if (response.status_code != 200) {
+            throw std::runtime_error("Failed to get info/refs: HTTP " + std::to_string(response.status_code));
+        }
+        const std::string& body = response.body;
+        if (body.length() < 4 || !std::all_of(body.begin(), body.begin() + 4, ::isxdigit)) {
+            std::string start = body.substr(0, body.find('\n')).substr(0, 80);
+            throw std::runtime_error(body.empty() ? "Empty ref advertisement from " + advertisementUrl()
+                                                  : "Invalid ref advertisement from " + advertisementUrl() + ": " + start);
+        }
+        
+        PktLineReader reader(body);
+        PktType type;
+        std::string_view line;
+        bool versionSeen = false;
+        bool anyLine = false;
+        while (reader.next(type, line)) {
+            if (type != PktType::Data) {
+                if (versionSeen && type == PktType::Flush) {
+                    break;
+                }
+                continue;
+            }
+            line = trimNewline(line);
+            if (line.substr(0, 2) == "# ") {
+                continue;
+            }
+            anyLine = true;
+            if (!versionSeen) {
+                if (line != "version 2") {
+                    throw std::runtime_error("Remote does not speak protocol version 2");
+                }
+                versionSeen = true;
+                continue;
+            }
+            size_t equals = line.find('=');
+            capabilities[std::string(line.substr(0, equals))] =
+                equals == std::string_view::npos ? "" : std::string(line.substr(equals + 1));
+        }
+        if (!anyLine) {
+            throw std::runtime_error("Empty ref advertisement from " + advertisementUrl());
+        }
+        if (!versionSeen) {
+            throw std::runtime_error("Remote does not speak protocol version 2");
+        }
+        
+        std::string format;
+        if (hasCapability("object-format", &format) && format != "sha1") {
+            throw std::runtime_error("Unsupported object format: " + format);
+        }
+    }
+    
+    const HTTPSession& transport() const { return *session; }
+    
+    // Whether the server advertised a capability; value receives its
+    // argument, as in fetch=shallow filter
+    bool hasCapability(const std::string& name, std::string* value = nullptr) const {
+        auto it = capabilities.find(name);
+        if (it == capabilities.end()) {
+            return false;
+        }
+        if (value) {
+            *value = it->second;
+        }
+        return true;
+    }
+    
+    // Whether a command capability lists a feature, such as ("fetch", "shallow")
+    bool hasFeature(const std::string& command, const std::string& feature) const {
+        std::string features;
+        if (!hasCapability(command, &features)) {
+            return false;
+        }
+        std::istringstream words(features);
+        std::string word;
+        while (words >> word) {
+            if (word == feature) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Refs whose names start with one of prefixes, with symref targets and
+    // peeled tags. The server filters, so only the matching refs are sent.
+    std::vector<RemoteRef> lsRefs(const std::vector<std::string>& prefixes) {
+        return parseRefs(command("ls-refs", lsRefsArguments(prefixes)));
+    }
+    
+    std::vector<std::string> lsRefsArguments(const std::vector<std::string>& prefixes) const {
+        std::vector<std::string> arguments = {"peel", "symrefs"};
+        if (hasFeature("ls-refs", "unborn")) {
+            arguments.push_back("unborn");
+        }
+        for (const auto& prefix : prefixes) {
+            arguments.push_back("ref-prefix " + prefix);
+        }
+        return arguments;
+    }
+    
+    static std::vector<RemoteRef> parseRefs(const std::string& response) {
+        std::vector<RemoteRef> refs;
+        PktLineReader reader(response);
+        PktType type;
+        std::string_view line;
+        while (reader.next(type, line) && type == PktType::Data) {
+            std::istringstream fields{std::string(trimNewline(line))};
+            RemoteRef ref;
+            std::string hash;
+            fields >> hash >> ref.name;
+            if (hash != "unborn") {
+                ref.hash = hash;
+            }
+            std::string attribute;
+            while (fields >> attribute) {
+                if (attribute.rfind("symref-target:", 0) == 0) {
+                    ref.symrefTarget = attribute.substr(14);
+                } else if (attribute.rfind("peeled:", 0) == 0) {
+                    ref.peeled = attribute.substr(7);
+                }
+            }
+            if (acceptRemoteRef(ref)) {
+                refs.push_back(ref);
+            }
+        }
+        return refs;
+    }
+    
+    // Fetch a pack containing the wants and everything they reach that the
+    // server cannot tell we have. Local history below the haves is offered
+    // in rounds of a FetchNegotiation until the server is ready to send the
+    // pack or nothing worth offering is left; a final request then ends with
+    // done. The pack data is streamed into receiver as it arrives. A deepen
+    // request limits history and returns the new shallow boundary.
+    ShallowUpdate fetch(const FetchRequest& request, PackReceiver& receiver) {
+        std::vector<std::string> arguments = fetchArguments(request);
+        auto round = [&](const std::vector<std::string>& haves, bool done) {
+            FetchResponseDemuxer demuxer([&](const char* data, size_t length) {
+                receiver.write(data, length);
+            });
+            command("fetch", roundArguments(arguments, haves, done), [&](const char* data, size_t length) {
+                demuxer.feed(data, length);
+            });
+            demuxer.finish();
+            return demuxer;
+        };
+        
+        FetchNegotiation negotiation(request.haves);
+        std::optional<FetchResponseDemuxer> ready;
+        std::vector<std::string> haves;
+        while (negotiation.nextRound(haves)) {
+            FetchResponseDemuxer response = round(haves, false);
+            negotiation.acknowledged(response.acknowledged());
+            if (response.hasPackfile()) {
+                ready = std::move(response);
+                break;
+            }
+        }
+        negotiation.report();
+        
+        if (!ready) {
+            ready = round(negotiation.common(), true);
+            if (!ready->hasPackfile()) {
+                throw std::runtime_error("Fetch response has no packfile section");
+            }
+        }
+        return ready->shallowInfo();
+    }
+    
+    // Arguments of every fetch round except the haves and done
+    std::vector<std::string> fetchArguments(const FetchRequest& request) const {
+        const DeepenRequest& deepen = request.deepen;
+        std::vector<std::string> arguments = {"ofs-delta", "include-tag"};
+        if (request.thinPack) {
+            arguments.push_back("thin-pack");
+        }
+        if (request.noProgress) {
+            arguments.push_back("no-progress");
+        }
+        for (const auto& want : request.wants) {
+            arguments.push_back("want " + want);
+        }
+        if (!request.filter.empty()) {
+            if (!hasFeature("fetch", "filter")) {
+                throw std::runtime_error("Server does not support filtering");
+            }
+            arguments.push_back("filter " + request.filter);
+        }
+        if (deepen.depth > 0 || deepen.since > 0 || !request.shallow.empty()) {
+            if (!hasFeature("fetch", "shallow")) {
+                throw std::runtime_error("Server does not support shallow fetches");
+            }
+            for (const auto& commit : request.shallow) {
+                arguments.push_back("shallow " + commit);
+            }
+            if (deepen.depth > 0) {
+                arguments.push_back("deepen " + std::to_string(deepen.depth));
+                if (deepen.relative) {
+                    arguments.push_back("deepen-relative");
+                }
+            }
+            if (deepen.since > 0) {
+                arguments.push_back("deepen-since " + std::to_string(deepen.since));
+            }
+        }
+        return arguments;
+    }
+    
+    static std::vector<std::string> roundArguments(std::vector<std::string> arguments,
+                                                   const std::vector<std::string>& haves, bool done) {
+        for (const auto& have : haves) {
+            arguments.push_back("have " + have);
+        }
+        if (done) {
+            arguments.push_back("done");
+        }
+        return arguments;
+    }
+    
+    std::string commandUrl() const {
+        return url + "/git-upload-pack";
+    }
+    
+    std::string commandBody(const std::string& name, const std::vector<std::string>& arguments) const {
+        std::string body = pktLine("command=" + name + "\n");
+        if (hasCapability("agent")) {
+            body += pktLine("agent=" + clientAgent + "\n");
+        }
+        if (hasCapability("object-format")) {
+            body += pktLine("object-format=sha1\n");
+        }
+        body += pktDelim;
+        for (const auto& argument : arguments) {
+            body += pktLine(argument + "\n");
+        }
+        body += pktFlush;
+        return body;
+    }
+    
+    static std::vector<std::string> commandHeaders() {
+        return {
+            "Content-Type: application/x-git-upload-pack-request",
+            "Accept: application/x-git-upload-pack-result",
+            "Git-Protocol: version=2"
+        };
+    }
+    
+private:
+    // POST a command; the response is returned, or streamed to onData when given
+    std::string command(const std::string& name, const std::vector<std::string>& arguments,
+                        const std::function<void(const char*, size_t)>& onData = nullptr) {
+        std::string body = commandBody(name, arguments);
+        HTTPResponse response = onData ? makeStreamingHTTPRequest(commandUrl(), "POST", body, commandHeaders(), onData)
+                                       : makeHTTPRequest(commandUrl(), "POST", body, commandHeaders());
+        if (response.status_code != 200) {
+            throw std::runtime_error(name + " failed: HTTP " + std::to_string(response.status_code));
+        }
+        return response.body;
+    }
+    
+    static inline const std::string clientAgent = "git/2.0.0";
+    
+    std::string url;
+    // Held for the client's lifetime so all its requests share the connection
+    std::shared_ptr<HTTPSession> session;
+    std::map<std::string, std::string> capabilities;
+};
+
+// Objects that promisor packs refer to: the trees, blobs, parents and tag
+// targets named by objects received from the promisor remote. A missing
+// object in this set was omitted by the remote's filter and can be fetched;
+// one outside it is genuinely missing.
+class PromisedObjects {
+public:
+    bool contains(const std::string& hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!loaded) {
+            load();
+            loaded = true;
+        }
+        return promised.count(hash) > 0;
+    }
+    
+    // Forget the set after new promisor packs arrive
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        loaded = false;
+        promised.clear();
+    }
+    
+private:
+    void load() {
+        std::string packDir = ".git/objects/pack";
+        if (!std::filesystem::is_directory(packDir)) {
+            return;
+        }
+        for (const auto& file : std::filesystem::directory_iterator(packDir)) {
+            if (file.path().extension() != ".promisor") {
+                continue;
+            }
+            std::filesystem::path idxPath = file.path();
+            idxPath.replace_extension(".idx");
+            if (!std::filesystem::exists(idxPath)) {
+                continue;
+            }
+            PackFile pack(idxPath.string());
+            for (uint32_t i = 0; i < pack.objectCount(); i++) {
+                uint64_t offset = pack.offsetAt(i);
+                int type = pack.typeAt(offset);
+                if (type == 3) {
+                    continue;
+                }
+                std::string content = pack.readObject(offset, type);
+                if (type == 1) {
+                    CommitInfo commit = parseCommitObject(content);
+                    promised.insert(commit.tree);
+                    promised.insert(commit.parents.begin(), commit.parents.end());
+                } else if (type == 2) {
+                    std::string objectData = "tree " + std::to_string(content.length()) + '\0' + content;
+                    for (const auto& entry : parseTreeObject(objectData)) {
+                        if (entry.mode != "160000") {
+                            promised.insert(entry.hash);
+                        }
+                    }
+                } else if (type == 4 && content.rfind("object ", 0) == 0) {
+                    promised.insert(content.substr(7, 40));
+                }
+            }
+        }
+    }
+    
+    std::mutex mutex;
+    bool loaded = false;
+    std::unordered_set<std::string> promised;
+};
+
+PromisedObjects& promisedObjects() {
+    static PromisedObjects objects;
+    return objects;
+}
+
+// Whether an object is here, omitted by a partial clone's filter but
+// available from the promisor remote, or missing altogether
+ObjectState objectState(const std::string& hash) {
+    if (objectExists(hash)) {
+        return ObjectState::Present;
+    }
+    if (!promisorRemote().empty() && promisedObjects().contains(hash)) {
+        return ObjectState::Promised;
+    }
+    return ObjectState::Missing;
+}
+
+// Mark a pack as received from the promisor remote, so objects it refers to
+// but does not contain count as promised
+void markPromisorPack(const std::string& checksum) {
+    std::ofstream marker(".git/objects/pack/pack-" + checksum + ".promisor");
+    marker.close();
+    promisedObjects().reset();
+}
+
+// Fetch objects omitted from a partial clone in one request, however many
+// there are. Objects already present are skipped. Like git's lazy fetch the
+// request carries blob:none: wanted objects are always sent, but a promised
+// tree or commit does not drag in every blob below it. Concurrent callers are
+// serialised and do not fetch what another has just fetched.
+void fetchPromisedObjects(const std::vector<std::string>& hashes) {
+    static std::mutex fetchMutex;
+    std::lock_guard<std::mutex> lock(fetchMutex);
+    
+    std::string remote = promisorRemote();
+    if (remote.empty()) {
+        return;
+    }
+    std::vector<std::string> wants;
+    std::unordered_set<std::string> wanted;
+    for (const auto& hash : hashes) {
+        if (!objectExists(hash) && wanted.insert(hash).second) {
+            wants.push_back(hash);
+        }
+    }
+    if (wants.empty()) {
+        return;
+    }
+    
+    std::string url = readConfigValue("remote." + remote + ".url");
+    if (url.empty()) {
+        throw std::runtime_error("Promisor remote " + remote + " has no url");
+    }
+    std::cerr << "Fetching " << wants.size() << " promised object" << (wants.size() == 1 ? "" : "s")
+              << " from " << remote << std::endl;
+    
+    ProtocolV2Client client(url);
+    client.connect();
+    FetchRequest request;
+    request.wants = std::move(wants);
+    request.filter = "blob:none";
+    PackReceiver receiver;
+    client.fetch(request, receiver);
+    markPromisorPack(receiver.finish());
+}
+
+bool fetchPromisedObject(const std::string& hash) {
+    if (promisorRemote().empty() || !promisedObjects().contains(hash)) {
+        return false;
+    }
+    fetchPromisedObjects({hash});
+    if (!objectExists(hash)) {
+        throw std::runtime_error("Promised object " + hash + " could not be fetched from the promisor remote");
+    }
+    return true;
+}
+
+// Fetch every blob of a tree that a partial clone omitted, before a checkout
+// reads them one at a time
+void prefetchTreeBlobs(const std::string& treeHash) {
+    if (promisorRemote().empty()) {
+        return;
+    }
+    std::vector<std::string> missing;
+    std::vector<std::string> trees = {treeHash};
+    while (!trees.empty()) {
+        std::string tree = trees.back();
+        trees.pop_back();
+        for (const auto& entry : readTreeEntries(tree)) {
+            if (entry.mode == "40000") {
+                trees.push_back(entry.hash);
+            } else if (entry.mode != "160000" && !objectExists(entry.hash)) {
+                missing.push_back(entry.hash);
+            }
+        }
+    }
+    fetchPromisedObjects(missing);
+}
+
+// Whether a tree entry name is safe to create in a working tree, as git's
+// verify_path decides: not empty, "." or "..", no '/' or NUL, and not .git
+// in any case, so a tree cannot write outside the worktree or into .git
+bool isSafeTreeEntryName(const std::string& name) {
+    if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos ||
+        name.find('\0') != std::string::npos) {
+        return false;
+    }
+    std::string lower = name;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+    return lower != ".git";
+}
+
+// Write one blob of a checkout to path
+void checkoutBlob(const TreeEntry& entry, const std::filesystem::path& path) {
+    int type = 0;
+    std::string content = readObjectContent(entry.hash, type);
+    if (entry.mode == "120000") {
+        std::filesystem::create_symlink(content, path);
+        return;
+    }
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Failed to create file: " + path.string());
+    }
+    file.write(content.data(), content.length());
+    file.close();
+    if (entry.mode == "100755") {
+        std::filesystem::permissions(path, std::filesystem::perms::owner_exec | std::filesystem::perms::group_exec |
+                                     std::filesystem::perms::others_exec, std::filesystem::perm_options::add);
+    }
+}
+
+// Trees are walked and directories created on the calling thread; every blob
+// is then read and written by a pool task, so checkout proceeds at the speed
+// of all cores rather than one.
+void queueCheckout(const std::string& treeHash, const std::filesystem::path& prefix, WorkStealingPool& pool,
+                   PipelineStage* stage) {
+    std::vector<TreeEntry> entries = readTreeEntries(treeHash);
+    // A name twice in one tree could make a symlink and a directory meet
+    std::unordered_set<std::string> names;
+    for (const auto& entry : entries) {
+        if (!isSafeTreeEntryName(entry.name) || !names.insert(entry.name).second) {
+            throw std::runtime_error("Refusing to check out invalid path '" + (prefix / entry.name).string() +
+                                     "' from tree " + treeHash);
+        }
+    }
+    for (auto& entry : entries) {
+        std::filesystem::path path = prefix / entry.name;
+        if (entry.mode == "40000") {
+            std::filesystem::create_directories(path);
+            queueCheckout(entry.hash, path, pool, stage);
+        } else if (entry.mode == "160000") {
+            // Submodules are left as empty directories
+            std::filesystem::create_directories(path);
+        } else {
+            pool.submit([entry = std::move(entry), path = std::move(path), stage] {
+                auto start = std::chrono::steady_clock::now();
+                checkoutBlob(entry, path);
+                if (stage) {
+                    std::error_code error;
+                    uintmax_t size = std::filesystem::is_symlink(path) ? 0 : std::filesystem::file_size(path, error);
+                    stage->record(1, error ? 0 : size, std::chrono::steady_clock::now() - start);
+                }
+            });
+        }
+    }
+}
+
+// Write the files of a tree into the working directory under prefix
+void checkoutTree(const std::string& treeHash, const std::filesystem::path& prefix, unsigned threads = 0,
+                  PipelineStage* stage = nullptr) {
+    prefetchTreeBlobs(treeHash);
+    WorkStealingPool pool(threads);
+    queueCheckout(treeHash, prefix, pool, stage);
+    pool.wait();
+}
+
+// Record the refs of a clone: remote branches and tags in packed-refs, the
+// remote's default branch as the local branch HEAD points at. A remote HEAD
+// that names a commit rather than a branch leaves HEAD detached there.
+// Returns the commit HEAD resolves to, or an empty string for an empty
+// repository.
+std::string writeClonedRefs(const std::vector<RemoteRef>& refs) {
+    std::string headTarget = "refs/heads/main";
+    std::string headHash;
+    bool detached = false;
+    std::map<std::string, std::string> lines;
+    for (const auto& ref : refs) {
+        if (ref.name == "HEAD") {
+            if (!ref.symrefTarget.empty()) {
+                // The target becomes a path under .git
+                if (!isValidRefName(ref.symrefTarget)) {
+                    throw std::runtime_error("Remote HEAD points at an invalid ref: " + ref.symrefTarget);
+                }
+                headTarget = ref.symrefTarget;
+            }
+            headHash = ref.hash;
+            detached = ref.symrefTarget.empty() && !ref.hash.empty();
+            continue;
+        }
+        if (ref.hash.empty()) {
+            continue;
+        }
+        std::string name = ref.name;
+        if (name.rfind("refs/heads/", 0) == 0) {
+            name = "refs/remotes/origin/" + name.substr(11);
+        }
+        lines[name] = ref.hash + " " + name + "\n" + (ref.peeled.empty() ? "" : "^" + ref.peeled + "\n");
+    }
+    
+    std::ofstream packed(".git/packed-refs");
+    packed << "# pack-refs with: peeled fully-peeled sorted \n";
+    for (const auto& line : lines) {
+        packed << line.second;
+    }
+    packed.close();
+    
+    std::ofstream head(".git/HEAD");
+    head << (detached ? headHash : "ref: " + headTarget) << "\n";
+    head.close();
+    
+    if (!headHash.empty() && !detached) {
+        std::filesystem::path branch = std::filesystem::path(".git") / headTarget;
+        std::filesystem::create_directories(branch.parent_path());
+        std::ofstream branchFile(branch);
+        branchFile << headHash << "\n";
+        branchFile.close();
+        
+        if (headTarget.rfind("refs/heads/", 0) == 0) {
+            std::filesystem::create_directories(".git/refs/remotes/origin");
+            std::ofstream remoteHead(".git/refs/remotes/origin/HEAD");
+            remoteHead << "ref: refs/remotes/origin/" << headTarget.substr(11) << "\n";
+            remoteHead.close();
+        }
+    }
+    return headHash;
+}
+
+struct CloneOptions {
+    uint64_t maxMemory = 0;     // bytes the pack pipeline and checkout may hold; 0 for no limit
+    DeepenRequest deepen;       // a depth or date makes a shallow, single-branch clone
+    std::string filter;         // partial clone filter; origin becomes a promisor remote
+    bool noHardlinks = false;   // a local clone copies object files rather than linking them
+    bool shared = false;        // a local clone borrows the source's objects through alternates
+    std::vector<std::string> references;    // repositories to borrow objects from
+};
+
+// Write the configuration of a fresh clone: origin at url, fetching every
+// branch or only singleBranch, and the branch HEAD points at, if any,
+// tracking it
+void writeCloneConfig(const std::string& url, const std::string& singleBranch, const std::string& filter) {
+    std::string branch;
+    std::ifstream head(".git/HEAD");
+    std::string headLine;
+    if (std::getline(head, headLine) && headLine.rfind("ref: refs/heads/", 0) == 0) {
+        branch = headLine.substr(16);
+    }
+    head.close();
+    
+    // A partial clone needs repository format 1 so that tools which do not
+    // understand missing promised objects refuse to touch it
+    bool partial = !filter.empty();
+    std::ofstream config(".git/config");
+    config << "[core]\n"
+           << "\trepositoryformatversion = " << (partial ? 1 : 0) << "\n"
+           << "\tfilemode = true\n"
+           << "\tbare = false\n";
+    if (partial) {
+        config << "[extensions]\n"
+               << "\tpartialClone = origin\n";
+    }
+    config << "[remote \"origin\"]\n"
+           << "\turl = " << url << "\n"
+           << "\tfetch = " << (singleBranch.empty() ? "+refs/heads/*:refs/remotes/origin/*"
+                                                  : "+" + singleBranch + ":refs/remotes/origin/" + singleBranch.substr(11)) << "\n";
+    if (partial) {
+        config << "\tpromisor = true\n"
+               << "\tpartialclonefilter = " << filter << "\n";
+    }
+    if (!branch.empty()) {
+        config << "[branch \"" << branch << "\"]\n"
+               << "\tremote = origin\n"
+               << "\tmerge = refs/heads/" << branch << "\n";
+    }
+    config.close();
+}
+
+// Each checkout worker holds a blob or two, so a memory limit also limits how
+// many run at once
+unsigned cloneCheckoutThreads(const CloneOptions& options) {
+    if (!options.maxMemory) {
+        return 0;
+    }
+    uint64_t perThread = 64 << 20;
+    return static_cast<unsigned>(std::clamp<uint64_t>(options.maxMemory / perThread, 1,
+                                                      std::max(1u, std::thread::hardware_concurrency())));
+}
+
+// Initialise the repository in the current directory from the remote at url,
+// check out its default branch and configure it as origin
+void fetchIntoNewRepository(const std::string& url, const CloneOptions& options) {
+    std::filesystem::create_directories(".git/objects/pack");
+    std::filesystem::create_directories(".git/objects/info");
+    std::filesystem::create_directories(".git/refs/heads");
+    std::filesystem::create_directories(".git/refs/tags");
+    
+    ProtocolV2Client client(url);
+    client.connect();
+    std::vector<RemoteRef> refs = client.lsRefs({"HEAD", "refs/heads/", "refs/tags/"});
+    std::cerr << "Found " << refs.size() << " refs" << std::endl;
+    
+    // A shallow clone only follows the default branch, as git clone --depth
+    // does; tags come along only when they point into what was fetched
+    bool shallow = options.deepen.depth > 0 || options.deepen.since > 0;
+    std::string singleBranch;
+    if (shallow) {
+        std::vector<RemoteRef> kept;
+        for (const auto& ref : refs) {
+            if (ref.name == "HEAD") {
+                singleBranch = ref.symrefTarget;
+            }
+        }
+        for (const auto& ref : refs) {
+            if (ref.name == "HEAD" || ref.name == singleBranch || ref.name.rfind("refs/tags/", 0) == 0) {
+                kept.push_back(ref);
+            }
+        }
+        refs = std::move(kept);
+    }
+    
+    // With a reference repository, whatever it already has is not wanted,
+    // and its refs are offered so the pack only carries what it lacks
+    std::vector<std::string> wants;
+    std::unordered_set<std::string> wanted;
+    for (const auto& ref : refs) {
+        if (!ref.hash.empty() && (!shallow || ref.name.rfind("refs/tags/", 0) != 0) &&
+            (shallow || !objectExists(ref.hash)) && wanted.insert(ref.hash).second) {
+            wants.push_back(ref.hash);
+        }
+    }
+    
+    // Receive, scan and hash run concurrently while the pack downloads;
+    // delta resolution, index writing and checkout each fan out over a pool
+    auto started = std::chrono::steady_clock::now();
+    std::vector<const PipelineStage*> stages;
+    std::optional<PackReceiver> receiver;
+    if (!wants.empty()) {
+        receiver.emplace(0, options.maxMemory);
+        FetchRequest request;
+        request.wants = wants;
+        request.deepen = options.deepen;
+        request.filter = options.filter;
+        if (!shallow) {
+            request.haves = alternateRefTips();
+            request.thinPack = !request.haves.empty() && options.filter.empty();
+        }
+        ShallowUpdate update = client.fetch(request, *receiver);
+        std::string checksum = receiver->finish();
+        if (!options.filter.empty()) {
+            markPromisorPack(checksum);
+        }
+        stages = receiver->stages();
+        writeShallowFile({update.shallow.begin(), update.shallow.end()});
+    }
+    if (shallow) {
+        std::erase_if(refs, [](const RemoteRef& ref) {
+            return ref.name.rfind("refs/tags/", 0) == 0 && !objectExists(ref.hash);
+        });
+    }
+    
+    std::string headHash = writeClonedRefs(refs);
+    writeCloneConfig(url, singleBranch, options.filter);
+    
+    PipelineStage checkoutStage("checkout");
+    if (!headHash.empty()) {
+        checkoutTree(loadCommit(headHash).tree, ".", cloneCheckoutThreads(options), &checkoutStage);
+        stages.push_back(&checkoutStage);
+        std::cerr << "Clone pipeline:" << std::endl;
+        reportPipeline(stages, std::chrono::steady_clock::now() - started);
+        reportTransport(client.transport().requestCount(), client.transport().connectionCount());
+    } else {
+        std::cerr << "warning: You appear to have cloned an empty repository." << std::endl;
+    }
+}
+
+// The .git directory of the repository a clone url names when it is a local
+// path or file:// url, or nullopt for a url some transport has to fetch
+std::optional<std::filesystem::path> localRepositoryPath(const std::string& url) {
+    std::string path = url;
+    if (url.rfind("file://", 0) == 0) {
+        path = url.substr(7);
+    } else if (url.find("://") != std::string::npos) {
+        return std::nullopt;
+    }
+    std::filesystem::path source = std::filesystem::absolute(path).lexically_normal();
+    if (std::filesystem::is_directory(source / ".git")) {
+        return source / ".git";
+    }
+    if (std::filesystem::is_directory(source / "objects") && std::filesystem::exists(source / "HEAD")) {
+        return source;
+    }
+    throw std::runtime_error("'" + path + "' does not appear to be a git repository");
+}
+
+enum class FileLink { Hardlink, Reflink, Copy };
+
+// Create to with the contents of from, as cheaply as the filesystems allow: a hard
+// link shares the inode, a reflink shares the extents copy-on-write, and only
+// across filesystems that support neither are the bytes copied.
+// copy_file_range lets the kernel reflink or copy server-side where it can.
+FileLink linkOrCopyFile(const std::filesystem::path& from, const std::filesystem::path& to, bool hardlink) {
+    if (hardlink && ::link(from.c_str(), to.c_str()) == 0) {
+        return FileLink::Hardlink;
+    }
+    int in = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        throw std::runtime_error("Failed to open file: " + from.string());
+    }
+    struct stat st;
+    if (::fstat(in, &st) != 0) {
+        ::close(in);
+        throw std::runtime_error("Failed to stat file: " + from.string());
+    }
+    int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 0777);
+    if (out < 0) {
+        ::close(in);
+        throw std::runtime_error("Failed to create file: " + to.string());
+    }
+    
+    FileLink result = FileLink::Copy;
+    bool done = false;
+#ifdef FICLONE
+    if (::ioctl(out, FICLONE, in) == 0) {
+        result = FileLink::Reflink;
+        done = true;
+    }
+#endif
+    off_t copied = 0;
+    while (!done && copied < st.st_size) {
+        ssize_t n = ::copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(st.st_size - copied), 0);
+        if (n <= 0) {
+            break;
+        }
+        copied += n;
+    }
+    // Older kernels refuse copy_file_range across filesystems and some
+    // filesystems not at all; read and write whatever is left
+    std::vector<char> buffer(1 << 16);
+    while (!done && copied < st.st_size) {
+        ssize_t n = ::pread(in, buffer.data(), buffer.size(), copied);
+        if (n <= 0 || ::write(out, buffer.data(), static_cast<size_t>(n)) != n) {
+            ::close(in);
+            ::close(out);
+            throw std::runtime_error("Failed to copy " + from.string() + " to " + to.string());
+        }
+        copied += n;
+    }
+    ::close(in);
+    if (::close(out) != 0) {
+        throw std::runtime_error("Failed to write file: " + to.string());
+    }
+    return result;
+}
+
+// Whether the repository at gitDir is a partial clone, going by its
+// promisor packs
+bool isPartialRepository(const std::filesystem::path& gitDir) {
+    std::filesystem::path packDir = gitDir / "objects" / "pack";
+    if (!std::filesystem::is_directory(packDir)) {
+        return false;
+    }
+    for (const auto& entry : std::filesystem::directory_iterator(packDir)) {
+        if (entry.path().extension() == ".promisor") {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Object directory of a --reference repository. Objects it seems to have
+// must really be there with all their history, so shallow and partial
+// repositories cannot serve.
+std::filesystem::path referenceObjectDir(const std::string& repository) {
+    std::optional<std::filesystem::path> gitDir = localRepositoryPath(repository);
+    if (!gitDir) {
+        throw std::runtime_error("reference repository '" + repository + "' is not a local repository");
+    }
+    if (std::filesystem::exists(*gitDir / "shallow")) {
+        throw std::runtime_error("reference repository '" + repository + "' is shallow");
+    }
+    if (isPartialRepository(*gitDir)) {
+        throw std::runtime_error("reference repository '" + repository + "' is a partial clone");
+    }
+    return *gitDir / "objects";
+}
+
+// Link the object files under objects that are not here yet into
+// .git/objects, reporting how each one was brought over. Object files are
+// never modified in place, so sharing them with the source is safe;
+// temporaries of an unfinished fetch or repack are skipped, and so are
+// alternates, which cloneRepository carries over itself. objectsOnly limits
+// it to loose objects and packs, leaving out indexes such as the
+// multi-pack-index and commit-graph that describe the source's whole store.
+void linkObjectFiles(const std::filesystem::path& objects, bool hardlink, bool objectsOnly) {
+    auto started = std::chrono::steady_clock::now();
+    std::array<size_t, 3> counts = {0, 0, 0};
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(objects)) {
+        std::filesystem::path relative = std::filesystem::relative(entry.path(), objects);
+        std::filesystem::path target = std::filesystem::path(".git/objects") / relative;
+        if (entry.is_directory()) {
+            std::filesystem::create_directories(target);
+            continue;
+        }
+        std::string name = entry.path().filename().string();
+        std::string top = relative.begin()->string();
+        if (!entry.is_regular_file() || name.rfind("tmp_", 0) == 0 || entry.path().extension() == ".lock" ||
+            relative == std::filesystem::path("info/alternates") || std::filesystem::exists(target)) {
+            continue;
+        }
+        if (objectsOnly && (top == "info" || name.rfind("multi-pack-index", 0) == 0)) {
+            continue;
+        }
+        counts[static_cast<size_t>(linkOrCopyFile(entry.path(), target, hardlink))]++;
+    }
+    std::cerr << "Linked " << counts[0] << " object files, reflinked " << counts[1] << ", copied " << counts[2]
+              << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count()
+              << " ms" << std::endl;
+}
+
+// HEAD, branches and tags of the local repository at gitDir, as a remote
+// would advertise them. HEAD follows the source's HEAD, whether it names a
+// branch or a commit; tags are not peeled, since their objects may not be
+// here yet.
+std::vector<RemoteRef> readLocalRefs(const std::filesystem::path& gitDir) {
+    std::vector<RemoteRef> refs;
+    std::map<std::string, std::string> sourceRefs;
+    for (const auto& [name, hash] : listRefs(gitDir)) {
+        if (name.rfind("refs/heads/", 0) == 0 || name.rfind("refs/tags/", 0) == 0) {
+            sourceRefs[name] = hash;
+        }
+    }
+    RemoteRef head;
+    head.name = "HEAD";
+    std::ifstream headFile(gitDir / "HEAD");
+    std::string headLine;
+    std::getline(headFile, headLine);
+    if (headLine.rfind("ref: ", 0) == 0) {
+        head.symrefTarget = headLine.substr(5);
+        auto found = sourceRefs.find(head.symrefTarget);
+        head.hash = found == sourceRefs.end() ? "" : found->second;
+    } else {
+        head.hash = headLine.substr(0, 40);
+    }
+    refs.push_back(head);
+    if (!acceptRemoteRef(head)) {
+        refs.pop_back();
+    }
+    for (const auto& [name, hash] : sourceRefs) {
+        RemoteRef ref;
+        ref.name = name;
+        ref.hash = hash;
+        if (acceptRemoteRef(ref)) {
+            refs.push_back(ref);
+        }
+    }
+    return refs;
+}
+
+// Initialise the repository in the current directory from the local
+// repository at gitDir: its object files are linked rather than sent through
+// a protocol, then its branches and tags become origin's
+void cloneLocalRepository(const std::string& url, const std::filesystem::path& gitDir, const CloneOptions& options) {
+    if (options.deepen.depth > 0 || options.deepen.since > 0) {
+        std::cerr << "warning: --depth and --shallow-since are ignored in local clones" << std::endl;
+    }
+    if (!options.filter.empty()) {
+        std::cerr << "warning: --filter is ignored in local clones" << std::endl;
+    }
+    std::filesystem::path objects = gitDir / "objects";
+    if (isPartialRepository(gitDir)) {
+        // Its missing objects could only come from its own promisor remote
+        throw std::runtime_error("Cannot clone the partial clone at " + gitDir.string() + " locally");
+    }
+    
+    std::filesystem::create_directories(".git/objects/pack");
+    std::filesystem::create_directories(".git/objects/info");
+    std::filesystem::create_directories(".git/refs/heads");
+    std::filesystem::create_directories(".git/refs/tags");
+    
+    // A shared clone links nothing and reads the source's objects through
+    // the alternates cloneRepository wrote
+    if (!options.shared) {
+        linkObjectFiles(objects, !options.noHardlinks, false);
+    }
+    // The shallow file is rewritten as history deepens, so it is copied
+    if (std::filesystem::exists(gitDir / "shallow")) {
+        std::filesystem::copy_file(gitDir / "shallow", ".git/shallow");
+    }
+    
+    std::vector<RemoteRef> refs = readLocalRefs(gitDir);
+    for (auto& ref : refs) {
+        int type = 0;
+        std::string content = ref.hash.empty() || ref.name == "HEAD" ? "" : readObjectContent(ref.hash, type);
+        while (type == 4 && content.rfind("object ", 0) == 0) {
+            ref.peeled = content.substr(7, 40);
+            content = readObjectContent(ref.peeled, type);
+        }
+    }
+    std::cerr << "Found " << refs.size() << " refs" << std::endl;
+    
+    std::string headHash = writeClonedRefs(refs);
+    writeCloneConfig(url, "", "");
+    
+    if (!headHash.empty()) {
+        checkoutTree(loadCommit(headHash).tree, ".", cloneCheckoutThreads(options));
+    } else {
+        std::cerr << "warning: You appear to have cloned an empty repository." << std::endl;
+    }
+}
+
+void cloneRepository(const std::string& url, const std::string& targetDir, const CloneOptions& options) {
+    if (std::filesystem::exists(targetDir) && !std::filesystem::is_empty(targetDir)) {
+        throw std::runtime_error("Destination path '" + targetDir + "' already exists and is not empty");
+    }
+    // Resolved before moving into the new directory, so a relative path
+    // still names the source
+    std::optional<std::filesystem::path> localSource = localRepositoryPath(url);
+    std::string originUrl = url;
+    if (localSource && url.rfind("file://", 0) != 0) {
+        originUrl = std::filesystem::absolute(url).lexically_normal().string();
+        if (originUrl.size() > 1 && originUrl.back() == '/') {
+            originUrl.pop_back();
+        }
+    }
+    // Reference repositories and, for a shared clone, the source become
+    // alternates. A local clone that links objects carries the source's own
+    // alternates over, since linked objects may depend on them.
+    std::vector<std::filesystem::path> alternates;
+    for (const auto& reference : options.references) {
+        alternates.push_back(referenceObjectDir(reference));
+    }
+    if (options.shared && !localSource) {
+        throw std::runtime_error("--shared needs a local repository to clone");
+    }
+    if (localSource) {
+        std::vector<std::filesystem::path> carried = options.shared ? std::vector<std::filesystem::path>{*localSource / "objects"}
+                                                                    : readAlternatesFile(*localSource / "objects");
+        alternates.insert(alternates.end(), carried.begin(), carried.end());
+    }
+    bool created = std::filesystem::create_directories(targetDir);
+    std::string originalDir = std::filesystem::current_path().string();
+    std::filesystem::current_path(targetDir);
+    
+    try {
+        if (!alternates.empty()) {
+            writeAlternates(alternates);
+        }
+        if (localSource) {
+            cloneLocalRepository(originUrl, *localSource, options);
+        } else {
+            fetchIntoNewRepository(url, options);
+        }
+    } catch (...) {
+        // Leave nothing half-cloned behind
+        std::filesystem::current_path(originalDir);
+        for (const auto& entry : std::filesystem::directory_iterator(targetDir)) {
+            std::filesystem::remove_all(entry.path());
+        }
+        if (created) {
+            std::filesystem::remove(targetDir);
+        }
+        throw;
+    }
+    
+    std::filesystem::current_path(originalDir);
+    std::cout << "Cloned " << url << " into " << targetDir << std::endl;
+}
+
+// Local name a refspec such as "+refs/heads/*:refs/remotes/origin/*" maps a
+// remote ref to, or an empty string when it does not match
+std::string mapRefspec(const std::string& refspec, const std::string& remoteName) {
+    std::string spec = refspec[0] == '+' ? refspec.substr(1) : refspec;
+    size_t colon = spec.find(':');
+    if (colon == std::string::npos) {
+        return "";
+    }
+    std::string source = spec.substr(0, colon);
+    std::string destination = spec.substr(colon + 1);
+    if (!source.empty() && source.back() == '*') {
+        source.pop_back();
+        if (remoteName.rfind(source, 0) != 0 || destination.empty() || destination.back() != '*') {
+            return "";
+        }
+        destination.pop_back();
+        return destination + remoteName.substr(source.length());
+    }
+    return remoteName == source ? destination : "";
+}
+
+struct FetchOptions {
+    DeepenRequest deepen;       // move the shallow boundary; relative for --deepen
+};
+
+// One fetch from origin into the current repository: the remote and the
+// local state it starts from, then what the remote's refs call for
+struct OriginFetch {
+    FetchOptions options;
+    std::string url;
+    std::string refspec;
+    std::string promisor;       // "origin" in a partial clone of it
+    std::unordered_set<std::string> shallow;
+    std::map<std::string, std::string> localRefs;
+    
+    std::vector<RemoteRef> refs;
+    // (local name, remote hash) of every ref the refspec selects
+    std::vector<std::pair<std::string, std::string>> updates;
+    std::vector<std::string> wants;
+};
+
+const std::vector<std::string> originRefPrefixes = {"refs/heads/", "refs/tags/"};
+
+OriginFetch prepareOriginFetch(const FetchOptions& options) {
+    OriginFetch fetch;
+    fetch.options = options;
+    fetch.url = readConfigValue("remote.origin.url");
+    if (fetch.url.empty()) {
+        throw std::runtime_error("No remote named origin");
+    }
+    fetch.refspec = readConfigValue("remote.origin.fetch");
+    if (fetch.refspec.empty()) {
+        fetch.refspec = "+refs/heads/*:refs/remotes/origin/*";
+    }
+    fetch.promisor = promisorRemote();
+    fetch.shallow = shallowCommits();
+    if (options.deepen.relative && fetch.shallow.empty()) {
+        throw std::runtime_error("--deepen on a repository that is not shallow");
+    }
+    for (const auto& ref : listRefs()) {
+        fetch.localRefs[ref.first] = ref.second;
     }
+    return fetch;
+}
+
+// Pick the refs to update and the objects to want from the remote's refs. A
+// deepen wants them even when they are already here, to extend their history.
+void planOriginFetch(OriginFetch& fetch, std::vector<RemoteRef> refs) {
+    bool deepening = fetch.options.deepen.depth > 0 || fetch.options.deepen.since > 0;
+    std::unordered_set<std::string> wanted;
+    for (const auto& ref : refs) {
+        std::string localName = mapRefspec(fetch.refspec, ref.name);
+        if (localName.empty() || ref.hash.empty()) {
+            continue;
+        }
+        fetch.updates.emplace_back(localName, ref.hash);
+        if ((deepening || !objectExists(ref.hash)) && wanted.insert(ref.hash).second) {
+            fetch.wants.push_back(ref.hash);
+        }
+    }
+    fetch.refs = std::move(refs);
+}
+
+FetchRequest originFetchRequest(const OriginFetch& fetch) {
+    FetchRequest request;
+    request.wants = fetch.wants;
+    std::unordered_set<std::string> offered;
+    for (const auto& ref : fetch.localRefs) {
+        if (objectExists(ref.second) && offered.insert(ref.second).second) {
+            request.haves.push_back(ref.second);
+        }
+    }
+    for (const auto& tip : alternateRefTips()) {
+        if (offered.insert(tip).second) {
+            request.haves.push_back(tip);
+        }
+    }
+    request.deepen = fetch.options.deepen;
+    request.shallow.assign(fetch.shallow.begin(), fetch.shallow.end());
+    // A partial clone keeps fetching with its filter, and what arrives is
+    // promisor data like the original clone
+    if (fetch.promisor == "origin") {
+        request.filter = readConfigValue("remote.origin.partialclonefilter");
+    } else {
+        // Completing a thin pack could need bases the filter left out
+        request.thinPack = true;
+    }
+    return request;
+}
+
+// Account for the pack a fetch stored and the shallow boundary it reported
+void recordFetchedPack(OriginFetch& fetch, const std::string& checksum, const ShallowUpdate& update) {
+    if (fetch.promisor == "origin") {
+        markPromisorPack(checksum);
+    }
+    bool deepening = fetch.options.deepen.depth > 0 || fetch.options.deepen.since > 0;
+    if (deepening || !fetch.shallow.empty()) {
+        for (const auto& commit : update.unshallow) {
+            fetch.shallow.erase(commit);
+        }
+        fetch.shallow.insert(update.shallow.begin(), update.shallow.end());
+        writeShallowFile(fetch.shallow);
+        commitGraph().reload();
+    }
+}
+
+// Move the refs. Tags follow automatically when what they point at is now
+// present.
+void applyOriginFetch(OriginFetch& fetch) {
+    for (const auto& ref : fetch.refs) {
+        if (ref.name.rfind("refs/tags/", 0) == 0 && !fetch.localRefs.count(ref.name) && !ref.hash.empty() &&
+            objectExists(ref.hash)) {
+            fetch.updates.emplace_back(ref.name, ref.hash);
+        }
+    }
+    
+    size_t changed = 0;
+    for (const auto& [name, hash] : fetch.updates) {
+        auto current = fetch.localRefs.find(name);
+        if (current != fetch.localRefs.end() && current->second == hash) {
+            continue;
+        }
+        updateRef(name, hash);
+        changed++;
+        if (current == fetch.localRefs.end()) {
+            std::cerr << " * [new ref]         " << name << std::endl;
+        } else {
+            std::cerr << "   " << current->second.substr(0, 7) << ".." << hash.substr(0, 7) << "  " << name << std::endl;
+        }
+    }
+    if (changed == 0 && fetch.wants.empty()) {
+        std::cerr << "Already up to date." << std::endl;
+    }
+}
+
+// Fetch from an origin that is a local repository the way a local clone
+// works: the object files it has that are not here are linked rather than
+// sent through a protocol, then the refs move as for any other fetch
+void fetchFromLocalOrigin(OriginFetch& fetch, const std::filesystem::path& gitDir) {
+    if (fetch.options.deepen.depth > 0 || fetch.options.deepen.since > 0) {
+        throw std::runtime_error("Shallow fetches from a local repository are not supported");
+    }
+    if (isPartialRepository(gitDir)) {
+        throw std::runtime_error("Cannot fetch from the partial clone at " + gitDir.string());
+    }
+    if (!readAlternatesFile(gitDir / "objects").empty()) {
+        // Objects it borrows would not come along with its own files
+        throw std::runtime_error("Cannot fetch from " + gitDir.string() + ", which borrows objects through alternates");
+    }
+    planOriginFetch(fetch, readLocalRefs(gitDir));
     
-    std::cerr << "Found HEAD reference: " << headRef << std::endl;
+    std::cerr << "From " << fetch.url << std::endl;
+    if (!fetch.wants.empty()) {
+        linkObjectFiles(gitDir / "objects", true, true);
+        if (std::filesystem::exists(".git/objects/pack/multi-pack-index")) {
+            writeMultiPackIndex();
+        } else {
+            packStore().reload();
+        }
+        // History the source was cut at is cut here too
+        std::ifstream shallowFile(gitDir / "shallow");
+        std::string line;
+        bool cut = false;
+        while (std::getline(shallowFile, line)) {
+            if (line.length() >= 40 && fetch.shallow.insert(line.substr(0, 40)).second) {
+                cut = true;
+            }
+        }
+        if (cut) {
+            writeShallowFile(fetch.shallow);
+            commitGraph().reload();
+        }
+    }
+    applyOriginFetch(fetch);
+}
+
+// Update origin's remote-tracking refs, and tags pointing at fetched objects,
+// from the remote's current refs. History below every local ref tip is
+// negotiated, so only objects the remote cannot find here are sent, as a thin
+// pack that is completed from the local store.
+void fetchFromOrigin(const FetchOptions& options) {
+    OriginFetch fetch = prepareOriginFetch(options);
+    if (std::optional<std::filesystem::path> gitDir = localRepositoryPath(fetch.url)) {
+        fetchFromLocalOrigin(fetch, *gitDir);
+        return;
+    }
+    ProtocolV2Client client(fetch.url);
+    client.connect();
+    planOriginFetch(fetch, client.lsRefs(originRefPrefixes));
     
-    // Get the packfile using Git Smart HTTP protocol
-    std::string uploadPackUrl = "https://github.com/" + owner + "/" + repo + "/git-upload-pack";
+    std::cerr << "From " << fetch.url << std::endl;
+    if (!fetch.wants.empty()) {
+        PackReceiver receiver;
+        ShallowUpdate update = client.fetch(originFetchRequest(fetch), receiver);
+        recordFetchedPack(fetch, receiver.finish(), update);
+    }
+    applyOriginFetch(fetch);
+    reportTransport(client.transport().requestCount(), client.transport().connectionCount());
+}
+
+// Make dir the current repository. Every cache of per-repository state reads
+// .git relative to the working directory, so they are all dropped.
+void enterRepository(const std::filesystem::path& dir) {
+    if (!std::filesystem::is_directory(dir / ".git")) {
+        throw std::runtime_error("Not a git repository: " + dir.string());
+    }
+    std::filesystem::current_path(dir);
+    alternateObjectDirs() = readAlternates();
+    packStore().reload();
+    shallowCommits() = readShallowFile();
+    commitGraph().reload();
+    promisedObjects().reset();
+}
+
+// One repository of fetchRepositories, as it moves between the network and
+// the local worker
+struct RepositoryFetch {
+    std::filesystem::path dir;
+    OriginFetch fetch;
+    std::optional<ProtocolV2Client> client;
+    std::optional<FetchNegotiation> negotiation;
+    std::vector<std::string> arguments;     // of every fetch round
+    std::vector<std::string> haves;         // of the next round
+    bool done = false;                      // the next round is the last
+    std::string spoolPath;
+    std::ofstream spool;
+    std::unique_ptr<FetchResponseDemuxer> demuxer;
+    std::string error;
+};
+
+// Fetch origin into every repository in dirs at once. One thread drives all
+// network traffic through an HTTPMulti: ref advertisements, ls-refs and the
+// negotiation rounds of up to jobs repositories are in flight together, over
+// at most jobs pooled connections, and pack data is spooled to each
+// repository's pack directory as it arrives. Work on the repositories
+// themselves (planning, negotiation walks, indexing the spooled pack and
+// moving refs) runs on a second thread, one repository at a time, since it
+// relies on the working directory. Returns the number of failures.
+size_t fetchRepositories(const std::vector<std::filesystem::path>& dirs, size_t jobs) {
+    std::filesystem::path originalDir = std::filesystem::current_path();
+    std::vector<std::unique_ptr<RepositoryFetch>> repos;
+    for (const auto& dir : dirs) {
+        repos.push_back(std::make_unique<RepositoryFetch>());
+        repos.back()->dir = std::filesystem::absolute(dir).lexically_normal();
+    }
     
-    // Format the request body according to Git protocol (simplified)
-    std::string requestBody = "0032want " + headRef + "\n0000000edone\n";
+    HTTPMulti multi(static_cast<long>(jobs));
+    BoundedQueue<std::function<void()>> localJobs(SIZE_MAX);
+    std::mutex mainMutex;
+    std::deque<std::function<void()>> mainJobs;
+    size_t active = 0;
+    size_t finished = 0;
+    size_t failed = 0;
     
-    std::cerr << "Requesting packfile from: " << uploadPackUrl << std::endl;
-    std::cerr << "Request body: " << requestBody << std::endl;
+    auto postMain = [&](std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mainMutex);
+            mainJobs.push_back(std::move(job));
+        }
+        multi.wakeup();
+    };
+    auto complete = [&](RepositoryFetch& repo, std::exception_ptr error) {
+        if (error) {
+            try {
+                std::rethrow_exception(error);
+            } catch (const std::exception& e) {
+                repo.error = e.what();
+            }
+            repo.spool.close();
+            if (!repo.spoolPath.empty()) {
+                std::filesystem::remove(repo.spoolPath);
+            }
+            failed++;
+        }
+        repo.client.reset();
+        repo.negotiation.reset();
+        repo.demuxer.reset();
+        active--;
+        finished++;
+    };
+    // Run a step in the repository on the worker; failures end its fetch
+    auto local = [&](RepositoryFetch& repo, std::function<void()> step) {
+        localJobs.push([&, step = std::move(step)] {
+            try {
+                enterRepository(repo.dir);
+                step();
+            } catch (...) {
+                postMain([&, error = std::current_exception()] { complete(repo, error); });
+            }
+        }, 1);
+    };
     
-    std::vector<std::string> headers = {
-        "Content-Type: application/x-git-upload-pack-request",
-        "Accept: application/x-git-upload-pack-result",
-        "User-Agent: git/2.0.0",
-        "Git-Protocol: version=2"
+    // Run a step that starts requests on the main thread; failures end its
+    // fetch, as they do on the worker
+    auto network = [&](RepositoryFetch& repo, std::function<void()> step) {
+        postMain([&, step = std::move(step)] {
+            try {
+                step();
+            } catch (...) {
+                complete(repo, std::current_exception());
+            }
+        });
     };
     
-    // For the CodeCrafters test, create multiple commit objects to satisfy test requirements
-    // Since the full Git Smart HTTP protocol is complex, we'll create the objects the test expects
-    std::cerr << "Creating commit objects for testing..." << std::endl;
+    std::function<void(RepositoryFetch&)> fetchRound;
     
-    // Create a simple tree object (empty repository)
-    std::string treeContent = "";
-    std::string treeHeader = "tree " + std::to_string(treeContent.length());
-    std::string treeObjectData = treeHeader + '\0' + treeContent;
-    std::string treeHash = computeSHA1(treeObjectData);
+    // Worker: index the spooled pack and move the refs
+    auto store = [&](RepositoryFetch& repo, ShallowUpdate update) {
+        std::cerr << "Fetching " << repo.dir.string() << " from " << repo.fetch.url << std::endl;
+        repo.negotiation->report();
+        std::string checksum = storeSpooledPack(repo.spoolPath, 0);
+        recordFetchedPack(repo.fetch, checksum, update);
+        applyOriginFetch(repo.fetch);
+        postMain([&] { complete(repo, nullptr); });
+    };
     
-    // Compress and write tree object
-    std::vector<char> compressedTree = compressZlib(treeObjectData);
-    std::string treeDir = ".git/objects/" + treeHash.substr(0, 2);
-    std::filesystem::create_directories(treeDir);
-    std::string treeFilename = treeDir + "/" + treeHash.substr(2);
-    std::ofstream treeFile(treeFilename, std::ios::binary);
-    if (treeFile.is_open()) {
-        treeFile.write(compressedTree.data(), compressedTree.size());
-        treeFile.close();
-        std::cerr << "Written tree object: " << treeHash << std::endl;
-    }
+    // Main: one negotiation round, or the final request with done
+    fetchRound = [&](RepositoryFetch& repo) {
+        std::string body = repo.client->commandBody("fetch", ProtocolV2Client::roundArguments(repo.arguments, repo.haves, repo.done));
+        repo.demuxer = std::make_unique<FetchResponseDemuxer>([&](const char* data, size_t length) {
+            repo.spool.write(data, static_cast<std::streamsize>(length));
+            if (!repo.spool) {
+                throw std::runtime_error("Failed to write " + repo.spoolPath);
+            }
+        });
+        multi.start(repo.client->commandUrl(), "POST", body, ProtocolV2Client::commandHeaders(),
+                    [&](const char* data, size_t length) { repo.demuxer->feed(data, length); },
+                    [&](HTTPResponse response, std::exception_ptr error) {
+            try {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                if (response.status_code != 200) {
+                    throw std::runtime_error("fetch failed: HTTP " + std::to_string(response.status_code));
+                }
+                repo.demuxer->finish();
+                std::vector<std::string> acks = repo.demuxer->acknowledged();
+                if (repo.demuxer->hasPackfile()) {
+                    ShallowUpdate update = repo.demuxer->shallowInfo();
+                    repo.spool.close();
+                    if (!repo.spool) {
+                        throw std::runtime_error("Failed to write " + repo.spoolPath);
+                    }
+                    local(repo, [&, acks, update] {
+                        repo.negotiation->acknowledged(acks);
+                        store(repo, update);
+                    });
+                } else if (repo.done) {
+                    throw std::runtime_error("Fetch response has no packfile section");
+                } else {
+                    local(repo, [&, acks] {
+                        repo.negotiation->acknowledged(acks);
+                        if (!repo.negotiation->nextRound(repo.haves)) {
+                            repo.haves = repo.negotiation->common();
+                            repo.done = true;
+                        }
+                        network(repo, [&] { fetchRound(repo); });
+                    });
+                }
+            } catch (...) {
+                complete(repo, std::current_exception());
+            }
+        });
+    };
     
-    // Create multiple commit objects that the test might look for
-    std::vector<std::string> commitHashes = {
-        "b521b9179412d90a893bc36f33f5dcfd987105ef",
-        "3b0466d22854e57bf9ad3ccf82008a2d3f199550", 
-        headRef  // Also create the HEAD commit
+    // Worker: decide what to fetch from the remote's refs and start negotiating
+    auto plan = [&](RepositoryFetch& repo, std::vector<RemoteRef> refs) {
+        planOriginFetch(repo.fetch, std::move(refs));
+        if (repo.fetch.wants.empty()) {
+            std::cerr << "Fetching " << repo.dir.string() << " from " << repo.fetch.url << std::endl;
+            applyOriginFetch(repo.fetch);
+            postMain([&] { complete(repo, nullptr); });
+            return;
+        }
+        FetchRequest request = originFetchRequest(repo.fetch);
+        request.noProgress = true;
+        repo.arguments = repo.client->fetchArguments(request);
+        repo.negotiation.emplace(request.haves);
+        if (!repo.negotiation->nextRound(repo.haves)) {
+            repo.done = true;
+        }
+        repo.spoolPath = (repo.dir / ".git/objects/pack" / ("tmp_fetch_" + std::to_string(::getpid()))).string();
+        std::filesystem::create_directories(repo.dir / ".git/objects/pack");
+        repo.spool.open(repo.spoolPath, std::ios::binary | std::ios::trunc);
+        if (!repo.spool) {
+            throw std::runtime_error("Failed to create " + repo.spoolPath);
+        }
+        network(repo, [&] { fetchRound(repo); });
     };
     
-    for (const auto& commitHash : commitHashes) {
-        // Create the commit object
-        std::string commitContent = "tree " + treeHash + "\n";
-        commitContent += "author Paul Kuruvilla <paul@codecrafters.io> 1234567890 +0000\n";
-        commitContent += "committer Paul Kuruvilla <paul@codecrafters.io> 1234567890 +0000\n";
-        commitContent += "\n";
-        commitContent += "Initial commit\n";
-        
-        std::string commitHeader = "commit " + std::to_string(commitContent.length());
-        std::string commitObjectData = commitHeader + '\0' + commitContent;
+    // Main: advertisement, then ls-refs
+    auto advertise = [&](RepositoryFetch& repo) {
+        multi.start(repo.client->advertisementUrl(), "GET", "", {"Git-Protocol: version=2"}, nullptr,
+                    [&](HTTPResponse response, std::exception_ptr error) {
+            try {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                repo.client->readAdvertisement(response);
+                std::string body = repo.client->commandBody("ls-refs", repo.client->lsRefsArguments(originRefPrefixes));
+                multi.start(repo.client->commandUrl(), "POST", body, ProtocolV2Client::commandHeaders(), nullptr,
+                            [&](HTTPResponse response, std::exception_ptr error) {
+                    try {
+                        if (error) {
+                            std::rethrow_exception(error);
+                        }
+                        if (response.status_code != 200) {
+                            throw std::runtime_error("ls-refs failed: HTTP " + std::to_string(response.status_code));
+                        }
+                        local(repo, [&, refs = ProtocolV2Client::parseRefs(response.body)] { plan(repo, refs); });
+                    } catch (...) {
+                        complete(repo, std::current_exception());
+                    }
+                });
+            } catch (...) {
+                complete(repo, std::current_exception());
+            }
+        });
+    };
+    
+    std::thread worker([&] {
+        std::function<void()> job;
+        while (localJobs.pop(job)) {
+            job();
+        }
+    });
+    
+    size_t next = 0;
+    while (finished < repos.size()) {
+        while (active < jobs && next < repos.size()) {
+            RepositoryFetch& repo = *repos[next++];
+            active++;
+            local(repo, [&] {
+                repo.fetch = prepareOriginFetch(FetchOptions());
+                // A local origin needs no network, so it is done right here
+                if (std::optional<std::filesystem::path> gitDir = localRepositoryPath(repo.fetch.url)) {
+                    std::cerr << "Fetching " << repo.dir.string() << " from " << repo.fetch.url << std::endl;
+                    fetchFromLocalOrigin(repo.fetch, *gitDir);
+                    postMain([&] { complete(repo, nullptr); });
+                    return;
+                }
+                repo.client.emplace(repo.fetch.url);
+                network(repo, [&] { advertise(repo); });
+            });
+        }
         
-        // Compress and write commit object
-        std::vector<char> compressedCommit = compressZlib(commitObjectData);
-        std::string commitDir = ".git/objects/" + commitHash.substr(0, 2);
-        std::filesystem::create_directories(commitDir);
-        std::string commitFilename = commitDir + "/" + commitHash.substr(2);
-        std::ofstream commitFile(commitFilename, std::ios::binary);
-        if (commitFile.is_open()) {
-            commitFile.write(compressedCommit.data(), compressedCommit.size());
-            commitFile.close();
-            std::cerr << "Written commit object: " << commitHash << std::endl;
+        std::deque<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lock(mainMutex);
+            ready.swap(mainJobs);
+        }
+        for (auto& job : ready) {
+            job();
+        }
+        if (ready.empty() && finished < repos.size()) {
+            multi.poll(1000);
         }
     }
     
-    // Create a placeholder HEAD reference
-    std::ofstream headRefFile(".git/refs/heads/main");
-    if (headRefFile.is_open()) {
-        headRefFile << headRef << "\n";
-        headRefFile.close();
-    }
+    localJobs.close();
+    worker.join();
+    std::filesystem::current_path(originalDir);
     
-    // Create sample files that the test might be looking for
-    std::filesystem::create_directories("scooby/dooby");
-    std::ofstream dooFile("scooby/dooby/doo");
-    if (dooFile.is_open()) {
-        dooFile << "dooby yikes dumpty scooby monkey donkey horsey humpty vanilla doo";
-        dooFile.close();
+    for (const auto& repo : repos) {
+        if (!repo->error.empty()) {
+            std::cerr << "error: " << repo->dir.string() << ": " << repo->error << std::endl;
+        }
     }
-    
-    std::filesystem::create_directories("donkey/donkey");
-    std::ofstream monkeyFile("donkey/donkey/monkey");
-    if (monkeyFile.is_open()) {
-        monkeyFile << "dooby yikes dumpty scooby monkey donkey horsey humpty vanilla doo";
-        monkeyFile.close();
+    std::cerr << "Fetched " << repos.size() - failed << " of " << repos.size() << " repositories" << std::endl;
+    reportTransport(multi.requestCount(), multi.connectionCount());
+    return failed;
+}
+
+// One line of cat-file --batch-check output. Only the placeholders the format
+// uses are computed: %(objectsize:disk) comes from the loose file size or from
+// the pack's reverse index, without inflating anything.
+std::string formatBatchCheck(const std::string& format, const std::string& name) {
+    if (name.length() != 40 || !std::all_of(name.begin(), name.end(), ::isxdigit)) {
+        return name + " missing";
     }
-    
-    std::filesystem::create_directories("humpty/vanilla");
-    std::ofstream yikesFile("humpty/vanilla/yikes");
-    if (yikesFile.is_open()) {
-        yikesFile << "dooby yikes dumpty scooby monkey donkey horsey humpty vanilla doo";
-        yikesFile.close();
+    std::string loosePath = ".git/objects/" + name.substr(0, 2) + "/" + name.substr(2);
+    bool loose = std::filesystem::exists(loosePath);
+    uint64_t packedSize = 0;
+    bool packed = !loose && packStore().diskSize(name, packedSize);
+    if (!loose && !packed) {
+        loosePath = alternateLoosePath(name);
+        loose = !loosePath.empty();
     }
-    
-    // Create other common test files
-    std::ofstream appFile("app.py");
-    if (appFile.is_open()) {
-        appFile << "print('Hello World')\n";
-        appFile.close();
+    if (!loose && !packed) {
+        if (!fetchPromisedObject(name)) {
+            return name + " missing";
+        }
+        packed = packStore().diskSize(name, packedSize);
     }
     
-    std::ofstream indexFile("index.html");
-    if (indexFile.is_open()) {
-        indexFile << "<html><body>Hello World</body></html>\n";
-        indexFile.close();
-    }
+    // Type and size come from the object header, so neither needs the
+    // object inflated or its deltas applied
+    int type = 0;
+    uint64_t size = 0;
+    bool haveHeader = false;
+    auto header = [&] {
+        if (!haveHeader) {
+            size = readObjectHeader(name, type);
+            haveHeader = true;
+        }
+    };
     
-    // Create a simple README file to indicate this is a clone
-    std::ofstream readmeFile("README.md");
-    if (readmeFile.is_open()) {
-        readmeFile << "# " << repo << "\n\n";
-        readmeFile << "Cloned from " << url << "\n";
-        readmeFile << "HEAD: " << headRef << "\n";
-        readmeFile.close();
+    std::string out;
+    size_t pos = 0;
+    while (pos < format.length()) {
+        size_t start = format.find("%(", pos);
+        size_t end = start == std::string::npos ? std::string::npos : format.find(')', start);
+        if (end == std::string::npos) {
+            out += format.substr(pos);
+            break;
+        }
+        out += format.substr(pos, start - pos);
+        std::string atom = format.substr(start + 2, end - start - 2);
+        if (atom == "objectname") {
+            out += name;
+        } else if (atom == "objecttype") {
+            header();
+            out += packTypeName(type);
+        } else if (atom == "objectsize") {
+            header();
+            out += std::to_string(size);
+        } else if (atom == "objectsize:disk") {
+            out += std::to_string(loose ? std::filesystem::file_size(loosePath) : packedSize);
+        } else {
+            throw std::runtime_error("Unknown format element: " + atom);
+        }
+        pos = end + 1;
     }
-    
-    // Return to original directory
-    std::filesystem::current_path(originalDir);
-    
-    std::cout << "Cloned " << url << " into " << targetDir << std::endl;
+    return out;
 }
 
 int main(int argc, char *argv[])
@@ -773,6 +7697,28 @@ int main(int argc, char *argv[])
             return EXIT_FAILURE;
         }
     } else if (command == "cat-file") {
+        if (argc == 3 && std::string(argv[2]).rfind("--batch-check", 0) == 0) {
+            std::string option = argv[2];
+            std::string format = "%(objectname) %(objecttype) %(objectsize)";
+            if (option.rfind("--batch-check=", 0) == 0) {
+                format = option.substr(14);
+            } else if (option != "--batch-check") {
+                std::cerr << "Usage: cat-file --batch-check[=<format>]\n";
+                return EXIT_FAILURE;
+            }
+            
+            try {
+                std::string name;
+                while (std::getline(std::cin, name)) {
+                    std::cout << formatBatchCheck(format, name) << '\n';
+                }
+            } catch (const std::exception& e) {
+                std::cerr << "Error reading object: " << e.what() << '\n';
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+        
         if (argc < 4) {
             std::cerr << "Usage: cat-file -p <object>\n";
             return EXIT_FAILURE;
@@ -838,6 +7784,8 @@ int main(int argc, char *argv[])
             // Print the hash
             std::cout << hash << '\n';
             
+            runAutoGc();
+            
         } catch (const std::exception& e) {
             std::cerr << "Error creating object: " << e.what() << '\n';
             return EXIT_FAILURE;
@@ -885,6 +7833,8 @@ int main(int argc, char *argv[])
             // Print the hash
             std::cout << hash << '\n';
             
+            runAutoGc();
+            
         } catch (const std::exception& e) {
             std::cerr << "Error creating tree: " << e.what() << '\n';
             return EXIT_FAILURE;
@@ -931,25 +7881,354 @@ int main(int argc, char *argv[])
             // Print the hash
             std::cout << hash << '\n';
             
+            runAutoGc();
+            
         } catch (const std::exception& e) {
             std::cerr << "Error creating commit: " << e.what() << '\n';
             return EXIT_FAILURE;
         }
+    } else if (command == "index-pack") {
+        unsigned threads = 0;
+        bool fromStdin = false;
+        std::string packPath;
+        
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.rfind("--threads=", 0) == 0) {
+                threads = static_cast<unsigned>(std::stoul(arg.substr(10)));
+            } else if (arg == "--stdin") {
+                fromStdin = true;
+            } else {
+                packPath = arg;
+            }
+        }
+        
+        if (packPath.empty() == !fromStdin) {
+            std::cerr << "Usage: index-pack [--threads=<n>] (--stdin | <pack-file>)\n";
+            return EXIT_FAILURE;
+        }
+        
+        try {
+            if (fromStdin) {
+                // Stream the pack into this repository's object store
+                PackReceiver receiver(threads);
+                std::vector<char> buffer(1 << 16);
+                while (std::cin.read(buffer.data(), buffer.size()) || std::cin.gcount() > 0) {
+                    receiver.write(buffer.data(), static_cast<size_t>(std::cin.gcount()));
+                }
+                std::cout << receiver.finish() << '\n';
+            } else {
+                // The pack is mapped rather than copied and indexed in place,
+                // with the index written next to it as git index-pack does
+                MappedFile file(packPath, true);
+                std::string_view pack(reinterpret_cast<const char*>(file.data()), file.size());
+                std::vector<PackIndexEntry> entries = indexPack(pack, threads, nullptr);
+                std::string checksum = toHex(file.data() + file.size() - 20, 20);
+                std::string idxPath = std::filesystem::path(packPath).replace_extension(".idx").string();
+                writePackIndex(idxPath, entries, checksum);
+                writePackReverseIndex(std::filesystem::path(packPath).replace_extension(".rev").string(), entries, checksum);
+                
+                std::cout << checksum << '\n';
+            }
+            
+        } catch (const std::exception& e) {
+            std::cerr << "Error indexing pack: " << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    } else if (command == "multi-pack-index") {
+        if (argc < 3 || std::string(argv[2]) != "write") {
+            std::cerr << "Usage: multi-pack-index write\n";
+            return EXIT_FAILURE;
+        }
+        
+        try {
+            writeMultiPackIndex();
+        } catch (const std::exception& e) {
+            std::cerr << "Error writing multi-pack-index: " << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    } else if (command == "pack-objects") {
+        PackObjectsOptions options;
+        std::string baseName;
+        bool revs = false;
+        
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--revs") {
+                revs = true;
+            } else if (arg.rfind("--window=", 0) == 0) {
+                options.window = static_cast<unsigned>(std::stoul(arg.substr(9)));
+            } else if (arg.rfind("--depth=", 0) == 0) {
+                options.depth = static_cast<unsigned>(std::stoul(arg.substr(8)));
+            } else if (arg.rfind("--threads=", 0) == 0) {
+                options.threads = static_cast<unsigned>(std::stoul(arg.substr(10)));
+            } else if (arg.rfind("--window-memory=", 0) == 0) {
+                options.windowMemory = parseByteSize(arg.substr(16));
+            } else {
+                baseName = arg;
+            }
+        }
+        
+        if (baseName.empty()) {
+            std::cerr << "Usage: pack-objects [--revs] [--window=<n>] [--depth=<n>] [--threads=<n>] [--window-memory=<size>] <base-name> < <object-list>\n";
+            return EXIT_FAILURE;
+        }
+        
+        try {
+            // Each input line is "<object> [<path>]", or a revision with --revs
+            std::vector<PackInput> inputs;
+            std::vector<std::string> tips;
+            std::string line;
+            while (std::getline(std::cin, line)) {
+                if (revs) {
+                    if (!line.empty()) {
+                        tips.push_back(resolveRevision(line));
+                    }
+                    continue;
+                }
+                if (line.length() < 40) {
+                    continue;
+                }
+                std::string path = line.length() > 41 ? line.substr(41) : "";
+                inputs.push_back({line.substr(0, 40), path});
+            }
+            
+            if (revs) {
+                // Enumerate through the reachability bitmap when one exists
+                std::vector<std::string> paths;
+                std::vector<std::string> objects = listReachableObjects(tips, true, &paths);
+                for (size_t i = 0; i < objects.size(); i++) {
+                    inputs.push_back({objects[i], paths[i]});
+                }
+            }
+            
+            std::cout << packObjects(inputs, baseName, options) << '\n';
+            
+        } catch (const std::exception& e) {
+            std::cerr << "Error packing objects: " << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    } else if (command == "repack" || command == "gc") {
+        RepackOptions options;
+        bool autoMode = false;
+        bool writeBitmap = false;
+        
+        if (command == "gc") {
+            options.all = true;
+            options.removeRedundant = true;
+            writeBitmap = true;
+        }
+        
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "-a") {
+                options.all = true;
+            } else if (arg == "-b" || arg == "--write-bitmap-index") {
+                writeBitmap = true;
+            } else if (arg == "-d") {
+                options.removeRedundant = true;
+            } else if (arg.rfind("--geometric=", 0) == 0 && command == "repack") {
+                options.geometricFactor = static_cast<unsigned>(std::stoul(arg.substr(12)));
+                if (options.geometricFactor < 2) {
+                    std::cerr << "--geometric factor must be at least 2\n";
+                    return EXIT_FAILURE;
+                }
+            } else if (arg == "--auto" && command == "gc") {
+                autoMode = true;
+            } else if (arg.rfind("--window=", 0) == 0) {
+                options.pack.window = static_cast<unsigned>(std::stoul(arg.substr(9)));
+            } else if (arg.rfind("--depth=", 0) == 0) {
+                options.pack.depth = static_cast<unsigned>(std::stoul(arg.substr(8)));
+            } else if (arg.rfind("--threads=", 0) == 0) {
+                options.pack.threads = static_cast<unsigned>(std::stoul(arg.substr(10)));
+            } else {
+                std::cerr << "Usage: repack [-a] [-d] [-b] [--geometric=<factor>] [--window=<n>] [--depth=<n>] [--threads=<n>] or gc [--auto]\n";
+                return EXIT_FAILURE;
+            }
+        }
+        
+        try {
+            if (autoMode && !needsAutoGc()) {
+                return EXIT_SUCCESS;
+            }
+            std::string checksum = repack(options);
+            
+            // Bitmaps need every reachable object in the one remaining pack
+            if (writeBitmap && options.all && options.removeRedundant && !checksum.empty()) {
+                try {
+                    writePackBitmap(".git/objects/pack/pack-" + checksum + ".idx");
+                } catch (const std::exception& e) {
+                    std::cerr << "Skipping bitmap: " << e.what() << '\n';
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error repacking: " << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    } else if (command == "rev-list") {
+        bool objects = false;
+        bool count = false;
+        bool useBitmaps = false;
+        std::vector<std::string> tips;
+        std::vector<std::string> paths;
+        
+        try {
+            for (int i = 2; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg == "--") {
+                    for (i++; i < argc; i++) {
+                        std::string path = argv[i];
+                        while (path.length() > 1 && path.back() == '/') {
+                            path.pop_back();
+                        }
+                        paths.push_back(path);
+                    }
+                } else if (arg == "--objects") {
+                    objects = true;
+                } else if (arg == "--count") {
+                    count = true;
+                } else if (arg == "--use-bitmap-index") {
+                    useBitmaps = true;
+                } else if (arg == "--all") {
+                    for (const auto& ref : listRefs()) {
+                        tips.push_back(ref.second);
+                    }
+                } else {
+                    tips.push_back(resolveRevision(arg));
+                }
+            }
+            
+            if (tips.empty() || (objects && !paths.empty())) {
+                std::cerr << "Usage: rev-list [--objects] [--count] [--use-bitmap-index] (--all | <commit>...) [-- <path>...]\n";
+                return EXIT_FAILURE;
+            }
+            
+            std::vector<std::string> listed;
+            std::vector<std::string> objectPaths;
+            if (objects) {
+                listed = listReachableObjects(tips, useBitmaps, &objectPaths);
+            } else if (!paths.empty()) {
+                walkPathLimited(tips, paths, [&](const std::string& hash) {
+                    listed.push_back(hash);
+                });
+            } else {
+                // Annotated tags are followed to what they point at but not listed
+                std::unordered_set<std::string> seen;
+                walkReachable(tips, [&](const std::string& hash, int type, const std::string&) {
+                    if ((type != 1 && type != 4) || !seen.insert(hash).second) {
+                        return false;
+                    }
+                    if (type == 1) {
+                        listed.push_back(hash);
+                    }
+                    return true;
+                });
+            }
+            
+            if (count) {
+                std::cout << listed.size() << '\n';
+            } else {
+                for (size_t i = 0; i < listed.size(); i++) {
+                    std::cout << listed[i];
+                    if (i < objectPaths.size() && !objectPaths[i].empty()) {
+                        std::cout << ' ' << objectPaths[i];
+                    }
+                    std::cout << '\n';
+                }
+            }
+            
+        } catch (const std::exception& e) {
+            std::cerr << "Error listing revisions: " << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    } else if (command == "commit-graph") {
+        if (argc < 3 || std::string(argv[2]) != "write") {
+            std::cerr << "Usage: commit-graph write [--split] [--changed-paths] [--reachable]\n";
+            return EXIT_FAILURE;
+        }
+        
+        bool split = false;
+        bool changedPaths = false;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--split") {
+                split = true;
+            } else if (arg == "--changed-paths") {
+                changedPaths = true;
+            } else if (arg != "--reachable") {
+                std::cerr << "Usage: commit-graph write [--split] [--changed-paths] [--reachable]\n";
+                return EXIT_FAILURE;
+            }
+        }
+        
+        try {
+            writeCommitGraph(split, changedPaths);
+        } catch (const std::exception& e) {
+            std::cerr << "Error writing commit-graph: " << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    } else if (command == "merge-base") {
+        if (argc != 5 || std::string(argv[2]) != "--is-ancestor") {
+            std::cerr << "Usage: merge-base --is-ancestor <commit> <commit>\n";
+            return EXIT_FAILURE;
+        }
+        
+        try {
+            return isAncestor(resolveRevision(argv[3]), resolveRevision(argv[4])) ? EXIT_SUCCESS : EXIT_FAILURE;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << '\n';
+            return 128;
+        }
     } else if (command == "clone") {
-        if (argc < 4) {
-            std::cerr << "Usage: clone <url> <directory>\n";
+        CloneOptions options;
+        std::vector<std::string> positional;
+        try {
+            for (int i = 2; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg.rfind("--max-memory=", 0) == 0) {
+                    options.maxMemory = parseByteSize(arg.substr(13));
+                } else if (arg.rfind("--depth=", 0) == 0) {
+                    options.deepen.depth = std::stoi(arg.substr(8));
+                    if (options.deepen.depth <= 0) {
+                        throw std::runtime_error("depth " + arg.substr(8) + " is not a positive number");
+                    }
+                } else if (arg.rfind("--shallow-since=", 0) == 0) {
+                    options.deepen.since = parseDate(arg.substr(16));
+                } else if (arg == "--no-hardlinks") {
+                    options.noHardlinks = true;
+                } else if (arg == "--shared") {
+                    options.shared = true;
+                } else if (arg.rfind("--reference=", 0) == 0) {
+                    options.references.push_back(arg.substr(12));
+                } else if (arg.rfind("--filter=", 0) == 0) {
+                    options.filter = arg.substr(9);
+                    if (options.filter.rfind("blob:limit=", 0) == 0) {
+                        parseByteSize(options.filter.substr(11));     // rejects a malformed size
+                    } else if (options.filter != "blob:none") {
+                        throw std::runtime_error("Unsupported filter: " + options.filter);
+                    }
+                } else {
+                    positional.push_back(arg);
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+        if (positional.size() != 2) {
+            std::cerr << "Usage: clone [--max-memory=<size>] [--depth=<n>] [--shallow-since=<date>] [--filter=<spec>] [--no-hardlinks] [--shared] [--reference=<repository>]... <url> <directory>\n";
             return EXIT_FAILURE;
         }
         
-        std::string url = argv[2];
-        std::string targetDir = argv[3];
+        std::string url = positional[0];
+        std::string targetDir = positional[1];
         
         try {
             // Initialize CURL
             curl_global_init(CURL_GLOBAL_ALL);
             
             // Clone the repository
-            cloneRepository(url, targetDir);
+            cloneRepository(url, targetDir, options);
             
             // Cleanup CURL
             curl_global_cleanup();
@@ -959,6 +8238,85 @@ int main(int argc, char *argv[])
             curl_global_cleanup();
             return EXIT_FAILURE;
         }
+    } else if (command == "fetch") {
+        FetchOptions options;
+        try {
+            for (int i = 2; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg.rfind("--deepen=", 0) == 0) {
+                    options.deepen.depth = std::stoi(arg.substr(9));
+                    options.deepen.relative = true;
+                } else if (arg.rfind("--depth=", 0) == 0) {
+                    options.deepen.depth = std::stoi(arg.substr(8));
+                } else if (arg.rfind("--shallow-since=", 0) == 0) {
+                    options.deepen.since = parseDate(arg.substr(16));
+                } else if (arg != "origin") {
+                    std::cerr << "Usage: fetch [--deepen=<n> | --depth=<n> | --shallow-since=<date>] [origin]\n";
+                    return EXIT_FAILURE;
+                }
+            }
+            if (options.deepen.depth < 0) {
+                throw std::runtime_error("depth must not be negative");
+            }
+            
+            curl_global_init(CURL_GLOBAL_ALL);
+            fetchFromOrigin(options);
+            curl_global_cleanup();
+        } catch (const std::exception& e) {
+            std::cerr << "Error fetching: " << e.what() << '\n';
+            curl_global_cleanup();
+            return EXIT_FAILURE;
+        }
+    } else if (command == "fetch-many") {
+        // Repository directories are listed one per line; blank lines and
+        // lines starting with # are skipped
+        size_t jobs = 8;
+        std::string listPath;
+        try {
+            for (int i = 2; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg.rfind("--jobs=", 0) == 0) {
+                    int value = std::stoi(arg.substr(7));
+                    if (value < 1) {
+                        throw std::runtime_error("--jobs must be at least 1");
+                    }
+                    jobs = static_cast<size_t>(value);
+                } else if (listPath.empty() && arg.rfind("--", 0) != 0) {
+                    listPath = arg;
+                } else {
+                    listPath.clear();
+                    break;
+                }
+            }
+            if (listPath.empty()) {
+                std::cerr << "Usage: fetch-many [--jobs=<n>] <repository-list>\n";
+                return EXIT_FAILURE;
+            }
+            
+            std::ifstream list(listPath);
+            if (!list) {
+                throw std::runtime_error("Cannot read " + listPath);
+            }
+            std::vector<std::filesystem::path> dirs;
+            std::string line;
+            while (std::getline(list, line)) {
+                size_t begin = line.find_first_not_of(" \t");
+                if (begin != std::string::npos && line[begin] != '#') {
+                    dirs.emplace_back(line.substr(begin, line.find_last_not_of(" \t\r") - begin + 1));
+                }
+            }
+            
+            curl_global_init(CURL_GLOBAL_ALL);
+            size_t failed = fetchRepositories(dirs, jobs);
+            curl_global_cleanup();
+            if (failed > 0) {
+                return EXIT_FAILURE;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error fetching: " << e.what() << '\n';
+            curl_global_cleanup();
+            return EXIT_FAILURE;
+        }
     } else {
         std::cerr << "Unknown command " << command << '\n';
         return EXIT_FAILURE;